@@ -17,8 +17,6 @@
 // Replace this (pid, tid) tupple by something like connection_id
 // Do not call init-deinit msg pages if the caller passes the same memory pointers
 // Use inline messages
-// Figure out better encoding for a handle
-// debugfs
 // Priority inheritance
 // More, more, more tests
 
@@ -35,6 +33,7 @@
 #include <linux/kref.h>
 #include <linux/printk.h>
 #include <linux/miscdevice.h>
+#include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/wait.h>
 #include <linux/spinlock.h>
@@ -42,15 +41,44 @@
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
 #include <linux/delay.h>
+#include <linux/idr.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/stringhash.h>
+#include <linux/genalloc.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#include <linux/sizes.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/eventfd.h>
+#include <linux/uio.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 
 #include "stplr.h"
 
+#define CREATE_TRACE_POINTS
+#include "stplr_trace.h"
+
 //#define STPLR_DEBUG
 
-#define stplr_dbg_at1(args...) do { if (stplr_debug_level >= 1) pr_info(args); } while (0)
-#define stplr_dbg_at2(args...) do { if (stplr_debug_level >= 2) pr_info(args); } while (0)
-#define stplr_dbg_at3(args...) do { if (stplr_debug_level >= 3) pr_info(args); } while (0)
-#define stplr_dbg_at4(args...) do { if (stplr_debug_level >= 4) pr_info(args); } while (0)
+/* debug messages cost a patched out jump unless debug level is raised */
+#define stplr_dbg_at(level, args...) \
+	do { \
+		if (static_branch_unlikely(&stplr_debug_enabled) && stplr_debug_level >= (level)) \
+			pr_info(args); \
+	} while (0)
+
+#define stplr_dbg_at1(args...) stplr_dbg_at(1, args)
+#define stplr_dbg_at2(args...) stplr_dbg_at(2, args)
+#define stplr_dbg_at3(args...) stplr_dbg_at(3, args)
+#define stplr_dbg_at4(args...) stplr_dbg_at(4, args)
 
 #define STPLR_DEVICE_NAME "stplr"
 
@@ -59,10 +87,36 @@
 	__stringify(STPLR_VERSION_MINOR) "." \
 	__stringify(STPLR_VERSION_MICRO)
 
+/* number of buckets (log2) of the per device service names hash table */
+#define STPLR_NAMES_HASH_BITS 10
+
+/* number of buckets (log2) of the per thread hash table of asynchronous senders */
+#define STPLR_CONNECTIONS_HASH_BITS 4
+
+/* initial number of slots in the handle table (doubled whenever it gets full) */
+#define STPLR_HANDLE_TABLE_MIN_SIZE 8
+
+/* receive arena slots are allocated with cache line granularity (log2) */
+#define STPLR_ARENA_SLOT_ORDER 6
+
+/* maximal size of the receive arena which can be mapped by a process */
+#define STPLR_ARENA_MAX_SIZE SZ_64M
+
 #define STPLR_THREAD_SEND_BUFFER 0
 #define STPLR_THREAD_REPLY_BUFFER 1
 #define STPLR_THREAD_NUM_OF_BUFFERS 2
 
+/* max number of queued calls (and posts) of one thread listed in debugfs */
+#define STPLR_DEBUGFS_MAX_QUEUED 32
+
+/* descriptors preallocated in every thread's message buffer (grown on demand) */
+#define STPLR_MSG_BUFFER_PREALLOC_MSGS 4
+#define STPLR_MSG_BUFFER_PREALLOC_PAGES 16
+
+/* storage grown above these limits (by a huge call) is not retained between uses */
+#define STPLR_MSG_BUFFER_RETAIN_MSGS 64
+#define STPLR_MSG_BUFFER_RETAIN_PAGES 256
+
 /* if stplr_process or stplr_thread does not exist, create one */
 #define STPLR_F_CREAT (1U << 0)
 
@@ -74,10 +128,48 @@
 
 /* module's params */
 static int stplr_debug_level = 0; /* do not emmit any traces by default */
-module_param_named(debug, stplr_debug_level, int, 0660);
+static DEFINE_STATIC_KEY_FALSE(stplr_debug_enabled);
+
+static void stplr_debug_level_update(void)
+{
+	if (READ_ONCE(stplr_debug_level) > 0)
+		static_branch_enable(&stplr_debug_enabled);
+	else
+		static_branch_disable(&stplr_debug_enabled);
+}
+
+static int stplr_debug_level_set(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+
+	ret = param_set_int(val, kp);
+	if (ret)
+		return ret;
+
+	stplr_debug_level_update();
+
+	return 0;
+}
+
+static const struct kernel_param_ops stplr_debug_level_ops = {
+	.set = stplr_debug_level_set,
+	.get = param_get_int,
+};
+
+module_param_cb(debug, &stplr_debug_level_ops, &stplr_debug_level, 0660);
 MODULE_PARM_DESC(debug,
 	"Verbosity of debug messages (range: [0(none)-3(max)], default: 0)");
 
+/* default busy poll window (in microseconds) for every device created */
+static unsigned int stplr_busy_poll_us = 0; /* do not busy poll by default */
+module_param_named(busy_poll, stplr_busy_poll_us, uint, 0660);
+MODULE_PARM_DESC(busy_poll,
+	"Default busy poll window in microseconds (default: 0, busy polling disabled), "
+	"may be changed per device by its 'busy_poll' sysfs attribute");
+
+/* upper limit of the busy poll window which can be set for a handle */
+#define STPLR_BUSY_POLL_MAX_US USEC_PER_SEC
+
 /* number of stapler devices created by this module */
 static int stplr_num_of_devices = 1;
 module_param_named(devices, stplr_num_of_devices, int, 0660);
@@ -90,6 +182,14 @@ MODULE_PARM_DESC(devices,
  * @miscdev:		our character device
  * @processes_lock:	protects @processes rb tree
  * @processes:		root of the rb tree of stplr_process'es
+ * @groups_lock:	protects @groups idr and subscribers of every group
+ * @groups:		subscriber groups (struct stplr_subscriber_group) indexed by gid
+ * @names_lock:		serializes modifications of @names hash table
+ * 			(lookups are done under rcu read lock)
+ * @names:		service names (struct stplr_name) hashed by name
+ * @debugfs:		debugfs file showing processes, threads and their queues
+ * @busy_poll_us:	default busy poll window of new handles (in microseconds,
+ * 			'busy_poll' sysfs attribute of the device)
  * @name:
  */
 struct stplr_device {
@@ -97,6 +197,12 @@ struct stplr_device {
 	struct miscdevice miscdev;
 	struct mutex processes_lock;
 	struct rb_root processes;
+	struct mutex groups_lock;
+	struct idr groups;
+	struct mutex names_lock;
+	DECLARE_HASHTABLE(names, STPLR_NAMES_HASH_BITS);
+	struct dentry *debugfs;
+	unsigned int busy_poll_us;
 	char name[];
 };
 
@@ -106,8 +212,22 @@ struct stplr_device {
  * @kref:		reference counter
  * @rb_node:		an element on the 'stplr_device::processes' rb tree
  * @dev:		parent stplr_device
- * @threads_lock:	protects @threads rb tree
+ * @threads_lock:	protects @threads rb tree and modifications of @handles
  * @threads:		root of the rb tree of this process' threads
+ * @siblings:		list of this process' threads (modified under
+ * 			@threads_lock, walked under rcu read lock)
+ * @handles:		table of handles of this process' threads
+ * 			(read under rcu read lock)
+ * @arena:		receive arena mapped by this process (set under
+ * 			@threads_lock, NULL while the process has none mapped,
+ * 			read under rcu read lock)
+ * @tokens_lock:	protects @tokens
+ * @tokens:		reply tokens handed out by this process' receiving threads
+ * 			(each one keeps a reference to its struct stplr_transaction)
+ * @dispatch_seq:	sequence of STPLR_DISPATCH_ROUND_ROBIN dispatching
+ * @stealers_lock:	protects @idle_stealers
+ * @idle_stealers:	threads taking part in work stealing which wait for calls
+ * 			(the most recently idle one first)
  */
 struct stplr_process {
 	pid_t pid;
@@ -116,29 +236,103 @@ struct stplr_process {
 	struct stplr_device *dev;
 	struct mutex threads_lock;
 	struct rb_root threads;
+	struct list_head siblings;
+	struct stplr_handle_table __rcu *handles;
+	struct stplr_arena __rcu *arena;
+	struct mutex tokens_lock;
+	struct idr tokens;
+	atomic_t dispatch_seq;
+	spinlock_t stealers_lock;
+	struct list_head idle_stealers;
+};
+
+/**
+ * struct stplr_arena - per process receive arena
+ * @kref:	reference counter (the process while mapped plus receivers using it)
+ * @rcu:	rcu head used to free the arena
+ * @mappings:	number of vmas mapping the arena
+ * @base:	kernel address of the arena (mapped also into the user space)
+ * @size:	size of the arena
+ * @pool:	allocator of the arena slots
+ * @slots:	sizes of allocated slots, indexed by slot offset
+ * 		(in units of 1 << STPLR_ARENA_SLOT_ORDER bytes)
+ *
+ * Messages received by STPLR_MSG_RECEIVE_ARENA are copied to slots
+ * chosen by the driver, so memory needed by a server scales with the number
+ * of messages being processed rather than with the number of its threads.
+ */
+struct stplr_arena {
+	struct kref kref;
+	struct rcu_head rcu;
+	atomic_t mappings;
+	void *base;
+	size_t size;
+	struct gen_pool *pool;
+	struct xarray slots;
+};
+
+
+/**
+ * struct stplr_handle_slot - one entry of the handle table
+ * @thread:	thread owning the handle (NULL if the slot is free)
+ * @generation:	incremented every time the slot is freed, so that
+ * 		stale handles referring to the slot can be rejected
+ */
+struct stplr_handle_slot {
+	struct stplr_thread *thread;
+	u32 generation;
+};
+
+/**
+ * struct stplr_handle_table - per process table of handles
+ * @rcu:	used to free the table after rcu grace period
+ * @size:	number of elements in the @slots array
+ * @slots:	handle slots
+ *
+ * Handle (struct stplr_handle) encodes slot index in its lower 32 bits
+ * and slot generation in its upper 32 bits. So resolving a handle
+ * is just a bounds check, an array load and a generation comparison.
+ */
+struct stplr_handle_table {
+	struct rcu_head rcu;
+	u32 size;
+	struct stplr_handle_slot slots[];
 };
 
 /**
  * struct stplr_msg_pages - describes user space message pages
  * @nr_pages:	number of pages used by user space message buffer (msgbuf)
  * @pages:	array of page pointers
- * @size:	size of the user space message buffer (buflen)
+ * @size:	size of the user space message buffer (buflen),
+ * 		overwritten with number of actually copied bytes
  * @offset:	offset into the first page
+ * @buflen:	size of the user space message buffer (never overwritten)
+ * @written:	end of the data written by STPLR_MSG_WRITE (reply buffers only)
  * @sgt:	scatter-gather table of user pages
+ * @ubuf:	user space address of the message buffer if its pages are not
+ * 		pinned (see stplr_msg_buffer_init_local()), NULL otherwise
  */
 struct stplr_msg_pages {
 	int nr_pages;
 	struct page **pages;
 	__u32 size;
 	__u32 offset;
+	__u32 buflen;
+	__u32 written;
 	struct sg_table sgt;
+	void __user *ubuf;
 };
 
 /**
  * struct stplr_thread_msg_buffer - thread's message buffer
- * @msgs:	address of the buffer
- * @nmsgs:	number of structs (either 'struct stplr_msg' or
- * 		'struct stplr_msg_pages') stored in the @msgs buffer
+ * @msgs:		address of the buffer
+ * @nmsgs:		number of structs (either 'struct stplr_msg' or
+ * 			'struct stplr_msg_pages') stored in the @msgs buffer
+ * @capacity:		number of structs the @msgs buffer has room for
+ * @pages:		page pointers of all messages
+ * @sgl:		scatterlist entries of all messages
+ * @pages_capacity:	number of entries in both @pages and @sgl
+ * @nr_pages:		number of pages pinned by all @nmsgs messages
  *
  * Thread's message buffer stores @nmsgs 'struct stplr_msg' objects
  * followed by @nmsgs 'struct stplr_msg_pages' objects.
@@ -146,56 +340,608 @@ struct stplr_msg_pages {
  * -------------------------------------------------------------
  * | struct stplr_msg | ... | struct stplr_msg_pages | ... |
  * -------------------------------------------------------------
+ *
+ * The storage is kept when the buffer is deinitialized and grows to
+ * the high-water mark of the number of messages and pinned pages, so that
+ * calls of the usual shape do not allocate at all. Storage above
+ * STPLR_MSG_BUFFER_RETAIN_* is given back once the buffer is not in use.
  */
 struct stplr_thread_msg_buffer {
 	void *msgs;
 	__u32 nmsgs;
+	__u32 capacity;
+	struct page **pages;
+	struct scatterlist *sgl;
+	__u32 pages_capacity;
+	__u32 nr_pages;
+};
+
+/**
+ * struct stplr_thread_load_notify - load notifications of the receiving thread
+ * @high_ctx:	eventfd signalled when the load reaches @high (or NULL)
+ * @low_ctx:	eventfd signalled when the load falls back to @low (or NULL)
+ * @metric:	STPLR_LOAD_QUEUE_DEPTH or STPLR_LOAD_QUEUE_WAIT
+ * @high:	high watermark
+ * @low:	low watermark
+ * @above:	the load has reached @high and has not fallen to @low yet
+ * @timer:	fires once the oldest queued call would have waited for @high
+ * 		(STPLR_LOAD_QUEUE_WAIT)
+ * @expires_ns:	time @timer has been armed for (0 if it is not armed)
+ * @work:	evaluates the load once @timer fires
+ */
+struct stplr_thread_load_notify {
+	struct eventfd_ctx *high_ctx;
+	struct eventfd_ctx *low_ctx;
+	__u32 metric;
+	u64 high;
+	u64 low;
+	bool above;
+	struct hrtimer timer;
+	u64 expires_ns;
+	struct work_struct work;
 };
 
 /**
  * struct stplr_thread_queue - queue of clients for the receiving thread
- * @lock:	spinlock protecting the list
- * @head:	head of the list
+ * @lock:	spinlock protecting all fields below
+ * @head:	head of the list of calls (struct stplr_transaction)
+ * @posts:	head of the list of messages posted to subscriber groups
+ * 		(struct stplr_post_entry)
+ * @ncalls:	number of calls on the @head list (also read locklessly by dispatching)
+ * @bytes:	number of bytes of the calls on the @head list
+ * @max_calls:	limit of @ncalls (STPLR_OPT_QUEUE_MAX_CALLS, 0 if none)
+ * @max_bytes:	limit of @bytes (STPLR_OPT_QUEUE_MAX_BYTES, 0 if none)
+ * @room:	clients waiting for room in the queue (STPLR_OPT_ADMISSION_WAIT)
+ * @notify:	load notifications (STPLR_LOAD_NOTIFY)
+ *
+ * Only the lock, the list heads and the counters are written by every
+ * enqueue and dequeue, the (rarely written) rest starts on a cache line
+ * of its own.
  */
 struct stplr_thread_queue {
 	spinlock_t lock;
 	struct list_head head;
+	struct list_head posts;
+	u32 ncalls;
+	u64 bytes;
+	u32 max_calls ____cacheline_aligned_in_smp;
+	u64 max_bytes;
+	wait_queue_head_t room;
+	struct stplr_thread_load_notify notify;
+};
+
+/**
+ * struct stplr_thread_busy_poll - adaptive busy poll state of the thread
+ * @max_ns:	maximal busy poll window (0 if busy polling is disabled)
+ * @avg_ns:	moving average of observed response times
+ *
+ * The actual busy poll window is twice the average response time
+ * (or @max_ns until the first response is observed). Once the average
+ * response time exceeds half of @max_ns, spinning is not worth the cpu time
+ * and the thread goes to sleep immediately, while still measuring response
+ * times so that it can start spinning again once the peer speeds up.
+ */
+struct stplr_thread_busy_poll {
+	u64 max_ns;
+	u64 avg_ns;
+};
+
+/**
+ * struct stplr_thread_credits - flow control of asynchronous senders
+ * @msgs:		max number of outstanding messages per sending process
+ * 			(0 means no limit)
+ * @bytes:		max number of outstanding bytes per sending process
+ * 			(0 means no limit)
+ * @connections:	sending processes with outstanding messages
+ * 			(struct stplr_connection) hashed by pid
+ * @wait:		wait queue of senders waiting for credits
+ *
+ * All fields (and connections) are protected by stplr_thread_queue::lock.
+ */
+struct stplr_thread_credits {
+	__u32 msgs;
+	__u64 bytes;
+	DECLARE_HASHTABLE(connections, STPLR_CONNECTIONS_HASH_BITS);
+	wait_queue_head_t wait;
+};
+
+/**
+ * struct stplr_thread_counters - cumulative statistics of the thread
+ * @msgs:		number of messages (calls and posts) received
+ * @bytes:		number of bytes received
+ * @pinned_pages:	number of user pages pinned on behalf of the thread
+ * @remote_copies:	number of received messages whose sender's pages
+ * 			reside on a numa node other than the copying cpu
+ * @stolen:		number of calls taken from the queues of siblings
+ *
+ * Written by the owner only, read locklessly (debugfs).
+ */
+struct stplr_thread_counters {
+	u64 msgs;
+	u64 bytes;
+	u64 pinned_pages;
+	u64 remote_copies;
+	u64 stolen;
+};
+
+/**
+ * struct stplr_thread_stats - per cpu histograms of the receiving thread
+ * @histograms:	log2 histograms indexed by STPLR_STATS_* constants
+ */
+struct stplr_thread_stats {
+	struct stplr_stats_histogram histograms[STPLR_STATS_NUM_OF_HISTOGRAMS];
 };
 
 /**
  * struct stplr_thread - groups thread related data structures
  * @tid:		thread id
- * @kref:		reference counter
- * @rb_node:		an element on the 'stplr_process::threads' rb tree
+ * @handle_index:	index of the thread's slot in the process' handle table
  * @parent:		parent stplr_process
+ * @rb_node:		an element on the 'stplr_process::threads' rb tree
+ * @sibling_node:	an element on the 'stplr_process::siblings' list
  * @zombie:		thread is about to die but others keep reference to it
- * @waiting_for_reply:	whether client thread shall wait for reply
+ * @reply_tokens:	receive ioctls report reply tokens (STPLR_OPT_REPLY_TOKEN)
+ * @wake_affine:	thread is woken up with a sync hint (STPLR_OPT_WAKE_AFFINE)
+ * @work_stealing:	thread takes part in work stealing (STPLR_OPT_WORK_STEALING)
+ * @dispatch:		dispatch policy of calls addressed to the thread
+ * 			(STPLR_OPT_DISPATCH)
+ * @filter:		BPF program run for calls addressed to the thread
+ * 			(STPLR_OPT_FILTER, read under rcu read lock)
+ * @node:		numa node the structure has been allocated on
+ * @names:		service names attached to this thread (protected by
+ * 			stplr_device::names_lock)
+ * @rcu:		used to free the structure after rcu grace period
+ * 			(handles are resolved under rcu read lock)
+ * @kref:		reference counter
  * @wait:		wait queue
- * @list_node:		an element on the receiving thread queue
+ * @transaction:	current synchronous call of this (client) thread
+ * 			(protected by @queue lock)
+ * @calls:		asynchronous calls of this (client) thread which have not
+ * 			been collected by STPLR_MSG_CALL_COMPLETE yet
+ * 			(protected by @queue lock)
+ * @steal_kick:		a sibling is busy and has calls which may be stolen
  * @queue:		receiving thread queue
+ * @idle_node:		an element on the 'stplr_process::idle_stealers' list
+ * @idle:		thread waits for calls in STPLR_MSG_RECEIVE
+ * 			(written by the owner, read by others)
+ * @cpu:		cpu the thread last started to wait for calls on
+ * 			(written by the owner, read by others)
+ * @waiting_for_reply:	whether replying thread shall wait for the client
+ * 			to pick the reply up (set by the replying thread itself,
+ * 			cleared by the client)
  * @buffers:		buffer[0] handles send case,
  * 			buffer[1] handles reply case
+ * @busy_poll:		adaptive busy poll state
+ * @admission_wait_us:	how long calls of this (client) thread wait for room
+ * 			in full queues (STPLR_OPT_ADMISSION_WAIT)
+ * @counters:		cumulative statistics
+ * @stats:		per cpu histograms (allocated by the first receive,
+ * 			NULL if the thread has not received anything yet)
+ * @timestamps:		where to report kernel timestamps of messages
+ * 			(STPLR_OPT_TIMESTAMPS)
+ * @resume_interrupted:	calls interrupted by a signal are kept queued to be
+ * 			resumed by the restarted ioctl (STPLR_OPT_RESUME_INTERRUPTED)
+ * @suspended:		call of this (client) thread interrupted by a signal,
+ * 			kept queued with its buffers pinned until the ioctl
+ * 			is restarted (the reference of the ioctl is passed to it,
+ * 			claimed by xchg(), as the flush of the thread may drop it)
+ * @suspended_ubuf:	user space argument of the interrupted ioctl
+ * @deadline:		where to read deadlines of blocking operations from
+ * 			(STPLR_OPT_DEADLINE)
+ * @spare:		preallocated transaction borrowed by synchronous calls
+ * 			of this (client) thread (NULL while borrowed)
+ * @credits:		credits granted to asynchronous senders
+ *
+ * The structure is split into cache line aligned parts, so that
+ * a number of clients hammering one server (fan-in) does not keep stealing
+ * the cache lines the server itself works on:
+ * - read-mostly part, used by lookups (set up at creation time),
+ * - part written by other threads (reference counting, wake ups, queueing;
+ *   the cold tail of @queue is kept on lines of its own),
+ * - part written by the owner on every receive or reply and read by
+ *   dispatching and work stealing siblings,
+ * - part written by the owner only (its own message buffers and statistics),
+ * - cold part (flow control of asynchronous senders).
  */
 struct stplr_thread {
+	/* read-mostly */
 	pid_t tid;
-	struct kref kref;
-	struct rb_node rb_node;
+	u32 handle_index;
 	struct stplr_process *parent;
+	struct rb_node rb_node;
+	struct list_head sibling_node;
 	atomic_t zombie;
-	bool waiting_for_reply;
+	bool reply_tokens;
+	bool wake_affine;
+	bool work_stealing;
+	int dispatch;
+	struct bpf_prog __rcu *filter;
+	int node;
+	struct list_head names;
+	struct rcu_head rcu;
+
+	/* written by other threads (clients, repliers) */
+	struct kref kref ____cacheline_aligned_in_smp;
 	wait_queue_head_t wait;
-	struct list_head list_node;
+	struct stplr_transaction *transaction;
+	struct list_head calls;
+	bool steal_kick;
 	struct stplr_thread_queue queue;
+
+	/* written by the owner, read by siblings */
+	struct list_head idle_node ____cacheline_aligned_in_smp;
+	bool idle;
+	int cpu;
+	bool waiting_for_reply;
+
+	/* written by the owner */
+	struct stplr_thread_msg_buffer buffers[STPLR_THREAD_NUM_OF_BUFFERS] ____cacheline_aligned_in_smp;
+	struct stplr_thread_busy_poll busy_poll;
+	u64 admission_wait_us;
+	struct stplr_thread_counters counters;
+	struct stplr_thread_stats __percpu *stats;
+	struct stplr_timestamps __user *timestamps;
+	bool resume_interrupted;
+	struct stplr_transaction *suspended;
+	void __user *suspended_ubuf;
+	u64 __user *deadline;
+	struct stplr_transaction *spare;
+
+	/* cold */
+	struct stplr_thread_credits credits ____cacheline_aligned_in_smp;
+};
+
+/**
+ * struct stplr_transaction - a single call (request and its reply) of a client
+ * @kref:		reference counter (client, receiving thread queue, reply token)
+ * @client:		client thread, valid as long as the call is not abandoned
+ * @pid:		process id of the client
+ * @tid:		thread id of the client
+ * @rprocess:		process the call is addressed to (strong reference)
+ * @rthread:		thread the call is queued to (strong reference)
+ * @rtid:		thread id the call has been addressed to (the call may be
+ * 			queued to another thread by STPLR_OPT_FILTER or STPLR_OPT_DISPATCH)
+ * @list_node:		an element on the 'stplr_thread_queue::head' list
+ * @call_node:		an element on the 'stplr_thread::calls' list
+ * 			(asynchronous calls only)
+ * @buffers:		buffer[0] handles send case,
+ * 			buffer[1] handles reply case
+ * @lock:		protects fields below and serializes server's accesses
+ * 			to the client's buffers with the client abandoning the call
+ * @served_by:		process id of the server which received the request
+ * 			and has not replied yet
+ * @replier:		thread which replied by STPLR_MSG_REPLY and waits for
+ * 			the client to pick the reply up
+ * @reply_copied:	reply has been already copied to the client's buffers
+ * 			(by STPLR_MSG_REPLY_TOKEN)
+ * @abandoned:		client does not wait for the call anymore
+ * @reply_required:	false for oneway STPLR_MSG_SEND
+ * @async:		call issued by STPLR_MSG_CALL
+ * @bytes:		size of the messages of the call (while it is queued)
+ * @priority:		call is queued ahead of the calls without priority
+ * 			(verdict of STPLR_OPT_FILTER program)
+ * @completed:		call is completed (written under @lock, read locklessly)
+ * @status:		completion status of the call
+ * @cookie:		user data of an asynchronous call
+ * @smsgs:		user space send messages of an asynchronous or suspended call
+ * @rmsgs:		user space reply messages of an asynchronous or suspended call
+ * @queued_ns:		time the call has been queued at
+ * @dequeued_ns:	time the call has been accepted by the receiving thread
+ * @replied_ns:		time the reply has been issued
+ * @reply_copied_ns:	time the reply has been copied to the client's buffers
+ *
+ * The client's buffers stay pinned until the last reference is dropped,
+ * so a server holding a reference may safely access them as long as
+ * the call has not been abandoned.
+ */
+struct stplr_transaction {
+	struct kref kref;
+	struct stplr_thread *client;
+	pid_t pid;
+	pid_t tid;
+	struct stplr_process *rprocess;
+	struct stplr_thread *rthread;
+	pid_t rtid;
+	struct list_head list_node;
+	struct list_head call_node;
 	struct stplr_thread_msg_buffer buffers[STPLR_THREAD_NUM_OF_BUFFERS];
+	struct mutex lock;
+	pid_t served_by;
+	struct stplr_thread *replier;
+	bool reply_copied;
+	bool abandoned;
+	bool reply_required;
+	bool async;
+	size_t bytes;
+	bool priority;
+	bool completed;
+	int status;
+	__u64 cookie;
+	struct stplr_msgs smsgs;
+	struct stplr_msgs rmsgs;
+	u64 queued_ns;
+	u64 dequeued_ns;
+	u64 replied_ns;
+	u64 reply_copied_ns;
+};
+
+/**
+ * struct stplr_subscriber_group - subscriber group
+ * @gid:		group identifier
+ * @owner:		process id of the process which created the group
+ * @subscribers:	list of subscribed threads (struct stplr_subscriber)
+ */
+struct stplr_subscriber_group {
+	int gid;
+	pid_t owner;
+	struct list_head subscribers;
+};
+
+/**
+ * struct stplr_subscriber - thread subscribed to a group
+ * @list_node:	an element on the 'stplr_subscriber_group::subscribers' list
+ * @thread:	subscribed thread (strong reference)
+ */
+struct stplr_subscriber {
+	struct list_head list_node;
+	struct stplr_thread *thread;
+};
+
+struct stplr_post;
+
+/**
+ * struct stplr_connection - asynchronous sender process of a receiving thread
+ * @hnode:	an element of the 'stplr_thread_credits::connections' hash table
+ * @thread:	receiving thread
+ * @pid:	process id of the sending process
+ * @msgs:	number of outstanding messages
+ * @bytes:	number of outstanding bytes
+ *
+ * The connection exists only while the process has outstanding messages,
+ * so short-lived senders do not accumulate on the receiving thread.
+ */
+struct stplr_connection {
+	struct hlist_node hnode;
+	struct stplr_thread *thread;
+	pid_t pid;
+	__u32 msgs;
+	__u64 bytes;
+};
+
+/**
+ * struct stplr_post_entry - delivery of a post to one subscriber
+ * @list_node:	an element on the 'stplr_thread_queue::posts' list
+ * @post:	the post being delivered
+ * @thread:	subscriber, valid only until the entry is queued
+ * @connection:	connection the credits were taken from (asynchronous sends only)
+ * @bytes:	number of bytes taken from the @connection credits
+ */
+struct stplr_post_entry {
+	struct list_head list_node;
+	struct stplr_post *post;
+	struct stplr_thread *thread;
+	struct stplr_connection *connection;
+	__u64 bytes;
+};
+
+/**
+ * struct stplr_post - message(s) posted to a subscriber group
+ * @kref:	reference counter (poster plus every queued entry)
+ * @pid:	process id of the posting process
+ * @tid:	thread id of the posting thread
+ * @pending:	number of subscribers which have not received the post yet
+ * @wait:	wait queue of the posting thread
+ * @buffer:	pinned message buffers of the posting thread (shared by
+ * 		all subscribers)
+ * @queued_ns:	time the post has been queued at
+ * @nentries:	number of elements in the @entries array
+ * @entries:	one entry per subscriber
+ */
+struct stplr_post {
+	struct kref kref;
+	pid_t pid;
+	pid_t tid;
+	atomic_t pending;
+	wait_queue_head_t wait;
+	struct stplr_thread_msg_buffer buffer;
+	u64 queued_ns;
+	__u32 nentries;
+	struct stplr_post_entry entries[];
+};
+
+/**
+ * struct stplr_name - service name attached to a thread
+ * @hlist:	an element on the 'stplr_device::names' hash table
+ * @list_node:	an element on the 'stplr_thread::names' list
+ * @rcu:	used to free the structure after rcu grace period
+ * @hash:	hash of @name
+ * @pid:	process id of the thread the name is attached to
+ * @tid:	thread id of the thread the name is attached to
+ * @name:	null terminated service name
+ */
+struct stplr_name {
+	struct hlist_node hlist;
+	struct list_head list_node;
+	struct rcu_head rcu;
+	u32 hash;
+	pid_t pid;
+	pid_t tid;
+	char name[STPLR_NAME_MAX];
 };
 
 static HLIST_HEAD(stplr_devices);
 
+static struct kmem_cache *stplr_process_cache;
+static struct kmem_cache *stplr_thread_cache;
+static struct kmem_cache *stplr_transaction_cache;
+
+static struct dentry *stplr_debugfs_root;
+
+/*
+ * Makes sure the buffer has room for @nmsgs messages spanning @nr_pages pages.
+ * Storage above STPLR_MSG_BUFFER_RETAIN_* left by a former call is freed
+ * (and reallocated to the preallocated size at least) if this call does not
+ * need it. Must be called when the buffer is not initialized (no pages pinned).
+ */
+static int stplr_msg_buffer_reserve(struct stplr_thread_msg_buffer *buffer, __u32 nmsgs, __u32 nr_pages)
+{
+	void *msgs;
+	struct page **pages;
+	struct scatterlist *sgl;
+
+	if (buffer->capacity > STPLR_MSG_BUFFER_RETAIN_MSGS && nmsgs <= STPLR_MSG_BUFFER_RETAIN_MSGS) {
+		kfree(buffer->msgs);
+		buffer->msgs = NULL;
+		buffer->capacity = 0;
+		nmsgs = max_t(__u32, nmsgs, STPLR_MSG_BUFFER_PREALLOC_MSGS);
+	}
+
+	if (buffer->pages_capacity > STPLR_MSG_BUFFER_RETAIN_PAGES && nr_pages <= STPLR_MSG_BUFFER_RETAIN_PAGES) {
+		kfree(buffer->sgl);
+		kfree(buffer->pages);
+		buffer->sgl = NULL;
+		buffer->pages = NULL;
+		buffer->pages_capacity = 0;
+		nr_pages = max_t(__u32, nr_pages, STPLR_MSG_BUFFER_PREALLOC_PAGES);
+	}
+
+	if (nmsgs > buffer->capacity) {
+		msgs = kcalloc(nmsgs, sizeof(struct stplr_msg) + sizeof(struct stplr_msg_pages), GFP_KERNEL);
+		if (!msgs)
+			return -ENOMEM;
+
+		kfree(buffer->msgs);
+		buffer->msgs = msgs;
+		buffer->capacity = nmsgs;
+	}
+
+	if (nr_pages > buffer->pages_capacity) {
+		pages = kmalloc_array(nr_pages, sizeof(struct page *), GFP_KERNEL);
+		sgl = kmalloc_array(nr_pages, sizeof(struct scatterlist), GFP_KERNEL);
+		if (!pages || !sgl) {
+			kfree(sgl);
+			kfree(pages);
+			return -ENOMEM;
+		}
+
+		kfree(buffer->sgl);
+		kfree(buffer->pages);
+		buffer->pages = pages;
+		buffer->sgl = sgl;
+		buffer->pages_capacity = nr_pages;
+	}
+
+	return 0;
+}
+
+/*
+ * Gives back the storage a huge call has grown the (not initialized) buffer to.
+ * Failing to reallocate the preallocated size leaves the buffer without
+ * storage, which its next use reserves.
+ */
+static void stplr_msg_buffer_trim(struct stplr_thread_msg_buffer *buffer)
+{
+	stplr_msg_buffer_reserve(buffer, STPLR_MSG_BUFFER_PREALLOC_MSGS, STPLR_MSG_BUFFER_PREALLOC_PAGES);
+}
+
+static void stplr_msg_buffer_free(struct stplr_thread_msg_buffer *buffer)
+{
+	kfree(buffer->sgl);
+	kfree(buffer->pages);
+	kfree(buffer->msgs);
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+/* passes the storage of (not initialized) @src buffer to (empty) @dst buffer */
+static void stplr_msg_buffer_move(struct stplr_thread_msg_buffer *dst, struct stplr_thread_msg_buffer *src)
+{
+	*dst = *src;
+	memset(src, 0, sizeof(*src));
+}
+
+/*
+ * Returns the time the oldest call of the queue has been queued at (0 if there
+ * is none). The calls with priority are queued in order ahead of the calls
+ * without it, which are queued in order as well (requeued calls are older than
+ * any other), so the oldest one is either the first call or the first call
+ * without priority.
+ */
+static u64 stplr_thread_queue_oldest_locked(struct stplr_thread_queue *queue)
+{
+	struct stplr_transaction *t;
+	u64 oldest = 0;
+
+	list_for_each_entry(t, &queue->head, list_node) {
+		if (!oldest || t->queued_ns < oldest)
+			oldest = t->queued_ns;
+		if (!t->priority)
+			break;
+	}
+
+	return oldest;
+}
+
+/* signals the eventfds of STPLR_LOAD_NOTIFY once the load crosses the watermarks */
+static void stplr_thread_queue_notify_locked(struct stplr_thread_queue *queue)
+{
+	struct stplr_thread_load_notify *notify = &queue->notify;
+	u64 oldest = 0;
+	u64 load;
+
+	if (!notify->high_ctx && !notify->low_ctx)
+		return;
+
+	if (notify->metric == STPLR_LOAD_QUEUE_DEPTH)
+		load = queue->ncalls;
+	else {
+		oldest = stplr_thread_queue_oldest_locked(queue);
+		load = oldest ? ktime_get_ns() - oldest : 0;
+	}
+
+	if (!notify->above && load >= notify->high) {
+		notify->above = true;
+		if (notify->high_ctx)
+			eventfd_signal(notify->high_ctx);
+	} else
+	if (notify->above && load <= notify->low) {
+		notify->above = false;
+		if (notify->low_ctx)
+			eventfd_signal(notify->low_ctx);
+	}
+
+	/* a stalled receiver does not touch its queue, so the wait has to be watched by a timer */
+	if (!notify->above && oldest && notify->expires_ns != oldest + notify->high) {
+		notify->expires_ns = oldest + notify->high;
+		hrtimer_start(&notify->timer, ns_to_ktime(notify->expires_ns), HRTIMER_MODE_ABS);
+	}
+}
+
+/* the timer fires in interrupt context, while the queue lock is taken with interrupts enabled */
+static enum hrtimer_restart stplr_thread_queue_notify_timer(struct hrtimer *timer)
+{
+	struct stplr_thread_load_notify *notify = container_of(timer, struct stplr_thread_load_notify, timer);
+
+	schedule_work(&notify->work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void stplr_thread_queue_notify_work(struct work_struct *work)
+{
+	struct stplr_thread_queue *queue = container_of(work, struct stplr_thread_queue, notify.work);
+
+	spin_lock(&queue->lock);
+	queue->notify.expires_ns = 0;
+	stplr_thread_queue_notify_locked(queue);
+	spin_unlock(&queue->lock);
+}
+
 static struct stplr_thread* stplr_thread_get_locked(struct stplr_process *process, pid_t tid, uint32_t flags)
 {
 	struct stplr_thread *thread;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &process->threads.rb_node;
+	int i;
 
 	while (*p) {
 		parent = *p;
@@ -220,21 +966,49 @@ static struct stplr_thread* stplr_thread_get_locked(struct stplr_process *proces
 	if (!(flags & STPLR_F_CREAT))
 		return ERR_PTR(-ENODEV);
 
-	thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	/* the structure is created by its owner, so it is placed on the owner's node */
+	thread = kmem_cache_alloc_node(stplr_thread_cache, GFP_KERNEL | __GFP_ZERO, numa_node_id());
 	if (!thread)
 		return ERR_PTR(-ENOMEM);
 
+	thread->spare = kmem_cache_zalloc(stplr_transaction_cache, GFP_KERNEL);
+	if (!thread->spare) {
+		kmem_cache_free(stplr_thread_cache, thread);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < STPLR_THREAD_NUM_OF_BUFFERS; i++)
+		if (stplr_msg_buffer_reserve(&thread->buffers[i],
+				STPLR_MSG_BUFFER_PREALLOC_MSGS, STPLR_MSG_BUFFER_PREALLOC_PAGES)) {
+			while (i-- > 0)
+				stplr_msg_buffer_free(&thread->buffers[i]);
+			kmem_cache_free(stplr_transaction_cache, thread->spare);
+			kmem_cache_free(stplr_thread_cache, thread);
+			return ERR_PTR(-ENOMEM);
+		}
+
 	thread->tid = tid;
+	thread->node = numa_node_id();
 	thread->parent = process;
 	atomic_set(&thread->zombie, 0);
 	kref_init(&thread->kref);
 	init_waitqueue_head(&thread->wait);
-	INIT_LIST_HEAD(&thread->list_node);
 	spin_lock_init(&thread->queue.lock);
 	INIT_LIST_HEAD(&thread->queue.head);
+	INIT_LIST_HEAD(&thread->queue.posts);
+	init_waitqueue_head(&thread->queue.room);
+	hrtimer_setup(&thread->queue.notify.timer, stplr_thread_queue_notify_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	INIT_WORK(&thread->queue.notify.work, stplr_thread_queue_notify_work);
+	INIT_LIST_HEAD(&thread->calls);
+	INIT_LIST_HEAD(&thread->names);
+	INIT_LIST_HEAD(&thread->idle_node);
+	hash_init(thread->credits.connections);
+	init_waitqueue_head(&thread->credits.wait);
+	thread->busy_poll.max_ns = (u64)READ_ONCE(process->dev->busy_poll_us) * NSEC_PER_USEC;
 
 	rb_link_node(&thread->rb_node, parent, p);
 	rb_insert_color(&thread->rb_node, &process->threads);
+	list_add_tail_rcu(&thread->sibling_node, &process->siblings);
 
 	stplr_dbg_at3("[%d:%d] stapler thread structure created for thread %d\n",
 		current->group_leader->pid, current->pid, thread->tid);
@@ -257,14 +1031,56 @@ static struct stplr_thread* stplr_thread_get(struct stplr_process *process, pid_
 	return thread;
 }
 
+static void stplr_thread_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(stplr_thread_cache, container_of(rcu, struct stplr_thread, rcu));
+}
+
 static void stplr_thread_release(struct kref *kref)
 {
 	struct stplr_thread *thread = container_of(kref, struct stplr_thread, kref);
 	struct stplr_process *process = thread->parent;
+	struct stplr_connection *connection;
+	struct eventfd_ctx *high_ctx;
+	struct eventfd_ctx *low_ctx;
+	struct hlist_node *next;
 	pid_t tid = thread->tid;
+	int bkt;
+	int i;
+
+	hash_for_each_safe(thread->credits.connections, bkt, next, connection, hnode)
+		kfree(connection);
+
+	for (i = 0; i < STPLR_THREAD_NUM_OF_BUFFERS; i++)
+		stplr_msg_buffer_free(&thread->buffers[i]);
+
+	if (thread->spare)
+		kmem_cache_free(stplr_transaction_cache, thread->spare);
+
+	free_percpu(thread->stats);
+
+	if (rcu_access_pointer(thread->filter))
+		bpf_prog_put(rcu_dereference_protected(thread->filter, true));
+
+	/* once the contexts are gone, the work does not arm the timer again */
+	spin_lock(&thread->queue.lock);
+	high_ctx = thread->queue.notify.high_ctx;
+	low_ctx = thread->queue.notify.low_ctx;
+	thread->queue.notify.high_ctx = NULL;
+	thread->queue.notify.low_ctx = NULL;
+	spin_unlock(&thread->queue.lock);
+
+	hrtimer_cancel(&thread->queue.notify.timer);
+	cancel_work_sync(&thread->queue.notify.work);
+
+	if (high_ctx)
+		eventfd_ctx_put(high_ctx);
+	if (low_ctx)
+		eventfd_ctx_put(low_ctx);
 
 	rb_erase(&thread->rb_node, &process->threads);
-	kfree(thread);
+	list_del_rcu(&thread->sibling_node);
+	call_rcu(&thread->rcu, stplr_thread_free_rcu);
 
 	stplr_dbg_at3("[%d:%d] stapler thread structure released for thread %d\n",
 		current->group_leader->pid, current->pid, tid);
@@ -288,6 +1104,16 @@ static void stplr_thread_put(struct stplr_thread *thread)
 	mutex_unlock(&process->threads_lock);
 }
 
+static struct stplr_msg *stplr_msg_buffer_get_msgs(struct stplr_thread_msg_buffer *buffer)
+{
+	return buffer->msgs;
+}
+
+static struct stplr_msg_pages *stplr_msg_buffer_get_msg_pages(struct stplr_thread_msg_buffer *buffer)
+{
+	return buffer->msgs + buffer->nmsgs * sizeof(struct stplr_msg);
+}
+
 static __u32 stplr_thread_get_num_of_msgs(struct stplr_thread *thread, int buffer_id)
 {
 	return thread->buffers[buffer_id].nmsgs;
@@ -295,55 +1121,150 @@ static __u32 stplr_thread_get_num_of_msgs(struct stplr_thread *thread, int buffe
 
 static struct stplr_msg *stplr_thread_get_msgs(struct stplr_thread *thread, int buffer_id)
 {
-	return thread->buffers[buffer_id].msgs;
+	return stplr_msg_buffer_get_msgs(&thread->buffers[buffer_id]);
 }
 
 static struct stplr_msg_pages *stplr_thread_get_msg_pages(struct stplr_thread *thread, int buffer_id)
 {
-	return thread->buffers[buffer_id].msgs +
-		thread->buffers[buffer_id].nmsgs * sizeof(struct stplr_msg);
+	return stplr_msg_buffer_get_msg_pages(&thread->buffers[buffer_id]);
 }
 
+/*
+ * Lockless check (list_empty() reads the heads with READ_ONCE()), so that
+ * a thread spinning on it does not bounce the queue lock against the clients
+ * it waits for. Callers take the lock afterwards and cope with an empty queue.
+ */
 static bool stplr_thread_queue_has_clients(struct stplr_thread_queue *queue)
 {
-	bool status;
+	return !list_empty(&queue->head) || !list_empty(&queue->posts);
+}
 
-	spin_lock(&queue->lock);
-	status = !list_empty(&queue->head);
-	spin_unlock(&queue->lock);
+/* must be called (under the queue lock) whenever a call is added to or removed from the queue */
+static void stplr_thread_queue_account_locked(struct stplr_thread_queue *queue,
+	struct stplr_transaction *t, int delta)
+{
+	if (delta > 0) {
+		WRITE_ONCE(queue->ncalls, queue->ncalls + 1);
+		queue->bytes += t->bytes;
+	} else {
+		WRITE_ONCE(queue->ncalls, queue->ncalls - 1);
+		queue->bytes -= t->bytes;
+		if (queue->max_calls || queue->max_bytes)
+			wake_up(&queue->room);
+	}
 
-	return status;
+	stplr_thread_queue_notify_locked(queue);
 }
 
-static struct stplr_process* stplr_process_get_locked(struct stplr_device *dev, pid_t pid, uint32_t flags)
+static bool stplr_thread_queue_full_locked(struct stplr_thread_queue *queue, struct stplr_transaction *t)
 {
-	struct stplr_process *process;
-	struct rb_node *parent = NULL;
-	struct rb_node **p = &dev->processes.rb_node;
+	if (queue->max_calls && queue->ncalls >= queue->max_calls)
+		return true;
 
-	while (*p) {
-		parent = *p;
-		process = rb_entry(parent, struct stplr_process, rb_node);
+	/* a call exceeding the limit on its own would never fit otherwise */
+	return queue->max_bytes && queue->ncalls && queue->bytes + t->bytes > queue->max_bytes;
+}
 
-		if (pid < process->pid)
-			p = &(*p)->rb_left;
-		else
-		if (pid > process->pid)
-			p = &(*p)->rb_right;
-		else
-		if ((flags & (STPLR_F_CREAT | STPLR_F_EXCL)) == (STPLR_F_CREAT | STPLR_F_EXCL))
-			return ERR_PTR(-EBUSY);
-		else
-		if (flags & STPLR_F_STRONG_REF)
-			return kref_get(&process->kref), process;
-		else
-			return process;
-	}
+static u64 stplr_busy_poll_window(const struct stplr_thread_busy_poll *busy_poll)
+{
+	if (!busy_poll->avg_ns)
+		return busy_poll->max_ns;
+
+	return 2 * busy_poll->avg_ns <= busy_poll->max_ns ? 2 * busy_poll->avg_ns : 0;
+}
+
+static bool stplr_busy_poll_expired(u64 start, u64 window)
+{
+	return ktime_get_ns() - start >= window || need_resched() || signal_pending(current);
+}
+
+static void stplr_busy_poll_update(struct stplr_thread_busy_poll *busy_poll, u64 elapsed)
+{
+	/* an idle period spent asleep says nothing but that the peer is slower than the window */
+	elapsed = min(elapsed, busy_poll->max_ns);
+
+	/* new sample contributes 1/8 to the moving average */
+	if (busy_poll->avg_ns)
+		busy_poll->avg_ns += (elapsed >> 3) - (busy_poll->avg_ns >> 3);
+	else
+		busy_poll->avg_ns = elapsed;
+}
+
+/* converts an absolute deadline to the timeout of wait_event_interruptible_hrtimeout() */
+static ktime_t stplr_deadline_to_timeout(ktime_t deadline)
+{
+	ktime_t now = ktime_get();
+
+	return deadline > now ? ktime_sub(deadline, now) : 0;
+}
+
+/*
+ * wait_event_interruptible() bounded by an absolute CLOCK_MONOTONIC deadline
+ * (KTIME_MAX if there is none), fails with -ETIMEDOUT once the deadline passes.
+ */
+#define stplr_wait_event_deadline(wq_head, condition, deadline)				\
+({											\
+	int __ret;									\
+											\
+	if ((deadline) == KTIME_MAX)							\
+		__ret = wait_event_interruptible(wq_head, condition);			\
+	else {										\
+		__ret = wait_event_interruptible_hrtimeout(wq_head, condition,		\
+			stplr_deadline_to_timeout(deadline));				\
+		if (__ret == -ETIME)							\
+			__ret = -ETIMEDOUT;						\
+	}										\
+	__ret;										\
+})
+
+/*
+ * Spins on the condition for up to the adaptive busy poll window
+ * of the thread and then falls back to stplr_wait_event_deadline().
+ */
+#define stplr_wait_event_busy_poll(thread, wq_head, condition, deadline)		\
+({											\
+	int __ret;									\
+	u64 __start = (thread)->busy_poll.max_ns ? ktime_get_ns() : 0;			\
+	u64 __window = stplr_busy_poll_window(&(thread)->busy_poll);			\
+											\
+	while (__window && !(condition) && !stplr_busy_poll_expired(__start, __window))	\
+		cpu_relax();								\
+											\
+	__ret = stplr_wait_event_deadline(wq_head, condition, deadline);		\
+	if (!__ret && __start)								\
+		stplr_busy_poll_update(&(thread)->busy_poll, ktime_get_ns() - __start);	\
+	__ret;										\
+})
+
+static struct stplr_process* stplr_process_get_locked(struct stplr_device *dev, pid_t pid, uint32_t flags)
+{
+	struct stplr_process *process;
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &dev->processes.rb_node;
+
+	while (*p) {
+		parent = *p;
+		process = rb_entry(parent, struct stplr_process, rb_node);
+
+		if (pid < process->pid)
+			p = &(*p)->rb_left;
+		else
+		if (pid > process->pid)
+			p = &(*p)->rb_right;
+		else
+		if ((flags & (STPLR_F_CREAT | STPLR_F_EXCL)) == (STPLR_F_CREAT | STPLR_F_EXCL))
+			return ERR_PTR(-EBUSY);
+		else
+		if (flags & STPLR_F_STRONG_REF)
+			return kref_get(&process->kref), process;
+		else
+			return process;
+	}
 
 	if (!(flags & STPLR_F_CREAT))
 		return ERR_PTR(-ENODEV);
 
-	process = kzalloc(sizeof(*process), GFP_KERNEL);
+	process = kmem_cache_zalloc(stplr_process_cache, GFP_KERNEL);
 	if (!process)
 		return ERR_PTR(-ENOMEM);
 
@@ -351,6 +1272,11 @@ static struct stplr_process* stplr_process_get_locked(struct stplr_device *dev,
 	process->dev = dev;
 	kref_init(&process->kref);
 	mutex_init(&process->threads_lock);
+	INIT_LIST_HEAD(&process->siblings);
+	mutex_init(&process->tokens_lock);
+	idr_init(&process->tokens);
+	spin_lock_init(&process->stealers_lock);
+	INIT_LIST_HEAD(&process->idle_stealers);
 
 	rb_link_node(&process->rb_node, parent, p);
 	rb_insert_color(&process->rb_node, &dev->processes);
@@ -376,16 +1302,143 @@ static struct stplr_process* stplr_process_get(struct stplr_device *dev, pid_t p
 	return process;
 }
 
+static struct stplr_arena *stplr_arena_create(size_t size)
+{
+	struct stplr_arena *arena;
+	int ret = -ENOMEM;
+
+	arena = kzalloc(sizeof(*arena), GFP_KERNEL);
+	if (!arena)
+		return ERR_PTR(-ENOMEM);
+
+	arena->base = vmalloc_user(size);
+	if (!arena->base)
+		goto out1;
+
+	arena->pool = gen_pool_create(STPLR_ARENA_SLOT_ORDER, -1);
+	if (!arena->pool)
+		goto out2;
+
+	ret = gen_pool_add(arena->pool, (unsigned long)arena->base, size, -1);
+	if (ret)
+		goto out3;
+
+	kref_init(&arena->kref);
+	atomic_set(&arena->mappings, 1);
+	arena->size = size;
+	xa_init(&arena->slots);
+
+	return arena;
+
+out3:
+	gen_pool_destroy(arena->pool);
+
+out2:
+	vfree(arena->base);
+
+out1:
+	kfree(arena);
+
+	return ERR_PTR(ret);
+}
+
+static void stplr_arena_destroy(struct stplr_arena *arena)
+{
+	unsigned long index;
+	void *entry;
+
+	/* gen_pool_destroy() insists on all chunks being free */
+	xa_for_each(&arena->slots, index, entry)
+		gen_pool_free(arena->pool,
+			(unsigned long)arena->base + (index << STPLR_ARENA_SLOT_ORDER),
+			xa_to_value(entry));
+
+	xa_destroy(&arena->slots);
+	gen_pool_destroy(arena->pool);
+	vfree(arena->base);
+	kfree_rcu(arena, rcu);
+}
+
+static void stplr_arena_release(struct kref *kref)
+{
+	stplr_arena_destroy(container_of(kref, struct stplr_arena, kref));
+}
+
+/* takes a reference to the arena currently mapped by the process (if any) */
+static struct stplr_arena *stplr_arena_get(struct stplr_process *process)
+{
+	struct stplr_arena *arena;
+
+	rcu_read_lock();
+	arena = rcu_dereference(process->arena);
+	if (arena && !kref_get_unless_zero(&arena->kref))
+		arena = NULL;
+	rcu_read_unlock();
+
+	return arena;
+}
+
+static void stplr_arena_put(struct stplr_arena *arena)
+{
+	kref_put(&arena->kref, stplr_arena_release);
+}
+
+static int stplr_arena_alloc(struct stplr_arena *arena, size_t size, __u32 *offset)
+{
+	unsigned long addr;
+	void *entry;
+
+	/* empty messages occupy a slot as well, so that they can be released the same way */
+	size = max_t(size_t, size, 1);
+
+	addr = gen_pool_alloc(arena->pool, size);
+	if (!addr)
+		return -ENOBUFS;
+
+	*offset = addr - (unsigned long)arena->base;
+
+	entry = xa_store(&arena->slots, *offset >> STPLR_ARENA_SLOT_ORDER,
+		xa_mk_value(size), GFP_KERNEL);
+	if (xa_is_err(entry)) {
+		gen_pool_free(arena->pool, addr, size);
+		return xa_err(entry);
+	}
+
+	return 0;
+}
+
+static int stplr_arena_free(struct stplr_arena *arena, __u32 offset)
+{
+	void *entry;
+
+	if (offset & ((1U << STPLR_ARENA_SLOT_ORDER) - 1))
+		return -EINVAL;
+
+	entry = xa_erase(&arena->slots, offset >> STPLR_ARENA_SLOT_ORDER);
+	if (!entry)
+		return -EINVAL;
+
+	gen_pool_free(arena->pool, (unsigned long)arena->base + offset, xa_to_value(entry));
+
+	return 0;
+}
+
 static void stplr_process_release(struct kref *kref)
 {
 	struct stplr_process *process = container_of(kref, struct stplr_process, kref);
 	struct stplr_device *dev = process->dev;
+	struct stplr_arena *arena;
 	pid_t pid = process->pid;
 
 	WARN_ON(!RB_EMPTY_ROOT(&process->threads));
 
 	rb_erase(&process->rb_node, &dev->processes);
-	kfree(process);
+	kfree(rcu_dereference_protected(process->handles, true));
+	arena = rcu_dereference_protected(process->arena, true);
+	if (arena)
+		stplr_arena_put(arena);
+	idr_destroy(&process->tokens);
+	kmem_cache_free(stplr_process_cache, process);
 
 	stplr_dbg_at3("[%d:%d] stapler process structure released for process %d\n",
 		current->group_leader->pid, current->pid, pid);
@@ -409,92 +1462,128 @@ static void stplr_process_put(struct stplr_process *process)
 	mutex_unlock(&dev->processes_lock);
 }
 
-static int stplr_thread_to_handle(struct stplr_process *process, const struct stplr_thread *thread, struct stplr_handle *handle)
+static struct stplr_handle_table *stplr_handle_table_grow(struct stplr_handle_table *table)
 {
-	handle->uuid = thread->tid; //TODO: Not sure this is ok.
-	return 0;
+	struct stplr_handle_table *new_table;
+	u32 size = table ? 2 * table->size : STPLR_HANDLE_TABLE_MIN_SIZE;
+
+	new_table = kzalloc(struct_size(new_table, slots, size), GFP_KERNEL);
+	if (!new_table)
+		return NULL;
+
+	new_table->size = size;
+	if (table)
+		memcpy(new_table->slots, table->slots, table->size * sizeof(table->slots[0]));
+
+	return new_table;
 }
 
-static int stplr_handle_to_thread(struct stplr_process *process, const struct stplr_handle *handle, struct stplr_thread **thread)
+static int stplr_thread_to_handle(struct stplr_process *process, struct stplr_thread *thread, struct stplr_handle *handle)
 {
-	struct stplr_thread *t;
-	pid_t tid = handle->uuid;
+	struct stplr_handle_table *table, *new_table;
+	struct stplr_handle_slot *slot;
+	u32 index;
 
-	t = stplr_thread_get(process, tid, 0);
-	if (IS_ERR(t))
-		return PTR_ERR(t);
+	mutex_lock(&process->threads_lock);
 
-	if (current->pid != t->tid)
-		return -EBADR;
+	table = rcu_dereference_protected(process->handles,
+		lockdep_is_held(&process->threads_lock));
 
-	*thread = t;
+	for (index = 0; table && index < table->size; index++)
+		if (!table->slots[index].thread)
+			break;
 
-	return 0;
-}
+	if (!table || index == table->size) {
+		new_table = stplr_handle_table_grow(table);
+		if (!new_table) {
+			mutex_unlock(&process->threads_lock);
+			return -ENOMEM;
+		}
 
-static int stplr_open(struct inode *inode, struct file *file)
-{
-	struct stplr_device *dev;
-	struct stplr_process *process;
+		rcu_assign_pointer(process->handles, new_table);
+		if (table)
+			kfree_rcu(table, rcu);
+		table = new_table;
+	}
 
-	stplr_dbg_at3("[%d:%d] %s()\n",
-		current->group_leader->pid, current->pid, __func__);
+	slot = &table->slots[index];
+	/* pairs with smp_load_acquire() in stplr_handle_lookup_thread() */
+	smp_store_release(&slot->thread, thread);
+	thread->handle_index = index;
 
-	dev = container_of(file->private_data, struct stplr_device, miscdev);
-	process = stplr_process_get(dev, current->group_leader->pid, STPLR_F_CREAT | STPLR_F_EXCL);
-	if (IS_ERR(process))
-		return PTR_ERR(process);
+	handle->uuid = ((__u64)slot->generation << 32) | index;
 
-	file->private_data = process;
+	mutex_unlock(&process->threads_lock);
 
 	return 0;
 }
 
-static int stplr_flush(struct file *file, fl_owner_t id)
+/* makes all handles referring to the thread stale, shall be called with threads_lock held */
+static void stplr_thread_invalidate_handle_locked(struct stplr_process *process, struct stplr_thread *thread)
 {
-	struct stplr_process *process;
-	struct rb_node *node, *next;
-
-	stplr_dbg_at3("[%d:%d] %s()\n",
-		current->group_leader->pid, current->pid, __func__);
+	struct stplr_handle_table *table;
+	struct stplr_handle_slot *slot;
 
-	process = file->private_data;
+	table = rcu_dereference_protected(process->handles,
+		lockdep_is_held(&process->threads_lock));
 
-	mutex_lock(&process->threads_lock);
+	if (!table || thread->handle_index >= table->size)
+		return;
 
-	for (node = rb_first(&process->threads); node != NULL; node = next) {
-		struct stplr_thread *thread;
-		bool is_zombie;
+	slot = &table->slots[thread->handle_index];
+	if (slot->thread != thread)
+		return;
 
-		next = rb_next(node);
-		thread = rb_entry(node, struct stplr_thread, rb_node);
-		is_zombie = atomic_read(&thread->zombie);
-		stplr_dbg_at3("[%d:%d] flusing tid: %d is_zombie: %s\n",
-			current->group_leader->pid, current->pid,
-			thread->tid, is_zombie ? "true" : "false");
-		if (!is_zombie)
-			stplr_thread_put_locked(thread);
-	}
+	WRITE_ONCE(slot->generation, slot->generation + 1);
+	WRITE_ONCE(slot->thread, NULL);
+}
 
+static void stplr_thread_invalidate_handle(struct stplr_process *process, struct stplr_thread *thread)
+{
+	mutex_lock(&process->threads_lock);
+	stplr_thread_invalidate_handle_locked(process, thread);
 	mutex_unlock(&process->threads_lock);
-
-	return 0;
 }
 
-static int stplr_release(struct inode *inode, struct file *file)
+static int stplr_handle_lookup_thread(struct stplr_process *process, const struct stplr_handle *handle, struct stplr_thread **thread)
 {
-	struct stplr_process *process;
+	int ret = 0;
+	struct stplr_handle_table *table;
+	struct stplr_handle_slot *slot;
+	struct stplr_thread *t;
+	u32 index = lower_32_bits(handle->uuid);
+	u32 generation = upper_32_bits(handle->uuid);
 
-	stplr_dbg_at3("[%d:%d] %s()\n",
-		current->group_leader->pid, current->pid, __func__);
+	rcu_read_lock();
 
-	process = file->private_data;
-	stplr_process_put(process);
+	table = rcu_dereference(process->handles);
+	if (!table || index >= table->size) {
+		ret = -ENODEV;
+		goto out1;
+	}
 
-	return 0;
+	slot = &table->slots[array_index_nospec(index, table->size)];
+	t = smp_load_acquire(&slot->thread);
+	if (!t || READ_ONCE(slot->generation) != generation) {
+		ret = -ENODEV;
+		goto out1;
+	}
+
+	if (current->pid != t->tid) {
+		ret = -EBADR;
+		goto out1;
+	}
+
+	*thread = t;
+
+out1:
+	rcu_read_unlock();
+
+	return ret;
 }
 
-size_t stplr_copy_buffers(struct sg_table *dst, struct sg_table *src)
+static size_t stplr_copy_buffers_range(struct sg_table *dst, size_t dst_skip,
+	struct sg_table *src, size_t src_skip, size_t count_max)
 {
 	struct sg_mapping_iter dst_miter;
 	struct sg_mapping_iter src_miter;
@@ -506,11 +1595,17 @@ size_t stplr_copy_buffers(struct sg_table *dst, struct sg_table *src)
 	sg_miter_start(&dst_miter, dst->sgl, dst->nents, SG_MITER_TO_SG);
 	sg_miter_start(&src_miter, src->sgl, src->nents, SG_MITER_FROM_SG);
 
-	while ((dst_offset < dst_miter.length || (dst_offset = 0, sg_miter_next(&dst_miter))) &&
+	if ((dst_skip && !sg_miter_skip(&dst_miter, dst_skip)) ||
+		(src_skip && !sg_miter_skip(&src_miter, src_skip)))
+		goto out;
+
+	while (count < count_max &&
+		(dst_offset < dst_miter.length || (dst_offset = 0, sg_miter_next(&dst_miter))) &&
 		(src_offset < src_miter.length || (src_offset = 0, sg_miter_next(&src_miter)))) {
-		len = min(
+		len = min3(
 			dst_miter.length - dst_offset,
-			src_miter.length - src_offset);
+			src_miter.length - src_offset,
+			count_max - count);
 
 		stplr_dbg_at4("[%d:%d] dst_miter.length: %zu, dst_offset: %zu\n",
 			current->group_leader->pid, current->pid,
@@ -528,6 +1623,7 @@ size_t stplr_copy_buffers(struct sg_table *dst, struct sg_table *src)
 		src_offset += len;
 	}
 
+out:
 	sg_miter_stop(&src_miter);
 	sg_miter_stop(&dst_miter);
 
@@ -537,596 +1633,4346 @@ size_t stplr_copy_buffers(struct sg_table *dst, struct sg_table *src)
 	return count;
 }
 
-#if defined(STPLR_DEBUG)
-static void stplr_print_buffer(struct sg_table *sgt)
+size_t stplr_copy_buffers(struct sg_table *dst, struct sg_table *src)
 {
-	struct sg_mapping_iter miter;
-	unsigned int sg_flags = SG_MITER_FROM_SG;
-
-	stplr_dbg_at3("sgt->nents: %u\n", sgt->nents);
-
-	sg_miter_start(&miter, sgt->sgl, sgt->nents, sg_flags);
-
-	while (sg_miter_next(&miter)) {
-		stplr_dbg_at4("addr: %px\n", miter.addr);
-		stplr_dbg_at4("length: %zu\n", miter.length);
-		stplr_dbg_at4("consumed: %zu\n", miter.consumed);
-		stplr_dbg_at4("__offset: %u\n", miter.__offset);
-		stplr_dbg_at4("__remaining: %u\n", miter.__remaining);
-	}
-
-	sg_miter_stop(&miter);
+	return stplr_copy_buffers_range(dst, 0, src, 0, SIZE_MAX);
 }
-#endif
 
-static int stplr_get_user_pages(const struct stplr_msg *msg, struct stplr_msg_pages *msg_pages)
+/* copies between user space buffer of a local message and pinned pages of its peer */
+static size_t stplr_copy_user_range(void __user *ubuf, size_t ulen,
+	struct sg_table *sgt, size_t skip, size_t count_max, bool to_user)
 {
-	int status;
-	__u64 msgbufaddr;
-	unsigned long first, last;
+	struct sg_mapping_iter miter;
+	size_t len;
+	size_t left;
+	size_t count = 0;
 
-	/* Calculate number of pages */
-	msgbufaddr = (__u64)msg->msgbuf;
-	first = (msgbufaddr & PAGE_MASK) >> PAGE_SHIFT;
-	last = ((msgbufaddr + msg->buflen - 1) & PAGE_MASK) >> PAGE_SHIFT;
+	sg_miter_start(&miter, sgt->sgl, sgt->nents, to_user ? SG_MITER_FROM_SG : SG_MITER_TO_SG);
 
-	/* Get number of pages used by user space message buffer (msgbuf) */
-	msg_pages->nr_pages = last - first + 1;
+	if (skip && !sg_miter_skip(&miter, skip))
+		goto out;
 
-	/* Allocate array of page pointers */
-	msg_pages->pages = kmalloc_array(msg_pages->nr_pages, sizeof(struct page*), GFP_KERNEL);
-	if (!msg_pages->pages)
-		return -ENOMEM;
+	count_max = min(count_max, ulen);
 
-	/* Get offset into first page */
-	msg_pages->offset = offset_in_page(msg->msgbuf);
+	while (count < count_max && sg_miter_next(&miter)) {
+		len = min(miter.length, count_max - count);
 
-	/* Copy size of the message */
-	msg_pages->size = msg->buflen;
+		if (to_user)
+			left = copy_to_user(ubuf + count, miter.addr, len);
+		else
+			left = copy_from_user(miter.addr, ubuf + count, len);
 
-	status = get_user_pages_fast(msgbufaddr & PAGE_MASK, msg_pages->nr_pages, FOLL_WRITE /* gup_flags */, msg_pages->pages);
-	if (status < 0) {
-		stplr_dbg_at1("[%d:%d] failed to get user pages (nr_pages: %d)\n",
-			current->group_leader->pid, current->pid,
-			msg_pages->nr_pages);
-		kfree(msg_pages->pages);
-		return status;
+		count += len - left;
+		if (left)
+			break;
 	}
 
-	msg_pages->nr_pages = status;
+out:
+	sg_miter_stop(&miter);
 
-	stplr_dbg_at3("[%d:%d] size: %u, offset: %u, pinned_pages: %d\n",
-		current->group_leader->pid, current->pid,
-		msg_pages->size, msg_pages->offset, msg_pages->nr_pages);
-	for (int i = 0; i < msg_pages->nr_pages; i++)
-		stplr_dbg_at4("[%d:%d] pfn: %lu\n",
-			current->group_leader->pid, current->pid,
-			page_to_pfn(msg_pages->pages[i]));
+	return count;
+}
 
-	status = sg_alloc_table_from_pages(&msg_pages->sgt, msg_pages->pages, msg_pages->nr_pages, msg_pages->offset, msg_pages->size, GFP_KERNEL);
-	if (status) {
-		stplr_dbg_at1("[%d:%d] failed to initialize sg table (nr_pages: %d, size: %u)\n",
-			current->group_leader->pid, current->pid,
-			msg_pages->nr_pages, msg_pages->size);
-		/* Release lock on all pages */
-		for (int i = 0; i < msg_pages->nr_pages; i++)
-			put_page(msg_pages->pages[i]);
-		kfree(msg_pages->pages);
-		return status;
-	}
+/*
+ * Copies up to @count_max bytes from the message @src (skipping its first
+ * @src_skip bytes) to the message @dst (skipping its first @dst_skip bytes).
+ * At most one of the messages may be a local one (not pinned), which
+ * is then accessed by its user space address. That is fine, as local
+ * messages are only ever accessed by the threads of the process owning them.
+ */
+static size_t stplr_copy_msg_range(struct stplr_msg_pages *dst, size_t dst_skip,
+	struct stplr_msg_pages *src, size_t src_skip, size_t count_max)
+{
+	if (WARN_ON_ONCE(dst->ubuf && src->ubuf))
+		return 0;
 
-#if defined(STPLR_DEBUG)
-	stplr_print_buffer(&msg_pages->sgt);
-#endif
+	if (dst->ubuf)
+		return dst_skip < dst->buflen ?
+			stplr_copy_user_range(dst->ubuf + dst_skip, dst->buflen - dst_skip,
+				&src->sgt, src_skip, count_max, true) : 0;
 
-	return 0;
-}
+	if (src->ubuf)
+		return src_skip < src->buflen ?
+			stplr_copy_user_range(src->ubuf + src_skip, src->buflen - src_skip,
+				&dst->sgt, dst_skip, count_max, false) : 0;
 
-static void stplr_put_user_pages(struct stplr_msg_pages *msg_pages)
-{
-	sg_free_table(&msg_pages->sgt);
-	/* Release lock on all pages */
-	for (int i = 0; i < msg_pages->nr_pages; i++)
-		put_page(msg_pages->pages[i]);
-	kfree(msg_pages->pages);
+	return stplr_copy_buffers_range(&dst->sgt, dst_skip, &src->sgt, src_skip, count_max);
 }
 
-static int stplr_thread_init_msgs(struct stplr_thread *thread, const struct stplr_msgs *msgs, int buffer_id)
+/* copies (up to) @len first bytes of the message to the kernel buffer @buf */
+static size_t stplr_copy_msg_head(struct stplr_msg_pages *msg_pages, void *buf, size_t len)
 {
-	int ret = -EFAULT;
-	struct stplr_msg *msg;
-	struct stplr_msg_pages *msg_pages;
-	struct stplr_thread_msg_buffer *buffer;
-	__u32 n;
+	len = min_t(size_t, len, msg_pages->buflen);
 
-	buffer = &thread->buffers[buffer_id];
+	if (msg_pages->ubuf)
+		return len - copy_from_user(buf, msg_pages->ubuf, len);
 
-	BUG_ON(buffer->msgs);
-	BUG_ON(buffer->nmsgs);
+	return sg_copy_to_buffer(msg_pages->sgt.sgl, msg_pages->sgt.nents, buf, len);
+}
 
-	buffer->nmsgs = msgs->count;
-	buffer->msgs = kzalloc(buffer->nmsgs * (sizeof(struct stplr_msg) + sizeof(struct stplr_msg_pages)), GFP_KERNEL);
-	if (!buffer->msgs)
-		return -ENOMEM;
+/* copies the whole message to the kernel buffer @buf */
+static size_t stplr_copy_msg_to_buffer(struct stplr_msg_pages *msg_pages, void *buf)
+{
+	return stplr_copy_msg_head(msg_pages, buf, msg_pages->buflen);
+}
 
-	if (copy_from_user(buffer->msgs, msgs->msgs, buffer->nmsgs * sizeof(struct stplr_msg)))
-		return -EFAULT;
+/*
+ * Copies data between two arrays of messages, each of them treated
+ * as one contiguous stream of bytes (of the size being the sum of buflens),
+ * starting at @dst_offset and @src_offset respectively.
+ * Returns number of copied bytes.
+ */
+static size_t stplr_copy_msgs(struct stplr_msg_pages *dst, __u32 dst_nmsgs, size_t dst_offset,
+	struct stplr_msg_pages *src, __u32 src_nmsgs, size_t src_offset)
+{
+	__u32 d = 0;
+	__u32 s = 0;
+	size_t len;
+	size_t copied;
+	size_t count = 0;
 
-	msg = stplr_thread_get_msgs(thread, buffer_id);
-	msg_pages = stplr_thread_get_msg_pages(thread, buffer_id);
+	while (d < dst_nmsgs && dst_offset >= dst[d].buflen)
+		dst_offset -= dst[d++].buflen;
 
-	for (n = 0; n < buffer->nmsgs; n++) {
-		int status;
+	while (s < src_nmsgs && src_offset >= src[s].buflen)
+		src_offset -= src[s++].buflen;
 
-		status = stplr_get_user_pages(&msg[n], &msg_pages[n]);
-		if (status) {
-			ret = status;
+	while (d < dst_nmsgs && s < src_nmsgs) {
+		len = min(dst[d].buflen - dst_offset, src[s].buflen - src_offset);
+		copied = stplr_copy_msg_range(
+			&dst[d], dst_offset, &src[s], src_offset, len);
+		count += copied;
+		if (copied < len)
 			break;
+
+		dst_offset += len;
+		if (dst_offset == dst[d].buflen) {
+			dst_offset = 0;
+			d++;
+		}
+
+		src_offset += len;
+		if (src_offset == src[s].buflen) {
+			src_offset = 0;
+			s++;
 		}
 	}
 
-	if (n < buffer->nmsgs) {
+	return count;
+}
+
+/*
+ * Returns how many bytes of the [@offset, @offset + @count) range
+ * of the messages stream fall into the message @n.
+ */
+static __u32 stplr_msgs_range_part(const struct stplr_msg_pages *msg_pages, __u32 n,
+	size_t offset, size_t count)
+{
+	size_t start = 0;
+	size_t end;
+	__u32 i;
+
+	for (i = 0; i < n; i++)
+		start += msg_pages[i].buflen;
+	end = start + msg_pages[n].buflen;
+
+	start = max(start, offset);
+	end = min(end, offset + count);
+
+	return end > start ? end - start : 0;
+}
+
+static size_t stplr_msgs_total_size(const struct stplr_msg_pages *msg_pages, __u32 nmsgs)
+{
+	size_t size = 0;
+	__u32 n;
+
+	for (n = 0; n < nmsgs; n++)
+		size += msg_pages[n].buflen;
+
+	return size;
+}
+
+/*
+ * Copies n-th source message into n-th destination message and sets sizes
+ * of both to the number of copied bytes (excess messages of either side
+ * get size 0). @pid and @tid identify the peer thread (for tracing only).
+ * Returns total number of copied bytes.
+ */
+static size_t stplr_copy_msg_pages(struct stplr_msg_pages *dst, __u32 dst_nmsgs,
+	struct stplr_msg_pages *src, __u32 src_nmsgs, pid_t pid, pid_t tid)
+{
+	size_t count = 0;
+	__u32 nmsgs;
+	__u32 n;
+
+	nmsgs = min(dst_nmsgs, src_nmsgs);
+
+	if (trace_stplr_copy_start_enabled())
+		trace_stplr_copy_start(pid, tid, nmsgs, stplr_msgs_total_size(src, src_nmsgs));
+
+	for (n = 0; n < nmsgs; n++) {
+		dst[n].size =
+		src[n].size =
+			stplr_copy_msg_range(&dst[n], 0, &src[n], 0, SIZE_MAX);
+		count += dst[n].size;
+	}
+
+	for (n = nmsgs; n < dst_nmsgs; n++)
+		dst[n].size = 0;
+
+	for (n = nmsgs; n < src_nmsgs; n++)
+		src[n].size = 0;
+
+	trace_stplr_copy_end(pid, tid, nmsgs, count);
+
+	return count;
+}
+
+#if defined(STPLR_DEBUG)
+static void stplr_print_buffer(struct sg_table *sgt)
+{
+	struct sg_mapping_iter miter;
+	unsigned int sg_flags = SG_MITER_FROM_SG;
+
+	stplr_dbg_at3("sgt->nents: %u\n", sgt->nents);
+
+	sg_miter_start(&miter, sgt->sgl, sgt->nents, sg_flags);
+
+	while (sg_miter_next(&miter)) {
+		stplr_dbg_at4("addr: %px\n", miter.addr);
+		stplr_dbg_at4("length: %zu\n", miter.length);
+		stplr_dbg_at4("consumed: %zu\n", miter.consumed);
+		stplr_dbg_at4("__offset: %u\n", miter.__offset);
+		stplr_dbg_at4("__remaining: %u\n", miter.__remaining);
+	}
+
+	sg_miter_stop(&miter);
+}
+#endif
+
+/* number of pages spanned by user space message buffer (msgbuf) */
+static int stplr_msg_nr_pages(const struct stplr_msg *msg)
+{
+	__u64 msgbufaddr;
+	unsigned long first, last;
+
+	msgbufaddr = (__u64)msg->msgbuf;
+	first = (msgbufaddr & PAGE_MASK) >> PAGE_SHIFT;
+	last = ((msgbufaddr + msg->buflen - 1) & PAGE_MASK) >> PAGE_SHIFT;
+
+	return last - first + 1;
+}
+
+/*
+ * Pins user pages of the message. Page pointers and scatterlist entries
+ * are taken from @pages and @sgl arrays (of stplr_msg_nr_pages() entries),
+ * so nothing is allocated here.
+ */
+static int stplr_get_user_pages(const struct stplr_msg *msg, struct stplr_msg_pages *msg_pages,
+	struct page **pages, struct scatterlist *sgl)
+{
+	int status;
+	__u64 msgbufaddr;
+	__u32 remaining;
+	__u32 offset;
+	__u32 length;
+
+	msgbufaddr = (__u64)msg->msgbuf;
+	msg_pages->nr_pages = stplr_msg_nr_pages(msg);
+	msg_pages->pages = pages;
+
+	/* Get offset into first page */
+	msg_pages->offset = offset_in_page(msg->msgbuf);
+
+	/* Copy size of the message */
+	msg_pages->size = msg->buflen;
+	msg_pages->buflen = msg->buflen;
+	msg_pages->written = 0;
+	msg_pages->ubuf = NULL;
+
+	memset(&msg_pages->sgt, 0, sizeof(msg_pages->sgt));
+	if (msg_pages->nr_pages <= 0) {
+		msg_pages->nr_pages = 0;
+		return 0;
+	}
+
+	status = get_user_pages_fast(msgbufaddr & PAGE_MASK, msg_pages->nr_pages, FOLL_WRITE /* gup_flags */, msg_pages->pages);
+	if (status != msg_pages->nr_pages) {
+		stplr_dbg_at1("[%d:%d] failed to get user pages (nr_pages: %d, status: %d)\n",
+			current->group_leader->pid, current->pid,
+			msg_pages->nr_pages, status);
+		/* Release lock on pages pinned so far */
+		for (int i = 0; i < status; i++)
+			put_page(msg_pages->pages[i]);
+		return status < 0 ? status : -EFAULT;
+	}
+
+	stplr_dbg_at3("[%d:%d] size: %u, offset: %u, pinned_pages: %d\n",
+		current->group_leader->pid, current->pid,
+		msg_pages->size, msg_pages->offset, msg_pages->nr_pages);
+	for (int i = 0; i < msg_pages->nr_pages; i++)
+		stplr_dbg_at4("[%d:%d] pfn: %lu\n",
+			current->group_leader->pid, current->pid,
+			page_to_pfn(msg_pages->pages[i]));
+
+	offset = msg_pages->offset;
+	remaining = msg_pages->size;
+
+	sg_init_table(sgl, msg_pages->nr_pages);
+	for (int i = 0; i < msg_pages->nr_pages; i++) {
+		length = min_t(__u32, PAGE_SIZE - offset, remaining);
+		sg_set_page(&sgl[i], msg_pages->pages[i], length, offset);
+		remaining -= length;
+		offset = 0;
+	}
+
+	msg_pages->sgt.sgl = sgl;
+	msg_pages->sgt.nents = msg_pages->nr_pages;
+	msg_pages->sgt.orig_nents = msg_pages->nr_pages;
+
+#if defined(STPLR_DEBUG)
+	stplr_print_buffer(&msg_pages->sgt);
+#endif
+
+	return 0;
+}
+
+static void stplr_put_user_pages(struct stplr_msg_pages *msg_pages)
+{
+	/* Release lock on all pages */
+	for (int i = 0; i < msg_pages->nr_pages; i++)
+		put_page(msg_pages->pages[i]);
+}
+
+/*
+ * Copies the array of user space messages into the buffer (which is not initialized yet),
+ * or its copy @kmsgs if the array has already been imported (see stplr_msgv_import()).
+ */
+static int stplr_msg_buffer_copy_msgs(struct stplr_thread_msg_buffer *buffer, const struct stplr_msgs *msgs,
+	const struct stplr_msg *kmsgs)
+{
+	int ret;
+
+	BUG_ON(buffer->nmsgs);
+
+	ret = stplr_msg_buffer_reserve(buffer, msgs->count, 0);
+	if (ret)
+		return ret;
+
+	if (kmsgs) {
+		memcpy(stplr_msg_buffer_get_msgs(buffer), kmsgs, msgs->count * sizeof(struct stplr_msg));
+		return 0;
+	}
+
+	if (copy_from_user(stplr_msg_buffer_get_msgs(buffer), msgs->msgs, msgs->count * sizeof(struct stplr_msg)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int stplr_msg_buffer_init(struct stplr_thread_msg_buffer *buffer, const struct stplr_msgs *msgs,
+	const struct stplr_msg *kmsgs)
+{
+	int ret = -EFAULT;
+	struct stplr_msg *msg;
+	struct stplr_msg_pages *msg_pages;
+	__u32 nr_pages;
+	__u32 n;
+
+	ret = stplr_msg_buffer_copy_msgs(buffer, msgs, kmsgs);
+	if (ret)
+		return ret;
+
+	msg = stplr_msg_buffer_get_msgs(buffer);
+
+	/* all the allocations (if any) take place before a single page gets pinned */
+	for (n = 0, nr_pages = 0; n < msgs->count; n++)
+		if (check_add_overflow(nr_pages, (__u32)max(stplr_msg_nr_pages(&msg[n]), 0), &nr_pages))
+			return -EINVAL;
+
+	ret = stplr_msg_buffer_reserve(buffer, msgs->count, nr_pages);
+	if (ret)
+		return ret;
+
+	buffer->nmsgs = msgs->count;
+	msg_pages = stplr_msg_buffer_get_msg_pages(buffer);
+
+	for (n = 0, nr_pages = 0; n < buffer->nmsgs; n++) {
+		ret = stplr_get_user_pages(&msg[n], &msg_pages[n],
+			&buffer->pages[nr_pages], &buffer->sgl[nr_pages]);
+		if (ret)
+			break;
+
+		nr_pages += msg_pages[n].nr_pages;
+	}
+
+	if (n < buffer->nmsgs) {
 		while (n-- > 0)
 			stplr_put_user_pages(&msg_pages[n]);
+		buffer->nmsgs = 0;
+		return ret;
+	}
+
+	buffer->nr_pages = nr_pages;
+
+	return 0;
+}
+
+/*
+ * Initializes the buffer of a call between threads of the same process.
+ * Both peers share the address space, so the messages are accessed
+ * directly by their user space addresses and no page gets pinned.
+ */
+static int stplr_msg_buffer_init_local(struct stplr_thread_msg_buffer *buffer, const struct stplr_msgs *msgs,
+	const struct stplr_msg *kmsgs)
+{
+	int ret;
+	struct stplr_msg *msg;
+	struct stplr_msg_pages *msg_pages;
+	__u32 n;
+
+	ret = stplr_msg_buffer_copy_msgs(buffer, msgs, kmsgs);
+	if (ret)
+		return ret;
+
+	msg = stplr_msg_buffer_get_msgs(buffer);
+
+	for (n = 0; n < msgs->count; n++)
+		if (!access_ok(msg[n].msgbuf, msg[n].buflen))
+			return -EFAULT;
+
+	buffer->nmsgs = msgs->count;
+	buffer->nr_pages = 0;
+	msg_pages = stplr_msg_buffer_get_msg_pages(buffer);
+
+	for (n = 0; n < buffer->nmsgs; n++) {
+		memset(&msg_pages[n], 0, sizeof(msg_pages[n]));
+		msg_pages[n].size = msg[n].buflen;
+		msg_pages[n].buflen = msg[n].buflen;
+		msg_pages[n].ubuf = (void __user *)msg[n].msgbuf;
+	}
+
+	return 0;
+}
+
+/* unpins the pages, the storage is kept for the next use of the buffer */
+static void stplr_msg_buffer_deinit(struct stplr_thread_msg_buffer *buffer)
+{
+	struct stplr_msg_pages *msg_pages;
+	__u32 n;
+
+	msg_pages = stplr_msg_buffer_get_msg_pages(buffer);
+
+	for (n = 0; n < buffer->nmsgs; n++)
+		stplr_put_user_pages(&msg_pages[n]);
+
+	buffer->nmsgs = 0;
+	buffer->nr_pages = 0;
+}
+
+static void stplr_msg_buffer_destroy(struct stplr_thread_msg_buffer *buffer)
+{
+	stplr_msg_buffer_deinit(buffer);
+	stplr_msg_buffer_free(buffer);
+}
+
+/*
+ * Imports the messages of a v2 ioctl the way import_iovec() does. Up to
+ * STPLR_MSGV_INLINE (UIO_FASTIOV) messages come inline with the ioctl argument,
+ * which has already been copied, so they are used in place. Larger arrays
+ * (up to UIO_MAXIOV messages) are copied into an allocated one.
+ * The result shall be released by stplr_msgv_release().
+ */
+static struct stplr_msg *stplr_msgv_import(struct stplr_msgv *msgv)
+{
+	struct stplr_msg *kmsgs;
+
+	if (msgv->pad)
+		return ERR_PTR(-EINVAL);
+
+	if (msgv->count <= STPLR_MSGV_INLINE)
+		return msgv->inline_msgs;
+
+	if (msgv->count > UIO_MAXIOV)
+		return ERR_PTR(-EINVAL);
+
+	kmsgs = kmalloc_array(msgv->count, sizeof(struct stplr_msg), GFP_KERNEL);
+	if (!kmsgs)
+		return ERR_PTR(-ENOMEM);
+
+	if (copy_from_user(kmsgs, msgv->msgs, msgv->count * sizeof(struct stplr_msg))) {
+		kfree(kmsgs);
+		return ERR_PTR(-EFAULT);
+	}
+
+	return kmsgs;
+}
+
+static void stplr_msgv_release(struct stplr_msgv *msgv, struct stplr_msg *kmsgs)
+{
+	if (kmsgs != msgv->inline_msgs)
+		kfree(kmsgs);
+}
+
+/* user space array of the messages of a v2 ioctl (@umsgv is where @msgv has been copied from) */
+static struct stplr_msg __user *stplr_msgv_user_msgs(struct stplr_msgv __user *umsgv, const struct stplr_msgv *msgv)
+{
+	if (msgv->count <= STPLR_MSGV_INLINE)
+		return umsgv->inline_msgs;
+
+	return (struct stplr_msg __user *)msgv->msgs;
+}
+
+/* writes the imported messages (with their sizes updated) back at once */
+static int stplr_msgv_export(struct stplr_msgv __user *umsgv, const struct stplr_msgv *msgv,
+	const struct stplr_msg *kmsgs)
+{
+	if (copy_to_user(stplr_msgv_user_msgs(umsgv, msgv), kmsgs, msgv->count * sizeof(struct stplr_msg)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Passes the numbers of actually copied bytes back to the user space messages
+ * or, if they have been imported by a v2 ioctl, to their copy @kmsgs.
+ */
+static void stplr_msgs_put_sizes(const struct stplr_msgs *msgs, struct stplr_msg *kmsgs,
+	const struct stplr_msg_pages *msg_pages, __u32 nmsgs)
+{
+	__u32 n;
+
+	if (kmsgs) {
+		for (n = 0; n < nmsgs; n++)
+			kmsgs[n].buflen = msg_pages[n].size;
+		return;
+	}
+
+	for (n = 0; n < nmsgs; n++)
+		put_user(msg_pages[n].size, (__u32 __user *)&msgs->msgs[n].buflen);
+}
+
+/*
+ * @sync tells that the waking thread is about to sleep (waiting for the woken
+ * one), so with STPLR_OPT_WAKE_AFFINE the scheduler is hinted to run the woken
+ * thread on the waker's cpu.
+ */
+static void stplr_thread_wake_up(struct stplr_thread *thread, bool sync)
+{
+	if (sync && READ_ONCE(thread->wake_affine))
+		wake_up_interruptible_sync(&thread->wait);
+	else
+		wake_up(&thread->wait);
+}
+
+/*
+ * Marks the receiving thread as waiting for calls (or not). Threads taking
+ * part in work stealing are also put on the idle stealers list of their
+ * process, so that busy siblings find them without walking all the threads.
+ * Only the owner puts the thread on the list, while it may be taken off
+ * the list by stplr_thread_kick_stealer() as well.
+ */
+static void stplr_thread_set_idle(struct stplr_thread *thread, bool idle)
+{
+	struct stplr_process *process = thread->parent;
+
+	WRITE_ONCE(thread->idle, idle);
+
+	if (idle && !READ_ONCE(thread->work_stealing))
+		return;
+
+	if (!idle && list_empty(&thread->idle_node))
+		return;
+
+	spin_lock(&process->stealers_lock);
+	if (idle)
+		list_add(&thread->idle_node, &process->idle_stealers);
+	else
+		list_del_init(&thread->idle_node);
+	spin_unlock(&process->stealers_lock);
+}
+
+/*
+ * Wakes up an idle sibling (taking part in work stealing) of the busy
+ * receiving thread, so that it steals the call just queued. This is best
+ * effort only, the call is served by its receiving thread anyway.
+ */
+static void stplr_thread_kick_stealer(struct stplr_thread *thread)
+{
+	struct stplr_process *process = thread->parent;
+	struct stplr_thread *sibling;
+
+	spin_lock(&process->stealers_lock);
+
+	list_for_each_entry(sibling, &process->idle_stealers, idle_node)
+		if (sibling != thread) {
+			list_del_init(&sibling->idle_node);
+			WRITE_ONCE(sibling->steal_kick, true);
+			wake_up(&sibling->wait);
+			break;
+		}
+
+	spin_unlock(&process->stealers_lock);
+}
+
+/* the lower the score, the better the thread suits the call of the current thread */
+static unsigned int stplr_thread_dispatch_score(struct stplr_thread *thread, int policy, int cpu)
+{
+	bool idle = READ_ONCE(thread->idle);
+	int thread_cpu = READ_ONCE(thread->cpu);
+
+	if (policy == STPLR_DISPATCH_CPU_LOCAL && idle)
+		return thread_cpu == cpu ? 0 : cpus_share_cache(thread_cpu, cpu) ? 1 : 2;
+
+	return idle ? 2 : 3 + READ_ONCE(thread->queue.ncalls);
+}
+
+/* whether the thread is one of the threads the calls of its siblings may be dispatched to */
+static bool stplr_thread_dispatchable(struct stplr_thread *thread)
+{
+	return (READ_ONCE(thread->work_stealing) || READ_ONCE(thread->dispatch) != STPLR_DISPATCH_NONE) &&
+		!atomic_read(&thread->zombie);
+}
+
+/*
+ * Chooses the thread which gets the call addressed to @rthread, according to
+ * the dispatch policy of @rthread. Takes a strong reference to the chosen
+ * thread, dropping the one to @rthread if another thread has been chosen.
+ * The siblings are walked under rcu read lock, so the choice is racy
+ * (the chosen thread may just be getting another call), but it never blocks
+ * the sender.
+ */
+static struct stplr_thread *stplr_thread_dispatch(struct stplr_thread *rthread)
+{
+	struct stplr_process *rprocess = rthread->parent;
+	struct stplr_thread *chosen = rthread;
+	struct stplr_thread *thread;
+	int policy = READ_ONCE(rthread->dispatch);
+	int cpu = raw_smp_processor_id();
+	unsigned int score = UINT_MAX;
+	unsigned int s;
+	u32 nthreads = 0;
+	u32 n = 0;
+
+	if (policy == STPLR_DISPATCH_NONE)
+		return rthread;
+
+	rcu_read_lock();
+
+	if (policy == STPLR_DISPATCH_ROUND_ROBIN) {
+		list_for_each_entry_rcu(thread, &rprocess->siblings, sibling_node)
+			if (stplr_thread_dispatchable(thread))
+				nthreads++;
+
+		if (nthreads)
+			n = (u32)atomic_inc_return(&rprocess->dispatch_seq) % nthreads;
+	}
+
+	list_for_each_entry_rcu(thread, &rprocess->siblings, sibling_node) {
+		if (!stplr_thread_dispatchable(thread))
+			continue;
+
+		if (policy == STPLR_DISPATCH_ROUND_ROBIN) {
+			if (n-- == 0) {
+				chosen = thread;
+				break;
+			}
+			continue;
+		}
+
+		s = stplr_thread_dispatch_score(thread, policy, cpu);
+		if (s < score) {
+			score = s;
+			chosen = thread;
+			if (s == 0)
+				break;
+		}
+	}
+
+	if (chosen != rthread && !kref_get_unless_zero(&chosen->kref))
+		chosen = rthread;
+
+	rcu_read_unlock();
+
+	if (chosen != rthread)
+		stplr_thread_put(rthread);
+
+	return chosen;
+}
+
+/*
+ * Looks up the thread @tid of @process the way dispatch does, under rcu
+ * instead of threads_lock. Returns it with a strong reference taken
+ * or NULL if there is no such (live) thread.
+ */
+static struct stplr_thread *stplr_thread_get_sibling(struct stplr_process *process, pid_t tid)
+{
+	struct stplr_thread *thread;
+	struct stplr_thread *found = NULL;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(thread, &process->siblings, sibling_node)
+		if (thread->tid == tid) {
+			if (!atomic_read(&thread->zombie) && kref_get_unless_zero(&thread->kref))
+				found = thread;
+			break;
+		}
+	rcu_read_unlock();
+
+	return found;
+}
+
+/* the context is read from the (already initialized) message buffer, not from the user space */
+static int stplr_filter_ctx_init(struct stplr_filter_ctx *ctx, struct stplr_thread *lthread,
+	struct stplr_thread *rthread, struct stplr_thread_msg_buffer *buffer)
+{
+	struct stplr_msg_pages *msg_pages = stplr_msg_buffer_get_msg_pages(buffer);
+	__u32 n;
+
+	BUILD_BUG_ON(sizeof(*ctx) < MAX_BPF_FUNC_ARGS * sizeof(u64));
+
+	ctx->pid = lthread->parent->pid;
+	ctx->tid = lthread->tid;
+	ctx->rtid = rthread->tid;
+	ctx->nmsgs = buffer->nmsgs;
+
+	for (n = 0; n < buffer->nmsgs; n++)
+		ctx->bytes += msg_pages[n].buflen;
+
+	if (buffer->nmsgs) {
+		ctx->payload_len = min_t(__u32, msg_pages[0].buflen, STPLR_FILTER_PAYLOAD);
+		if (stplr_copy_msg_head(&msg_pages[0], ctx->payload, ctx->payload_len) != ctx->payload_len)
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
+/*
+ * Runs the STPLR_OPT_FILTER program of @rthread for the messages of @lthread
+ * (initialized in @buffer). Returns the thread the messages shall be queued to,
+ * taking a strong reference to it if another thread than @rthread has been
+ * chosen, or an error pointer if they shall not be queued at all. Either way
+ * the reference to @rthread is kept.
+ */
+static struct stplr_thread *stplr_thread_filter(struct stplr_thread *rthread,
+	struct stplr_thread *lthread, struct stplr_thread_msg_buffer *buffer, bool *priority)
+{
+	struct stplr_filter_ctx ctx = {};
+	struct bpf_trace_run_ctx run_ctx = {};
+	struct bpf_run_ctx *old_run_ctx;
+	struct stplr_thread *thread;
+	struct bpf_prog *prog;
+	u32 verdict = STPLR_FILTER_PASS;
+	pid_t tid;
+	int ret;
+
+	*priority = false;
+
+	if (!rcu_access_pointer(rthread->filter))
+		return rthread;
+
+	/* might fault, so the context is prepared before entering rcu read side */
+	ret = stplr_filter_ctx_init(&ctx, lthread, rthread, buffer);
+	if (ret)
+		return ERR_PTR(ret);
+
+	/*
+	 * The program is run the way __bpf_trace_run() runs raw tracepoint programs:
+	 * with the same recursion protection and with a run context of its own
+	 * (there is no link, so bpf_get_attach_cookie() gives 0).
+	 */
+	rcu_read_lock();
+	prog = rcu_dereference(rthread->filter);
+	if (prog) {
+		preempt_disable();
+		if (likely(this_cpu_inc_return(*(prog->active)) == 1)) {
+			old_run_ctx = bpf_set_run_ctx(&run_ctx.run_ctx);
+			verdict = bpf_prog_run(prog, &ctx);
+			bpf_reset_run_ctx(old_run_ctx);
+		} else {
+			verdict = STPLR_FILTER_DROP;
+		}
+		this_cpu_dec(*(prog->active));
+		preempt_enable();
+	}
+	rcu_read_unlock();
+
+	if (verdict == STPLR_FILTER_DROP) {
+		stplr_dbg_at2("[%d:%d] messages to %d:%d dropped by filter\n",
+			current->group_leader->pid, current->pid,
+			rthread->parent->pid, rthread->tid);
+		return ERR_PTR(-EPERM);
+	}
+
+	*priority = verdict & STPLR_FILTER_F_PRIORITY;
+
+	/*
+	 * Nothing verifies the return value of raw tracepoint programs,
+	 * so any other value is taken for a thread id and checked here.
+	 */
+	tid = verdict & ~STPLR_FILTER_F_PRIORITY;
+	if (tid == STPLR_FILTER_PASS || tid == rthread->tid)
+		return rthread;
+
+	thread = stplr_thread_get_sibling(rthread->parent, tid);
+	if (!thread) {
+		stplr_dbg_at2("[%d:%d] filter of %d:%d returned unknown thread %d\n",
+			current->group_leader->pid, current->pid,
+			rthread->parent->pid, rthread->tid, tid);
+		return ERR_PTR(-ENODEV);
+	}
+
+	return thread;
+}
+
+/* counts the messages being copied from pages of a numa node other than the one of the current cpu */
+static void stplr_thread_account_numa(struct stplr_thread *thread, const struct stplr_msg_pages *msg_pages, __u32 nmsgs)
+{
+	int node = numa_node_id();
+	__u32 n;
+
+	for (n = 0; n < nmsgs; n++)
+		if (msg_pages[n].nr_pages && page_to_nid(msg_pages[n].pages[0]) != node) {
+			thread->counters.remote_copies++;
+			break;
+		}
+}
+
+static void stplr_thread_account_pinned(struct stplr_thread *thread, const struct stplr_thread_msg_buffer *buffer)
+{
+	thread->counters.pinned_pages += buffer->nr_pages;
+}
+
+static unsigned int stplr_stats_bucket(u64 value)
+{
+	return value ? min_t(unsigned int, ilog2(value), STPLR_STATS_BUCKETS - 1) : 0;
+}
+
+#define stplr_stats_record(stats, histogram, value) \
+	this_cpu_inc((stats)->histograms[histogram].buckets[stplr_stats_bucket(value)])
+
+/*
+ * Histograms are allocated lazily, so that threads which only send
+ * do not pay for per cpu memory. If the allocation fails, the thread
+ * just does not collect them (and tries again with its next receive).
+ */
+static void stplr_thread_alloc_stats(struct stplr_thread *thread)
+{
+	if (likely(thread->stats))
+		return;
+
+	smp_store_release(&thread->stats, alloc_percpu(struct stplr_thread_stats));
+}
+
+static void stplr_thread_stats_sum(struct stplr_thread *thread, int histogram, struct stplr_stats_histogram *sum)
+{
+	struct stplr_thread_stats __percpu *stats = smp_load_acquire(&thread->stats);
+	const struct stplr_stats_histogram *h;
+	int cpu;
+	int b;
+
+	memset(sum, 0, sizeof(*sum));
+
+	if (!stats)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		h = &per_cpu_ptr(stats, cpu)->histograms[histogram];
+		for (b = 0; b < STPLR_STATS_BUCKETS; b++)
+			sum->buckets[b] += READ_ONCE(h->buckets[b]);
+	}
+}
+
+/* counts recorded concurrently with the reset might get lost */
+static void stplr_thread_stats_reset(struct stplr_thread *thread)
+{
+	struct stplr_thread_stats __percpu *stats = smp_load_acquire(&thread->stats);
+	int cpu;
+
+	if (!stats)
+		return;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(stats, cpu), 0, sizeof(struct stplr_thread_stats));
+}
+
+static void stplr_thread_account_received(struct stplr_thread *thread, size_t bytes, u64 queued_ns, u64 copy_start_ns)
+{
+	struct stplr_thread_stats __percpu *stats = thread->stats;
+
+	thread->counters.msgs++;
+	thread->counters.bytes += bytes;
+
+	if (stats) {
+		stplr_stats_record(stats, STPLR_STATS_SIZE, bytes);
+		stplr_stats_record(stats, STPLR_STATS_QUEUE_NS, copy_start_ns - queued_ns);
+		stplr_stats_record(stats, STPLR_STATS_COPY_NS, ktime_get_ns() - copy_start_ns);
+	}
+}
+
+/* reads the deadline of the blocking operation of the thread (KTIME_MAX if there is none) */
+static int stplr_thread_get_deadline(struct stplr_thread *thread, ktime_t *deadline)
+{
+	u64 deadline_ns = 0;
+
+	if (thread->deadline && get_user(deadline_ns, thread->deadline))
+		return -EFAULT;
+
+	*deadline = deadline_ns && deadline_ns <= KTIME_MAX ? ns_to_ktime(deadline_ns) : KTIME_MAX;
+
+	return 0;
+}
+
+static void stplr_thread_put_timestamps(struct stplr_thread *thread,
+	u64 enqueue_ns, u64 dequeue_ns, u64 reply_ns, u64 reply_copy_ns)
+{
+	struct stplr_timestamps timestamps = {
+		.enqueue_ns = enqueue_ns,
+		.dequeue_ns = dequeue_ns,
+		.reply_ns = reply_ns,
+		.reply_copy_ns = reply_copy_ns,
+	};
+
+	/*
+	 * The message has already been consumed, so the ioctl does not fail,
+	 * but the registration is dropped, so that user space does not take
+	 * stale timestamps for valid ones (STPLR_HANDLE_GET_OPTION shows 0).
+	 */
+	if (thread->timestamps)
+		if (copy_to_user(thread->timestamps, &timestamps, sizeof(timestamps))) {
+			stplr_dbg_at1("[%d:%d] cannot report timestamps\n",
+				current->group_leader->pid, current->pid);
+			thread->timestamps = NULL;
+		}
+}
+
+static void stplr_thread_account_replied(struct stplr_thread *thread, u64 queued_ns)
+{
+	struct stplr_thread_stats __percpu *stats = thread->stats;
+
+	if (stats)
+		stplr_stats_record(stats, STPLR_STATS_RTT_NS, ktime_get_ns() - queued_ns);
+}
+
+static int stplr_thread_init_msgs(struct stplr_thread *thread, const struct stplr_msgs *msgs,
+	const struct stplr_msg *kmsgs, int buffer_id)
+{
+	int ret;
+
+	ret = stplr_msg_buffer_init(&thread->buffers[buffer_id], msgs, kmsgs);
+	if (!ret)
+		stplr_thread_account_pinned(thread, &thread->buffers[buffer_id]);
+
+	return ret;
+}
+
+static void stplr_thread_deinit_msgs(struct stplr_thread *thread, int buffer_id)
+{
+	stplr_msg_buffer_deinit(&thread->buffers[buffer_id]);
+	stplr_msg_buffer_trim(&thread->buffers[buffer_id]);
+}
+
+/*
+ * Synchronous calls borrow the preallocated transaction of the client thread
+ * (see stplr_transaction_recycle()), so only a call issued while it is
+ * borrowed (or kept by the server) allocates one.
+ */
+static struct stplr_transaction *stplr_transaction_create(struct stplr_thread *lthread,
+	struct stplr_process *rprocess, struct stplr_thread *rthread, bool reply_required)
+{
+	struct stplr_transaction *t = lthread->spare;
+
+	if (t) {
+		lthread->spare = NULL;
+		memset(t, 0, sizeof(*t));
+	} else {
+		t = kmem_cache_zalloc(stplr_transaction_cache, GFP_KERNEL);
+		if (!t)
+			return NULL;
+	}
+
+	kref_init(&t->kref);
+	t->client = lthread;
+	t->pid = lthread->parent->pid;
+	t->tid = lthread->tid;
+	/* caller holds strong references to both, so they can be just taken */
+	kref_get(&rprocess->kref);
+	t->rprocess = rprocess;
+	kref_get(&rthread->kref);
+	t->rthread = rthread;
+	t->rtid = rthread->tid;
+	INIT_LIST_HEAD(&t->list_node);
+	INIT_LIST_HEAD(&t->call_node);
+	mutex_init(&t->lock);
+	t->reply_required = reply_required;
+
+	return t;
+}
+
+static void stplr_transaction_destroy(struct stplr_transaction *t)
+{
+	stplr_msg_buffer_destroy(&t->buffers[STPLR_THREAD_REPLY_BUFFER]);
+	stplr_msg_buffer_destroy(&t->buffers[STPLR_THREAD_SEND_BUFFER]);
+	stplr_thread_put(t->rthread);
+	stplr_process_put(t->rprocess);
+}
+
+static void stplr_transaction_release(struct kref *kref)
+{
+	struct stplr_transaction *t = container_of(kref, struct stplr_transaction, kref);
+
+	stplr_transaction_destroy(t);
+	kmem_cache_free(stplr_transaction_cache, t);
+}
+
+/*
+ * Calls between threads of the same process do not pin the pages
+ * of the client, the peers just copy from/to its user space buffers.
+ */
+static int stplr_transaction_init_msgs(struct stplr_transaction *t, const struct stplr_msgs *msgs,
+	const struct stplr_msg *kmsgs, int buffer_id)
+{
+	if (t->rprocess == t->client->parent)
+		return stplr_msg_buffer_init_local(&t->buffers[buffer_id], msgs, kmsgs);
+
+	return stplr_msg_buffer_init(&t->buffers[buffer_id], msgs, kmsgs);
+}
+
+/*
+ * Runs the filter of the addressed thread for the (already initialized) send
+ * messages of the call and dispatches the call, retargeting it to the thread
+ * chosen by either of them.
+ */
+static int stplr_transaction_route(struct stplr_transaction *t)
+{
+	struct stplr_thread *thread;
+
+	thread = stplr_thread_filter(t->rthread, t->client, &t->buffers[STPLR_THREAD_SEND_BUFFER], &t->priority);
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+
+	if (thread != t->rthread) {
+		stplr_thread_put(t->rthread);
+		t->rthread = thread;
+	}
+
+	t->rthread = stplr_thread_dispatch(t->rthread);
+
+	return 0;
+}
+
+/*
+ * Synchronous calls use the preallocated message buffers of the client thread,
+ * the storage is given back once the call is completed (an abandoned call
+ * keeps it, as the server might still access it, and frees it on release).
+ */
+static void stplr_transaction_borrow_buffers(struct stplr_transaction *t, struct stplr_thread *thread)
+{
+	int i;
+
+	for (i = 0; i < STPLR_THREAD_NUM_OF_BUFFERS; i++)
+		stplr_msg_buffer_move(&t->buffers[i], &thread->buffers[i]);
+}
+
+static void stplr_transaction_return_buffers(struct stplr_transaction *t, struct stplr_thread *thread)
+{
+	int i;
+
+	mutex_lock(&t->lock);
+	if (!t->abandoned)
+		for (i = 0; i < STPLR_THREAD_NUM_OF_BUFFERS; i++) {
+			stplr_msg_buffer_deinit(&t->buffers[i]);
+			stplr_msg_buffer_move(&thread->buffers[i], &t->buffers[i]);
+			stplr_msg_buffer_trim(&thread->buffers[i]);
+		}
+	mutex_unlock(&t->lock);
+}
+
+/* might sleep, so it must not be called with spinlocks held */
+static void stplr_transaction_put(struct stplr_transaction *t)
+{
+	kref_put(&t->kref, stplr_transaction_release);
+}
+
+/*
+ * Drops the reference of the client thread to its completed synchronous call.
+ * If it is the last one, the transaction becomes the spare of the thread
+ * (only the owner creates and recycles its transactions, so no lock is needed).
+ */
+static void stplr_transaction_recycle(struct stplr_transaction *t, struct stplr_thread *thread)
+{
+	if (!refcount_dec_and_test(&t->kref.refcount))
+		return;
+
+	stplr_transaction_destroy(t);
+
+	if (!thread->spare)
+		thread->spare = t;
+	else
+		kmem_cache_free(stplr_transaction_cache, t);
+}
+
+static struct stplr_msg_pages *stplr_transaction_get_msg_pages(struct stplr_transaction *t, int buffer_id)
+{
+	return stplr_msg_buffer_get_msg_pages(&t->buffers[buffer_id]);
+}
+
+static __u32 stplr_transaction_get_num_of_msgs(struct stplr_transaction *t, int buffer_id)
+{
+	return t->buffers[buffer_id].nmsgs;
+}
+
+/*
+ * Queues the call to the receiving thread, the queue takes its own reference.
+ * Fails with -EAGAIN if the queue is full and with -ENODEV if the thread
+ * is about to die (checked under the queue lock, so the call is either
+ * refused or drained together with the other queued calls).
+ */
+static int stplr_transaction_queue(struct stplr_transaction *t)
+{
+	struct stplr_thread *rthread = t->rthread;
+	struct stplr_transaction *pos;
+	int ret = 0;
+
+	t->bytes = stplr_msgs_total_size(stplr_transaction_get_msg_pages(t, STPLR_THREAD_SEND_BUFFER),
+		stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER));
+	t->queued_ns = ktime_get_ns();
+
+	spin_lock(&rthread->queue.lock);
+	if (atomic_read(&rthread->zombie))
+		ret = -ENODEV;
+	else
+	if (stplr_thread_queue_full_locked(&rthread->queue, t))
+		ret = -EAGAIN;
+	else {
+		kref_get(&t->kref);
+
+		trace_stplr_enqueue(t->pid, t->tid, t->rprocess->pid, rthread->tid,
+			stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER), t->reply_required);
+
+		if (t->priority) {
+			/* behind the calls with priority (if there is none, at the head) */
+			list_for_each_entry(pos, &rthread->queue.head, list_node)
+				if (!pos->priority)
+					break;
+			list_add_tail(&t->list_node, &pos->list_node);
+		} else
+			list_add_tail(&t->list_node, &rthread->queue.head);
+		stplr_thread_queue_account_locked(&rthread->queue, t, 1);
+	}
+	spin_unlock(&rthread->queue.lock);
+
+	if (ret)
+		return ret;
+
+	trace_stplr_wakeup(t->rprocess->pid, rthread->tid);
+	stplr_thread_wake_up(rthread, !t->async);
+
+	if (READ_ONCE(rthread->work_stealing) && !READ_ONCE(rthread->idle))
+		stplr_thread_kick_stealer(rthread);
+
+	return 0;
+}
+
+/* wait condition of stplr_transaction_queue_admitted(), the call is queued outside of the wait */
+static bool stplr_thread_queue_has_room(struct stplr_thread *rthread, struct stplr_transaction *t)
+{
+	bool room;
+
+	spin_lock(&rthread->queue.lock);
+	room = atomic_read(&rthread->zombie) || !stplr_thread_queue_full_locked(&rthread->queue, t);
+	spin_unlock(&rthread->queue.lock);
+
+	return room;
+}
+
+/*
+ * Queues the call, waiting for room in a full queue as long as the client
+ * has chosen, but not past the @deadline of the call (KTIME_MAX if none).
+ * The room may be taken by another client before this one queues its call,
+ * so the call is queued in a loop.
+ */
+static int stplr_transaction_queue_admitted(struct stplr_transaction *t, struct stplr_thread *lthread,
+	ktime_t deadline)
+{
+	u64 wait_us = lthread->admission_wait_us;
+	ktime_t until = deadline;
+	ktime_t now;
+	int ret;
+
+	ret = stplr_transaction_queue(t);
+	if (ret != -EAGAIN || wait_us == 0)
+		return ret;
+
+	if (wait_us != STPLR_ADMISSION_WAIT_FOREVER) {
+		now = ktime_get();
+		if (wait_us < div_u64(KTIME_MAX - now, NSEC_PER_USEC))
+			until = min(deadline, ktime_add_us(now, wait_us));
+	}
+
+	for (;;) {
+		ret = stplr_wait_event_deadline(t->rthread->queue.room, stplr_thread_queue_has_room(t->rthread, t), until);
+		if (ret == -ETIMEDOUT)
+			return until == deadline ? -ETIMEDOUT : -EBUSY;
+		if (ret)
+			return ret;
+
+		ret = stplr_transaction_queue(t);
+		if (ret != -EAGAIN)
+			return ret;
+	}
+}
+
+/* must be called with t->lock held and only if the call is not abandoned */
+static void stplr_transaction_complete(struct stplr_transaction *t, int status)
+{
+	t->served_by = 0;
+	t->status = status;
+	/* pairs with smp_load_acquire() of the client */
+	smp_store_release(&t->completed, true);
+	trace_stplr_wakeup(t->pid, t->tid);
+	stplr_thread_wake_up(t->client, true);
+}
+
+/*
+ * Detaches the call from its client, which does not wait for it anymore
+ * (either it has been interrupted or it is about to die).
+ */
+static void stplr_transaction_abandon(struct stplr_transaction *t)
+{
+	struct stplr_thread *rthread = t->rthread;
+	struct stplr_thread *replier;
+	struct stplr_msg_pages *msg_pages;
+	bool queued = false;
+	__u32 n;
+
+	spin_lock(&rthread->queue.lock);
+	if (!list_empty(&t->list_node)) {
+		list_del_init(&t->list_node);
+		stplr_thread_queue_account_locked(&rthread->queue, t, -1);
+		queued = true;
+	}
+	spin_unlock(&rthread->queue.lock);
+
+	if (queued)
+		stplr_transaction_put(t);
+
+	mutex_lock(&t->lock);
+
+	t->abandoned = true;
+	t->served_by = 0;
+	replier = t->replier;
+	t->replier = NULL;
+
+	/* release thread blocked in STPLR_MSG_REPLY, nothing of its reply has been copied */
+	if (replier) {
+		msg_pages = stplr_thread_get_msg_pages(replier, STPLR_THREAD_REPLY_BUFFER);
+		for (n = 0; n < stplr_thread_get_num_of_msgs(replier, STPLR_THREAD_REPLY_BUFFER); n++)
+			msg_pages[n].size = 0;
+		replier->waiting_for_reply = false;
+		wake_up(&replier->wait);
+	}
+
+	mutex_unlock(&t->lock);
+}
+
+/* takes a reference to the current synchronous call of the client thread */
+static struct stplr_transaction *stplr_thread_get_transaction(struct stplr_thread *thread)
+{
+	struct stplr_transaction *t;
+
+	spin_lock(&thread->queue.lock);
+	t = thread->transaction;
+	if (t)
+		kref_get(&t->kref);
+	spin_unlock(&thread->queue.lock);
+
+	return t;
+}
+
+static void stplr_thread_set_transaction(struct stplr_thread *thread, struct stplr_transaction *t)
+{
+	spin_lock(&thread->queue.lock);
+	thread->transaction = t;
+	spin_unlock(&thread->queue.lock);
+}
+
+/*
+ * An ioctl interrupted by a signal may be restarted (either by the kernel
+ * or by the caller getting -EINTR) with the same arguments. If the thread
+ * has promised to do so (STPLR_OPT_RESUME_INTERRUPTED), the call is not
+ * given up, which would have it queued and pinned again from scratch then,
+ * but suspended and the restarted ioctl just waits for it again.
+ * Returns true if the call has been suspended.
+ */
+static bool stplr_thread_suspend_transaction(struct stplr_thread *thread, struct stplr_transaction *t,
+	void __user *ubuf, const struct stplr_msgs *smsgs, const struct stplr_msgs *rmsgs, int ret)
+{
+	if (ret != -ERESTARTSYS || !thread->resume_interrupted || fatal_signal_pending(current))
+		return false;
+
+	t->smsgs = *smsgs;
+	if (rmsgs)
+		t->rmsgs = *rmsgs;
+
+	thread->suspended_ubuf = ubuf;
+	/* publishes the call to stplr_thread_claim_suspended_transaction() */
+	smp_store_release(&thread->suspended, t);
+
+	return true;
+}
+
+/*
+ * Takes the suspended call (if any) from the thread. Besides the owner,
+ * the call is claimed by the flush of the dying thread, so whoever gets it
+ * is the only one to drop it.
+ */
+static struct stplr_transaction *stplr_thread_claim_suspended_transaction(struct stplr_thread *thread)
+{
+	if (!READ_ONCE(thread->suspended))
+		return NULL;
+
+	return xchg(&thread->suspended, NULL);
+}
+
+/* gives up the claimed suspended call, as the interrupted ioctl has not been restarted */
+static void stplr_thread_drop_transaction(struct stplr_thread *thread, struct stplr_transaction *t)
+{
+	stplr_transaction_abandon(t);
+	if (t->reply_required)
+		stplr_thread_set_transaction(thread, NULL);
+	stplr_transaction_return_buffers(t, thread);
+	stplr_transaction_recycle(t, thread);
+}
+
+static void stplr_thread_drop_suspended_transaction(struct stplr_thread *thread)
+{
+	struct stplr_transaction *t = stplr_thread_claim_suspended_transaction(thread);
+
+	if (t)
+		stplr_thread_drop_transaction(thread, t);
+}
+
+/*
+ * Returns the suspended call if the ioctl is the restarted one (the same
+ * argument describing the same messages sent to the same thread),
+ * otherwise drops it and returns NULL.
+ */
+static struct stplr_transaction *stplr_thread_resume_transaction(struct stplr_thread *thread,
+	void __user *ubuf, pid_t pid, pid_t tid, const struct stplr_msgs *smsgs, const struct stplr_msgs *rmsgs)
+{
+	struct stplr_transaction *t = stplr_thread_claim_suspended_transaction(thread);
+
+	if (!t)
+		return NULL;
+
+	if (ubuf == thread->suspended_ubuf && pid == t->rprocess->pid && tid == t->rtid &&
+	    t->reply_required == !!rmsgs &&
+	    smsgs->msgs == t->smsgs.msgs && smsgs->count == t->smsgs.count &&
+	    (!rmsgs || (rmsgs->msgs == t->rmsgs.msgs && rmsgs->count == t->rmsgs.count)))
+		return t;
+
+	stplr_thread_drop_transaction(thread, t);
+
+	return NULL;
+}
+
+/*
+ * Resolves the handle to the current thread. Any other ioctl than the restart
+ * of the interrupted one (see stplr_thread_resume_transaction()) drops
+ * the suspended call of the thread.
+ */
+static int stplr_handle_to_thread(struct stplr_process *process, const struct stplr_handle *handle, struct stplr_thread **thread)
+{
+	int ret;
+
+	ret = stplr_handle_lookup_thread(process, handle, thread);
+	if (ret)
+		return ret;
+
+	if (unlikely(READ_ONCE((*thread)->suspended)))
+		stplr_thread_drop_suspended_transaction(*thread);
+
+	return 0;
+}
+
+/* abandons all asynchronous (and suspended) calls of the thread which is about to die */
+static void stplr_thread_abandon_calls(struct stplr_thread *thread)
+{
+	struct stplr_transaction *t, *next;
+	LIST_HEAD(calls);
+
+	spin_lock(&thread->queue.lock);
+	list_splice_init(&thread->calls, &calls);
+	spin_unlock(&thread->queue.lock);
+
+	list_for_each_entry_safe(t, next, &calls, call_node) {
+		list_del_init(&t->call_node);
+		stplr_transaction_abandon(t);
+		stplr_transaction_put(t);
+	}
+
+	stplr_thread_drop_suspended_transaction(thread);
+}
+
+/* takes the first completed asynchronous call off the list, the list's reference is passed to the caller */
+static struct stplr_transaction *stplr_thread_take_completed_call(struct stplr_thread *thread)
+{
+	struct stplr_transaction *t;
+	struct stplr_transaction *found = NULL;
+
+	spin_lock(&thread->queue.lock);
+	list_for_each_entry(t, &thread->calls, call_node)
+		if (smp_load_acquire(&t->completed)) {
+			list_del_init(&t->call_node);
+			found = t;
+			break;
+		}
+	spin_unlock(&thread->queue.lock);
+
+	return found;
+}
+
+static void stplr_post_release(struct kref *kref)
+{
+	struct stplr_post *post = container_of(kref, struct stplr_post, kref);
+
+	stplr_msg_buffer_destroy(&post->buffer);
+	kfree(post);
+}
+
+static void stplr_post_entry_complete(struct stplr_post_entry *entry)
+{
+	struct stplr_post *post = entry->post;
+	struct stplr_connection *connection = entry->connection;
+
+	/* return credits taken by asynchronous send */
+	if (connection) {
+		struct stplr_thread *rthread = connection->thread;
+		bool idle;
+
+		spin_lock(&rthread->queue.lock);
+		connection->msgs--;
+		connection->bytes -= entry->bytes;
+		idle = !connection->msgs;
+		if (idle)
+			hash_del(&connection->hnode);
+		spin_unlock(&rthread->queue.lock);
+		wake_up(&rthread->credits.wait);
+
+		if (idle)
+			kfree(connection);
+	}
+
+	if (atomic_dec_and_test(&post->pending))
+		wake_up(&post->wait);
+
+	kref_put(&post->kref, stplr_post_release);
+}
+
+/* completes all calls and posts queued to the thread which is about to die */
+static void stplr_thread_drain_queue(struct stplr_thread *thread)
+{
+	struct stplr_post_entry *entry, *next;
+	struct stplr_transaction *t;
+	LIST_HEAD(posts);
+
+	spin_lock(&thread->queue.lock);
+	list_splice_init(&thread->queue.posts, &posts);
+	spin_unlock(&thread->queue.lock);
+	/* let senders waiting for credits or room notice the thread is a zombie */
+	wake_up_all(&thread->credits.wait);
+	wake_up_all(&thread->queue.room);
+
+	list_for_each_entry_safe(entry, next, &posts, list_node) {
+		list_del_init(&entry->list_node);
+		stplr_post_entry_complete(entry);
+	}
+
+	/*
+	 * Calls are taken one by one, as their clients might be abandoning them
+	 * concurrently (which also removes them from the queue).
+	 */
+	for (;;) {
+		spin_lock(&thread->queue.lock);
+		t = list_first_entry_or_null(&thread->queue.head, struct stplr_transaction, list_node);
+		if (t) {
+			list_del_init(&t->list_node);
+			stplr_thread_queue_account_locked(&thread->queue, t, -1);
+		}
+		spin_unlock(&thread->queue.lock);
+
+		if (!t)
+			break;
+
+		mutex_lock(&t->lock);
+		if (!t->abandoned)
+			stplr_transaction_complete(t, -EPIPE);
+		mutex_unlock(&t->lock);
+		stplr_transaction_put(t);
+	}
+}
+
+static struct stplr_connection *stplr_thread_find_connection(struct stplr_thread *thread, pid_t pid)
+{
+	struct stplr_connection *connection;
+
+	hash_for_each_possible(thread->credits.connections, connection, hnode, pid)
+		if (connection->pid == pid)
+			return connection;
+
+	return NULL;
+}
+
+/*
+ * Takes credits of the sending process and queues the entry to the receiving
+ * thread. Returns -EAGAIN if the credits are exhausted and -ENODEV if the
+ * receiving thread is about to die. The @connection is consumed if this is
+ * the first outstanding message of the process to the receiving thread.
+ */
+static int stplr_thread_queue_async(struct stplr_thread *rthread, struct stplr_post_entry *entry,
+	pid_t pid, struct stplr_connection **connection)
+{
+	int ret = 0;
+	struct stplr_thread_credits *credits = &rthread->credits;
+	struct stplr_connection *c;
+
+	spin_lock(&rthread->queue.lock);
+
+	if (atomic_read(&rthread->zombie)) {
+		ret = -ENODEV;
+		goto out1;
+	}
+
+	c = stplr_thread_find_connection(rthread, pid);
+	if (!c) {
+		c = *connection;
+		*connection = NULL;
+		c->thread = rthread;
+		c->pid = pid;
+		hash_add(credits->connections, &c->hnode, pid);
+	}
+
+	/* single message bigger than the whole window is let through when nothing is outstanding */
+	if ((credits->msgs && c->msgs >= credits->msgs) ||
+		(credits->bytes && c->bytes && c->bytes + entry->bytes > credits->bytes)) {
+		ret = -EAGAIN;
+		goto out1;
+	}
+
+	c->msgs++;
+	c->bytes += entry->bytes;
+	entry->connection = c;
+	kref_get(&entry->post->kref);
+	list_add_tail(&entry->list_node, &rthread->queue.posts);
+
+out1:
+	spin_unlock(&rthread->queue.lock);
+
+	return ret;
+}
+
+static struct stplr_subscriber *stplr_group_find_subscriber(struct stplr_subscriber_group *group, struct stplr_thread *thread)
+{
+	struct stplr_subscriber *subscriber;
+
+	list_for_each_entry(subscriber, &group->subscribers, list_node)
+		if (subscriber->thread == thread)
+			return subscriber;
+
+	return NULL;
+}
+
+static void stplr_group_remove_subscriber(struct stplr_subscriber *subscriber)
+{
+	list_del(&subscriber->list_node);
+	stplr_thread_put(subscriber->thread);
+	kfree(subscriber);
+}
+
+static void stplr_group_free(struct stplr_device *dev, struct stplr_subscriber_group *group)
+{
+	struct stplr_subscriber *subscriber, *next;
+
+	list_for_each_entry_safe(subscriber, next, &group->subscribers, list_node)
+		stplr_group_remove_subscriber(subscriber);
+
+	idr_remove(&dev->groups, group->gid);
+
+	stplr_dbg_at3("[%d:%d] stapler group %d destroyed\n",
+		current->group_leader->pid, current->pid, group->gid);
+
+	kfree(group);
+}
+
+/* unsubscribes the thread from all groups it has subscribed to */
+static void stplr_groups_unsubscribe_thread(struct stplr_device *dev, struct stplr_thread *thread)
+{
+	struct stplr_subscriber_group *group;
+	struct stplr_subscriber *subscriber;
+	int gid;
+
+	mutex_lock(&dev->groups_lock);
+
+	idr_for_each_entry(&dev->groups, group, gid) {
+		subscriber = stplr_group_find_subscriber(group, thread);
+		if (subscriber)
+			stplr_group_remove_subscriber(subscriber);
+	}
+
+	mutex_unlock(&dev->groups_lock);
+}
+
+/* drops all subscriptions of the process' threads and destroys groups owned by the process */
+static void stplr_groups_flush(struct stplr_process *process)
+{
+	struct stplr_device *dev = process->dev;
+	struct stplr_subscriber_group *group;
+	struct stplr_subscriber *subscriber, *next;
+	int gid;
+
+	mutex_lock(&dev->groups_lock);
+
+	idr_for_each_entry(&dev->groups, group, gid) {
+		if (group->owner == process->pid) {
+			stplr_group_free(dev, group);
+			continue;
+		}
+
+		list_for_each_entry_safe(subscriber, next, &group->subscribers, list_node)
+			if (subscriber->thread->parent == process)
+				stplr_group_remove_subscriber(subscriber);
+	}
+
+	mutex_unlock(&dev->groups_lock);
+}
+
+/*
+ * Creates a post for every (non zombie) subscriber of the group.
+ * Every entry of the returned post holds strong reference to its subscriber.
+ */
+static struct stplr_post *stplr_group_create_post(struct stplr_device *dev, __u32 gid)
+{
+	struct stplr_subscriber_group *group;
+	struct stplr_subscriber *subscriber;
+	struct stplr_post *post;
+	__u32 n = 0;
+
+	mutex_lock(&dev->groups_lock);
+
+	group = idr_find(&dev->groups, gid);
+	if (!group) {
+		post = ERR_PTR(-ENOENT);
+		goto out1;
+	}
+
+	list_for_each_entry(subscriber, &group->subscribers, list_node)
+		if (!atomic_read(&subscriber->thread->zombie))
+			n++;
+
+	post = kzalloc(struct_size(post, entries, n), GFP_KERNEL);
+	if (!post) {
+		post = ERR_PTR(-ENOMEM);
+		goto out1;
+	}
+
+	list_for_each_entry(subscriber, &group->subscribers, list_node) {
+		if (atomic_read(&subscriber->thread->zombie))
+			continue;
+
+		kref_get(&subscriber->thread->kref);
+		post->entries[post->nentries].post = post;
+		post->entries[post->nentries].thread = subscriber->thread;
+		INIT_LIST_HEAD(&post->entries[post->nentries].list_node);
+		post->nentries++;
+	}
+
+out1:
+	mutex_unlock(&dev->groups_lock);
+
+	return post;
+}
+
+static int stplr_name_check(const char *name, u32 *hash)
+{
+	size_t len = strnlen(name, STPLR_NAME_MAX);
+
+	if (len == 0 || len == STPLR_NAME_MAX)
+		return -EINVAL;
+
+	*hash = full_name_hash(NULL, name, len);
+
+	return 0;
+}
+
+/* shall be called with rcu read lock or names_lock held */
+static struct stplr_name *stplr_name_find(struct stplr_device *dev, const char *name, u32 hash)
+{
+	struct stplr_name *entry;
+
+	hash_for_each_possible_rcu(dev->names, entry, hlist, hash,
+		lockdep_is_held(&dev->names_lock))
+		if (entry->hash == hash && !strcmp(entry->name, name))
+			return entry;
+
+	return NULL;
+}
+
+static void stplr_name_remove(struct stplr_name *entry)
+{
+	hash_del_rcu(&entry->hlist);
+	list_del(&entry->list_node);
+	kfree_rcu(entry, rcu);
+}
+
+/* detaches all names attached to the thread */
+static void stplr_names_detach_thread(struct stplr_device *dev, struct stplr_thread *thread)
+{
+	struct stplr_name *entry, *next;
+
+	mutex_lock(&dev->names_lock);
+
+	list_for_each_entry_safe(entry, next, &thread->names, list_node)
+		stplr_name_remove(entry);
+
+	mutex_unlock(&dev->names_lock);
+}
+
+static long stplr_ioctl_version(void __user *ubuf, size_t size)
+{
+	struct stplr_version version;
+
+	if (size != sizeof(struct stplr_version))
+		return -EINVAL;
+
+	memset(&version, 0, sizeof(version));
+	version.major = STPLR_VERSION_MAJOR;
+	version.minor = STPLR_VERSION_MINOR;
+	version.micro = STPLR_VERSION_MICRO;
+
+	if (copy_to_user(ubuf, &version, sizeof(struct stplr_version)))
+		return -EINVAL;
+
+	return 0;
+}
+
+static long stplr_ioctl_handle_get(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	struct stplr_thread *lthread;
+	struct stplr_handle handle;
+	pid_t tid = current->pid;
+
+	if (size != sizeof(struct stplr_handle))
+		return -EINVAL;
+
+	lthread = stplr_thread_get(lprocess, tid, STPLR_F_CREAT | STPLR_F_EXCL);
+	if (IS_ERR(lthread))
+		return PTR_ERR(lthread);
+
+	if (stplr_thread_to_handle(lprocess, lthread, &handle)) {
+		atomic_set(&lthread->zombie, 1);
+		stplr_thread_put(lthread);
+		return -EBADE;
+	}
+
+	if (copy_to_user(ubuf, &handle, sizeof(struct stplr_handle)))
+		return -EFAULT;
+
+	trace_stplr_handle_get(lprocess->pid, tid);
+
+	return 0;
+}
+
+static long stplr_ioctl_handle_put(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	struct stplr_thread *lthread;
+	struct stplr_handle handle;
+
+	if (size != sizeof(struct stplr_handle))
+		return -EINVAL;
+
+	if (copy_from_user(&handle, ubuf, sizeof(struct stplr_handle)))
+		return -EFAULT;
+
+	if (stplr_handle_to_thread(lprocess, &handle, &lthread))
+		return -EBADE;
+
+	trace_stplr_handle_put(lprocess->pid, lthread->tid);
+
+	atomic_set(&lthread->zombie, 1);
+	stplr_thread_invalidate_handle(lprocess, lthread);
+	stplr_names_detach_thread(lprocess->dev, lthread);
+	stplr_groups_unsubscribe_thread(lprocess->dev, lthread);
+	stplr_thread_drain_queue(lthread);
+	stplr_thread_abandon_calls(lthread);
+	stplr_thread_put(lthread);
+
+	return 0;
+}
+
+/*
+ * @kmsgs (if not NULL) is the copy of the send messages imported
+ * by STPLR_MSG_SEND_V2, which gets the sizes instead of the user space array.
+ */
+static long stplr_msg_send(struct stplr_process *lprocess, void __user *ubuf,
+	const struct stplr_msg_send *msg_send, struct stplr_msg *kmsgs)
+{
+	int ret = -EFAULT;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_thread *lthread;
+	ktime_t deadline;
+	struct stplr_process *rprocess;
+	struct stplr_thread *rthread;
+	struct stplr_transaction *t;
+	struct stplr_msg_pages *lmsg_pages;
+	__u32 lnmsgs;
+
+	ret = stplr_handle_lookup_thread(lprocess, &msg_send->handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	t = stplr_thread_resume_transaction(lthread, ubuf, msg_send->pid, msg_send->tid, &msg_send->smsgs, NULL);
+	if (t) {
+		/* the call is still queued (or being served) with its buffers pinned */
+		kref_get(&t->rprocess->kref);
+		rprocess = t->rprocess;
+		kref_get(&t->rthread->kref);
+		rthread = t->rthread;
+		goto resume;
+	}
+
+	stplr_dbg_at3("[%d:%d] send to %d:%d\n",
+		current->group_leader->pid, current->pid,
+		msg_send->pid, msg_send->tid);
+
+	rprocess = stplr_process_get(dev, msg_send->pid, STPLR_F_STRONG_REF);
+	if (IS_ERR(rprocess)) {
+		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_send->pid);
+		ret = PTR_ERR(rprocess);
+		goto out1;
+	}
+
+	rthread = stplr_thread_get(rprocess, msg_send->tid, STPLR_F_STRONG_REF);
+	if (IS_ERR_OR_NULL(rthread)) {
+		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_send->tid);
+		ret = rthread ? PTR_ERR(rthread) : -ENODEV;
+		goto out2;
+	}
+
+	t = stplr_transaction_create(lthread, rprocess, rthread, false);
+	if (!t) {
+		ret = -ENOMEM;
+		goto out3;
+	}
+
+	stplr_transaction_borrow_buffers(t, lthread);
+
+	ret = stplr_transaction_init_msgs(t, &msg_send->smsgs, kmsgs, STPLR_THREAD_SEND_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out4;
+	}
+
+	stplr_thread_account_pinned(lthread, &t->buffers[STPLR_THREAD_SEND_BUFFER]);
+
+	ret = stplr_transaction_route(t);
+	if (ret)
+		goto out4;
+
+	ret = stplr_transaction_queue_admitted(t, lthread, deadline);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_queue_admitted() failed with code %d\n",
+			current->group_leader->pid, current->pid, ret);
+		goto out4;
+	}
+
+resume:
+	ret = stplr_wait_event_deadline(lthread->wait, smp_load_acquire(&t->completed), deadline);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
+			current->group_leader->pid, current->pid, ret);
+		if (stplr_thread_suspend_transaction(lthread, t, ubuf, &msg_send->smsgs, NULL, ret))
+			goto out3;
+		stplr_transaction_abandon(t);
+		goto out4;
+	}
+
+	ret = t->status;
+	if (ret)
+		goto out4;
+
+	/* gather number of actually copied bytes in send buffers (needed to pass to user space) */
+	/* real copying happened in receiving (remote) thread */
+	lmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_SEND_BUFFER);
+	lnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER);
+
+	stplr_msgs_put_sizes(&msg_send->smsgs, kmsgs, lmsg_pages, lnmsgs);
+
+out4:
+	stplr_transaction_return_buffers(t, lthread);
+	stplr_transaction_recycle(t, lthread);
+
+out3:
+	stplr_thread_put(rthread);
+
+out2:
+	stplr_process_put(rprocess);
+
+out1:
+	return ret;
+}
+
+static long stplr_ioctl_msg_send(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	struct stplr_msg_send msg_send;
+
+	if (size != sizeof(struct stplr_msg_send))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_send, ubuf, sizeof(msg_send)))
+		return -EFAULT;
+
+	return stplr_msg_send(lprocess, ubuf, &msg_send, NULL);
+}
+
+static long stplr_ioctl_msg_send_v2(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_msg_send_v2 __user *uarg = ubuf;
+	struct stplr_msg_send_v2 msg_send_v2;
+	struct stplr_msg_send msg_send;
+	struct stplr_msg *kmsgs;
+
+	if (size != sizeof(struct stplr_msg_send_v2))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_send_v2, ubuf, sizeof(msg_send_v2)))
+		return -EFAULT;
+
+	kmsgs = stplr_msgv_import(&msg_send_v2.smsgv);
+	if (IS_ERR(kmsgs))
+		return PTR_ERR(kmsgs);
+
+	msg_send.handle = msg_send_v2.handle;
+	msg_send.pid = msg_send_v2.pid;
+	msg_send.tid = msg_send_v2.tid;
+	/* user space array is still needed to match a restarted call */
+	msg_send.smsgs.msgs = stplr_msgv_user_msgs(&uarg->smsgv, &msg_send_v2.smsgv);
+	msg_send.smsgs.count = msg_send_v2.smsgv.count;
+
+	ret = stplr_msg_send(lprocess, ubuf, &msg_send, kmsgs);
+	if (!ret)
+		ret = stplr_msgv_export(&uarg->smsgv, &msg_send_v2.smsgv, kmsgs);
+
+	stplr_msgv_release(&msg_send_v2.smsgv, kmsgs);
+
+	return ret;
+}
+
+/*
+ * @kmsgs (if not NULL) is the copy of the send messages followed by the reply
+ * messages, imported by STPLR_MSG_SEND_RECEIVE_V2, which gets the sizes instead
+ * of the user space arrays.
+ */
+static long stplr_msg_send_receive(struct stplr_process *lprocess, void __user *ubuf,
+	const struct stplr_msg_send_receive *msg_send_receive, struct stplr_msg *kmsgs)
+{
+	int ret = -EFAULT;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_msg *krmsgs = kmsgs ? kmsgs + msg_send_receive->smsgs.count : NULL;
+	struct stplr_thread *lthread;
+	ktime_t deadline;
+	struct stplr_process *rprocess;
+	struct stplr_thread *rthread;
+	struct stplr_thread *replier;
+	struct stplr_transaction *t;
+	struct stplr_msg_pages *lmsg_pages;
+	struct stplr_msg_pages *rmsg_pages;
+	__u32 lnmsgs;
+	__u32 rnmsgs;
+	__u32 n;
+
+	ret = stplr_handle_lookup_thread(lprocess, &msg_send_receive->handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	t = stplr_thread_resume_transaction(lthread, ubuf, msg_send_receive->pid, msg_send_receive->tid,
+		&msg_send_receive->smsgs, &msg_send_receive->rmsgs);
+	if (t) {
+		/* the call is still queued (or being served) with its buffers pinned */
+		kref_get(&t->rprocess->kref);
+		rprocess = t->rprocess;
+		kref_get(&t->rthread->kref);
+		rthread = t->rthread;
+		goto resume;
+	}
+
+	stplr_dbg_at3("[%d:%d] send to %d:%d\n",
+		current->group_leader->pid, current->pid,
+		msg_send_receive->pid, msg_send_receive->tid);
+
+	rprocess = stplr_process_get(dev, msg_send_receive->pid, STPLR_F_STRONG_REF);
+	if (IS_ERR(rprocess)) {
+		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_send_receive->pid);
+		ret = PTR_ERR(rprocess);
+		goto out1;
+	}
+
+	rthread = stplr_thread_get(rprocess, msg_send_receive->tid, STPLR_F_STRONG_REF);
+	if (IS_ERR_OR_NULL(rthread)) {
+		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_send_receive->tid);
+		ret = rthread ? PTR_ERR(rthread) : -ENODEV;
+		goto out2;
+	}
+
+	t = stplr_transaction_create(lthread, rprocess, rthread, true);
+	if (!t) {
+		ret = -ENOMEM;
+		goto out3;
+	}
+
+	stplr_transaction_borrow_buffers(t, lthread);
+
+	ret = stplr_transaction_init_msgs(t, &msg_send_receive->smsgs, kmsgs, STPLR_THREAD_SEND_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out4;
+	}
+
+	stplr_thread_account_pinned(lthread, &t->buffers[STPLR_THREAD_SEND_BUFFER]);
+
+	ret = stplr_transaction_route(t);
+	if (ret)
+		goto out4;
+
+	ret = stplr_transaction_init_msgs(t, &msg_send_receive->rmsgs, krmsgs, STPLR_THREAD_REPLY_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out4;
+	}
+
+	stplr_thread_account_pinned(lthread, &t->buffers[STPLR_THREAD_REPLY_BUFFER]);
+
+	/* make the call reachable by STPLR_MSG_REPLY, STPLR_MSG_READ and STPLR_MSG_WRITE */
+	stplr_thread_set_transaction(lthread, t);
+
+	ret = stplr_transaction_queue_admitted(t, lthread, deadline);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_queue_admitted() failed with code %d\n",
+			current->group_leader->pid, current->pid, ret);
+		goto out5;
+	}
+
+resume:
+	ret = stplr_wait_event_busy_poll(lthread, lthread->wait, smp_load_acquire(&t->completed), deadline);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
+			current->group_leader->pid, current->pid, ret);
+		if (stplr_thread_suspend_transaction(lthread, t, ubuf,
+				&msg_send_receive->smsgs, &msg_send_receive->rmsgs, ret))
+			goto out3;
+		stplr_transaction_abandon(t);
+		goto out5;
+	}
+
+	ret = t->status;
+	if (ret)
+		goto out5;
+
+	/* gather number of actually copied bytes in send buffers (needed to pass to user space) */
+	/* real copying happened in receiving (remote) thread */
+	lmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_SEND_BUFFER);
+	lnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER);
+
+	stplr_msgs_put_sizes(&msg_send_receive->smsgs, kmsgs, lmsg_pages, lnmsgs);
+
+	/* here copying of reply buffers will take place (unless STPLR_MSG_REPLY_TOKEN did it) */
+	lmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_REPLY_BUFFER);
+	lnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_REPLY_BUFFER);
+
+	mutex_lock(&t->lock);
+
+	replier = t->replier;
+	t->replier = NULL;
+
+	if (replier) {
+		rmsg_pages = stplr_thread_get_msg_pages(replier, STPLR_THREAD_REPLY_BUFFER);
+		rnmsgs = stplr_thread_get_num_of_msgs(replier, STPLR_THREAD_REPLY_BUFFER);
+
+		stplr_copy_msg_pages(lmsg_pages, lnmsgs, rmsg_pages, rnmsgs,
+			replier->parent->pid, replier->tid);
+		t->reply_copied_ns = ktime_get_ns();
+
+		/* finally wake up replying thread */
+		replier->waiting_for_reply = false;
+		trace_stplr_wakeup(replier->parent->pid, replier->tid);
+		wake_up(&replier->wait);
+	} else if (!t->reply_copied) {
+		/* replying thread gave up before we picked the reply up */
+		ret = -EPIPE;
+	}
+
+	mutex_unlock(&t->lock);
+
+	if (ret)
+		goto out5;
+
+	/* account for the data already written by STPLR_MSG_WRITE */
+	for (n = 0; n < lnmsgs; n++)
+		lmsg_pages[n].size = max(lmsg_pages[n].size, lmsg_pages[n].written);
+
+	stplr_msgs_put_sizes(&msg_send_receive->rmsgs, krmsgs, lmsg_pages, lnmsgs);
+
+	stplr_thread_put_timestamps(lthread, t->queued_ns, t->dequeued_ns, t->replied_ns, t->reply_copied_ns);
+
+out5:
+	stplr_thread_set_transaction(lthread, NULL);
+
+out4:
+	stplr_transaction_return_buffers(t, lthread);
+	stplr_transaction_recycle(t, lthread);
+
+out3:
+	stplr_thread_put(rthread);
+
+out2:
+	stplr_process_put(rprocess);
+
+out1:
+	return ret;
+}
+
+static long stplr_ioctl_msg_send_receive(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	struct stplr_msg_send_receive msg_send_receive;
+
+	if (size != sizeof(struct stplr_msg_send_receive))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_send_receive, ubuf, sizeof(msg_send_receive)))
+		return -EFAULT;
+
+	return stplr_msg_send_receive(lprocess, ubuf, &msg_send_receive, NULL);
+}
+
+static long stplr_ioctl_msg_send_receive_v2(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_msg_send_receive_v2 __user *uarg = ubuf;
+	struct stplr_msg_send_receive_v2 msg_send_receive_v2;
+	struct stplr_msg_send_receive msg_send_receive;
+	struct stplr_msg __user *umsgs;
+	struct stplr_msg *kmsgs;
+
+	if (size != sizeof(struct stplr_msg_send_receive_v2))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_send_receive_v2, ubuf, sizeof(msg_send_receive_v2)))
+		return -EFAULT;
+
+	if (msg_send_receive_v2.nsmsgs > msg_send_receive_v2.msgv.count)
+		return -EINVAL;
+
+	kmsgs = stplr_msgv_import(&msg_send_receive_v2.msgv);
+	if (IS_ERR(kmsgs))
+		return PTR_ERR(kmsgs);
+
+	/* user space arrays are still needed to match a restarted call */
+	umsgs = stplr_msgv_user_msgs(&uarg->msgv, &msg_send_receive_v2.msgv);
+
+	msg_send_receive.handle = msg_send_receive_v2.handle;
+	msg_send_receive.pid = msg_send_receive_v2.pid;
+	msg_send_receive.tid = msg_send_receive_v2.tid;
+	msg_send_receive.smsgs.msgs = umsgs;
+	msg_send_receive.smsgs.count = msg_send_receive_v2.nsmsgs;
+	msg_send_receive.rmsgs.msgs = umsgs + msg_send_receive_v2.nsmsgs;
+	msg_send_receive.rmsgs.count = msg_send_receive_v2.msgv.count - msg_send_receive_v2.nsmsgs;
+
+	ret = stplr_msg_send_receive(lprocess, ubuf, &msg_send_receive, kmsgs);
+	if (!ret)
+		ret = stplr_msgv_export(&uarg->msgv, &msg_send_receive_v2.msgv, kmsgs);
+
+	stplr_msgv_release(&msg_send_receive_v2.msgv, kmsgs);
+
+	return ret;
+}
+
+static long stplr_ioctl_msg_call(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = -EFAULT;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_msg_call msg_call;
+	struct stplr_thread *lthread;
+	struct stplr_process *rprocess;
+	struct stplr_thread *rthread;
+	struct stplr_transaction *t;
+
+	if (size != sizeof(struct stplr_msg_call))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_call, ubuf, sizeof(msg_call)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_call.handle, &lthread);
+	if (ret)
+		return ret;
+
+	stplr_dbg_at3("[%d:%d] call %d:%d (cookie %llu)\n",
+		current->group_leader->pid, current->pid,
+		msg_call.pid, msg_call.tid, msg_call.cookie);
+
+	rprocess = stplr_process_get(dev, msg_call.pid, STPLR_F_STRONG_REF);
+	if (IS_ERR(rprocess)) {
+		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_call.pid);
+		ret = PTR_ERR(rprocess);
+		goto out1;
+	}
+
+	rthread = stplr_thread_get(rprocess, msg_call.tid, STPLR_F_STRONG_REF);
+	if (IS_ERR_OR_NULL(rthread)) {
+		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_call.tid);
+		ret = rthread ? PTR_ERR(rthread) : -ENODEV;
+		goto out2;
+	}
+
+	t = stplr_transaction_create(lthread, rprocess, rthread, true);
+	if (!t) {
+		ret = -ENOMEM;
+		goto out3;
+	}
+
+	t->async = true;
+	t->cookie = msg_call.cookie;
+	t->smsgs = msg_call.smsgs;
+	t->rmsgs = msg_call.rmsgs;
+
+	ret = stplr_transaction_init_msgs(t, &msg_call.smsgs, NULL, STPLR_THREAD_SEND_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out4;
+	}
+
+	stplr_thread_account_pinned(lthread, &t->buffers[STPLR_THREAD_SEND_BUFFER]);
+
+	ret = stplr_transaction_route(t);
+	if (ret)
+		goto out4;
+
+	ret = stplr_transaction_init_msgs(t, &msg_call.rmsgs, NULL, STPLR_THREAD_REPLY_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out4;
+	}
+
+	stplr_thread_account_pinned(lthread, &t->buffers[STPLR_THREAD_REPLY_BUFFER]);
+
+	ret = stplr_transaction_queue_admitted(t, lthread, KTIME_MAX);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_transaction_queue_admitted() failed with code %d\n",
+			current->group_leader->pid, current->pid, ret);
+		goto out4;
+	}
+
+	/*
+	 * The reference we got at creation is passed to the list of calls in flight
+	 * (the call cannot be collected before, as only this thread collects it).
+	 */
+	spin_lock(&lthread->queue.lock);
+	list_add_tail(&t->call_node, &lthread->calls);
+	spin_unlock(&lthread->queue.lock);
+
+	goto out3;
+
+out4:
+	stplr_transaction_put(t);
+
+out3:
+	stplr_thread_put(rthread);
+
+out2:
+	stplr_process_put(rprocess);
+
+out1:
+	return ret;
+}
+
+static long stplr_ioctl_msg_call_complete(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = -EFAULT;
+	struct stplr_msg_call_complete msg_complete;
+	struct stplr_thread *lthread;
+	ktime_t deadline;
+	struct stplr_transaction *t;
+	struct stplr_msg_pages *msg_pages;
+	__u32 nmsgs;
+	__u32 n;
+
+	if (size != sizeof(struct stplr_msg_call_complete))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_complete, ubuf, sizeof(msg_complete)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_complete.handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	if (msg_complete.flags & ~STPLR_MSG_CALL_COMPLETE_F_NOWAIT)
+		return -EINVAL;
+
+	if (msg_complete.flags & STPLR_MSG_CALL_COMPLETE_F_NOWAIT) {
+		t = stplr_thread_take_completed_call(lthread);
+		if (!t)
+			return -EAGAIN;
+	} else {
+		ret = stplr_wait_event_deadline(lthread->wait, (t = stplr_thread_take_completed_call(lthread)) != NULL,
+			deadline);
+		if (ret) {
+			stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
+				current->group_leader->pid, current->pid, ret);
+			return ret;
+		}
+	}
+
+	stplr_dbg_at3("[%d:%d] call (cookie %llu) completed with status %d\n",
+		current->group_leader->pid, current->pid, t->cookie, t->status);
+
+	if (!t->status) {
+		msg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_SEND_BUFFER);
+		nmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER);
+
+		for (n = 0; n < nmsgs; n++)
+			put_user(msg_pages[n].size, (__u32 __user *)&t->smsgs.msgs[n].buflen);
+
+		msg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_REPLY_BUFFER);
+		nmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_REPLY_BUFFER);
+
+		/* account for the data already written by STPLR_MSG_WRITE */
+		for (n = 0; n < nmsgs; n++)
+			put_user(max(msg_pages[n].size, msg_pages[n].written),
+				(__u32 __user *)&t->rmsgs.msgs[n].buflen);
+	}
+
+	put_user(t->status, (__s32 __user *)&(((struct stplr_msg_call_complete*)ubuf)->status));
+	put_user(t->cookie, (__u64 __user *)&(((struct stplr_msg_call_complete*)ubuf)->cookie));
+
+	stplr_transaction_put(t);
+
+	return 0;
+}
+
+static int stplr_reply_token_create(struct stplr_process *lprocess, struct stplr_transaction *t)
+{
+	int id;
+
+	kref_get(&t->kref);
+
+	mutex_lock(&lprocess->tokens_lock);
+	id = idr_alloc(&lprocess->tokens, t, 1, 0, GFP_KERNEL);
+	mutex_unlock(&lprocess->tokens_lock);
+
+	/* cannot be the last reference, the caller holds its own */
+	if (id < 0)
+		kref_put(&t->kref, stplr_transaction_release);
+
+	return id;
+}
+
+static void stplr_reply_tokens_flush(struct stplr_process *process)
+{
+	struct stplr_transaction *t;
+	int id;
+
+	mutex_lock(&process->tokens_lock);
+	idr_for_each_entry(&process->tokens, t, id) {
+		idr_remove(&process->tokens, id);
+		stplr_transaction_put(t);
+	}
+	mutex_unlock(&process->tokens_lock);
+}
+
+/*
+ * Marks the call as being served by @lprocess.
+ * Returns value to be reported as 'reply_required' to the receiving thread
+ * @lthread (0, 1 or a reply token) or negative error code.
+ * Asynchronous calls cannot be addressed by client's pid and tid,
+ * so they are always replied with tokens. Must be called with t->lock held.
+ */
+static int stplr_transaction_accept(struct stplr_process *lprocess,
+	struct stplr_thread *lthread, struct stplr_transaction *t)
+{
+	int reply_required = 1;
+
+	t->dequeued_ns = ktime_get_ns();
+
+	if (!t->reply_required)
+		return 0;
+
+	if (lthread->reply_tokens || t->async) {
+		reply_required = stplr_reply_token_create(lprocess, t);
+		if (reply_required < 0) {
+			stplr_dbg_at1("[%d:%d] cannot create reply token (%d)\n",
+				current->group_leader->pid, current->pid, reply_required);
+			return reply_required;
+		}
+	}
+
+	t->served_by = lprocess->pid;
+
+	return reply_required;
+}
+
+/*
+ * Takes the first call off the queue and locks it. Abandoned calls are skipped.
+ * Returns NULL if there are no calls in the queue.
+ */
+static struct stplr_transaction *stplr_thread_dequeue_transaction(struct stplr_thread *thread)
+{
+	struct stplr_transaction *t;
+
+	for (;;) {
+		spin_lock(&thread->queue.lock);
+		t = list_first_entry_or_null(&thread->queue.head, struct stplr_transaction, list_node);
+		if (t) {
+			list_del_init(&t->list_node);
+			stplr_thread_queue_account_locked(&thread->queue, t, -1);
+		}
+		spin_unlock(&thread->queue.lock);
+
+		if (!t)
+			return NULL;
+
+		mutex_lock(&t->lock);
+		if (!t->abandoned)
+			return t;
+		mutex_unlock(&t->lock);
+
+		stplr_transaction_put(t);
+	}
+}
+
+/*
+ * Takes the first call waiting in the queue of a sibling thread
+ * (a thread of the same process taking part in work stealing as well).
+ * Returns it with its lock held, just like stplr_thread_dequeue_transaction().
+ */
+static struct stplr_transaction *stplr_thread_steal_transaction(struct stplr_thread *thread)
+{
+	struct stplr_process *process = thread->parent;
+	struct stplr_thread *sibling;
+	struct stplr_transaction *t;
+
+	WRITE_ONCE(thread->steal_kick, false);
+
+	for (;;) {
+		t = NULL;
+
+		rcu_read_lock();
+		list_for_each_entry_rcu(sibling, &process->siblings, sibling_node) {
+			if (sibling == thread || !READ_ONCE(sibling->work_stealing))
+				continue;
+
+			spin_lock(&sibling->queue.lock);
+			t = list_first_entry_or_null(&sibling->queue.head, struct stplr_transaction, list_node);
+			if (t) {
+				list_del_init(&t->list_node);
+				stplr_thread_queue_account_locked(&sibling->queue, t, -1);
+			}
+			spin_unlock(&sibling->queue.lock);
+
+			if (t)
+				break;
+		}
+		rcu_read_unlock();
+
+		if (!t)
+			return NULL;
+
+		mutex_lock(&t->lock);
+		if (!t->abandoned) {
+			thread->counters.stolen++;
+			return t;
+		}
+		mutex_unlock(&t->lock);
+
+		stplr_transaction_put(t);
+	}
+}
+
+static bool stplr_thread_has_work(struct stplr_thread *thread)
+{
+	return stplr_thread_queue_has_clients(&thread->queue) || READ_ONCE(thread->steal_kick);
+}
+
+/* puts the call back to the queue it has been taken from (even if it has been stolen) */
+static void stplr_thread_requeue_transaction(struct stplr_transaction *t)
+{
+	struct stplr_thread *rthread = t->rthread;
+
+	spin_lock(&rthread->queue.lock);
+	list_add(&t->list_node, &rthread->queue.head);
+	stplr_thread_queue_account_locked(&rthread->queue, t, 1);
+	spin_unlock(&rthread->queue.lock);
+
+	mutex_unlock(&t->lock);
+}
+
+static void stplr_thread_receive_post(struct stplr_thread *lthread, struct stplr_post_entry *entry,
+	struct stplr_msg_receive *msg_receive, struct stplr_msg *kmsgs)
+{
+	struct stplr_post *post = entry->post;
+	struct stplr_msg_pages *lmsg_pages;
+	struct stplr_msg_pages *pmsg_pages;
+	__u32 lnmsgs;
+	__u32 pnmsgs;
+	__u32 nmsgs;
+	__u32 n;
+	size_t count = 0;
+	u64 copy_start_ns;
+
+	trace_stplr_dequeue(lthread->parent->pid, lthread->tid, post->pid, post->tid);
+
+	/* post buffers are shared by all subscribers, so their sizes are left untouched */
+	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_SEND_BUFFER);
+	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+	pmsg_pages = stplr_msg_buffer_get_msg_pages(&post->buffer);
+	pnmsgs = post->buffer.nmsgs;
+
+	nmsgs = min(lnmsgs, pnmsgs);
+
+	stplr_thread_account_numa(lthread, pmsg_pages, pnmsgs);
+
+	if (trace_stplr_copy_start_enabled())
+		trace_stplr_copy_start(post->pid, post->tid, nmsgs, stplr_msgs_total_size(pmsg_pages, pnmsgs));
+
+	copy_start_ns = ktime_get_ns();
+
+	for (n = 0; n < nmsgs; n++) {
+		lmsg_pages[n].size =
+			stplr_copy_buffers(
+				&lmsg_pages[n].sgt, &pmsg_pages[n].sgt);
+		count += lmsg_pages[n].size;
+	}
+
+	for (; n < lnmsgs; n++)
+		lmsg_pages[n].size = 0;
+
+	trace_stplr_copy_end(post->pid, post->tid, nmsgs, count);
+	stplr_thread_account_received(lthread, count, post->queued_ns, copy_start_ns);
+
+	stplr_msgs_put_sizes(&msg_receive->rmsgs, kmsgs, lmsg_pages, lnmsgs);
+
+	msg_receive->pid = post->pid;
+	msg_receive->tid = post->tid;
+	msg_receive->reply_required = 0;
+
+	stplr_thread_put_timestamps(lthread, post->queued_ns, copy_start_ns, 0, 0);
+
+	stplr_post_entry_complete(entry);
+}
+
+/*
+ * Fills in the sender (@pid, @tid and @reply_required) of @msg_receive,
+ * which the caller passes to user space. @kmsgs (if not NULL) is the copy
+ * of the messages imported by STPLR_MSG_RECEIVE_V2, which gets the sizes
+ * instead of the user space array.
+ */
+static long stplr_msg_receive(struct stplr_process *lprocess, struct stplr_msg_receive *msg_receive,
+	struct stplr_msg *kmsgs)
+{
+	int ret = -EFAULT;
+	struct stplr_thread *lthread;
+	ktime_t deadline;
+	struct stplr_transaction *t;
+	struct stplr_post_entry *entry;
+	struct stplr_msg_pages *lmsg_pages;
+	struct stplr_msg_pages *rmsg_pages;
+	__u32 lnmsgs;
+	__u32 rnmsgs;
+	size_t count;
+	u64 copy_start_ns;
+	int reply_required;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_receive->handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	stplr_thread_alloc_stats(lthread);
+
+	ret = stplr_thread_init_msgs(lthread, &msg_receive->rmsgs, kmsgs, STPLR_THREAD_SEND_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		return ret;
+	}
+
+	for (;;) {
+		WRITE_ONCE(lthread->cpu, raw_smp_processor_id());
+		stplr_thread_set_idle(lthread, true);
+		ret = stplr_wait_event_busy_poll(lthread, lthread->wait, stplr_thread_has_work(lthread), deadline);
+		stplr_thread_set_idle(lthread, false);
+		if (ret) {
+			stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
+				current->group_leader->pid, current->pid, ret);
+			goto out1;
+		}
+
+		/* pick the first call from the list, posts are served once there are no calls */
+		t = stplr_thread_dequeue_transaction(lthread);
+		if (t)
+			break;
+
+		/* own calls first, then the calls of busy siblings */
+		if (READ_ONCE(lthread->work_stealing)) {
+			t = stplr_thread_steal_transaction(lthread);
+			if (t)
+				break;
+		}
+
+		spin_lock(&lthread->queue.lock);
+		entry = list_first_entry_or_null(&lthread->queue.posts, struct stplr_post_entry, list_node);
+		if (entry)
+			list_del_init(&entry->list_node);
+		spin_unlock(&lthread->queue.lock);
+
+		if (entry) {
+			stplr_thread_receive_post(lthread, entry, msg_receive, kmsgs);
+			goto out1;
+		}
+	}
+
+	reply_required = stplr_transaction_accept(lprocess, lthread, t);
+	if (reply_required < 0) {
+		stplr_thread_requeue_transaction(t);
+		ret = reply_required;
+		goto out1;
+	}
+
+	trace_stplr_dequeue(lprocess->pid, lthread->tid, t->pid, t->tid);
+
+	/* here copying of send buffers will take place */
+	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_SEND_BUFFER);
+	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+	rmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_SEND_BUFFER);
+	rnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER);
+
+	stplr_thread_account_numa(lthread, rmsg_pages, rnmsgs);
+
+	copy_start_ns = ktime_get_ns();
+	count = stplr_copy_msg_pages(lmsg_pages, lnmsgs, rmsg_pages, rnmsgs, t->pid, t->tid);
+	stplr_thread_account_received(lthread, count, t->queued_ns, copy_start_ns);
+
+	stplr_msgs_put_sizes(&msg_receive->rmsgs, kmsgs, lmsg_pages, lnmsgs);
+
+	msg_receive->pid = t->pid;
+	msg_receive->tid = t->tid;
+	msg_receive->reply_required = reply_required;
+
+	stplr_thread_put_timestamps(lthread, t->queued_ns, t->dequeued_ns, 0, 0);
+
+	/*
+	 * Complete the call only if reply is not needed.
+	 * In case reply is needed it will be completed
+	 * from STPLR_MSG_REPLY (or STPLR_MSG_REPLY_TOKEN) ioctl().
+	 */
+	if (!reply_required)
+		stplr_transaction_complete(t, 0);
+
+	mutex_unlock(&t->lock);
+	stplr_transaction_put(t);
+
+out1:
+	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+
+	return ret;
+}
+
+static long stplr_ioctl_msg_receive(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_msg_receive msg_receive;
+
+	if (size != sizeof(struct stplr_msg_receive))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_receive, ubuf, sizeof(msg_receive)))
+		return -EFAULT;
+
+	ret = stplr_msg_receive(lprocess, &msg_receive, NULL);
+	if (ret)
+		return ret;
+
+	put_user(msg_receive.pid, (__u32 __user *)&(((struct stplr_msg_receive*)ubuf)->pid));
+	put_user(msg_receive.tid, (__u32 __user *)&(((struct stplr_msg_receive*)ubuf)->tid));
+	put_user(msg_receive.reply_required, (__u32 __user *)&(((struct stplr_msg_receive*)ubuf)->reply_required));
+
+	return 0;
+}
+
+static long stplr_ioctl_msg_receive_v2(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_msg_receive_v2 __user *uarg = ubuf;
+	struct stplr_msg_receive_v2 msg_receive_v2;
+	struct stplr_msg_receive msg_receive;
+	struct stplr_msg *kmsgs;
+	size_t from;
+	size_t to;
+
+	if (size != sizeof(struct stplr_msg_receive_v2))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_receive_v2, ubuf, sizeof(msg_receive_v2)))
+		return -EFAULT;
+
+	kmsgs = stplr_msgv_import(&msg_receive_v2.rmsgv);
+	if (IS_ERR(kmsgs))
+		return PTR_ERR(kmsgs);
+
+	msg_receive.handle = msg_receive_v2.handle;
+	msg_receive.rmsgs.msgs = stplr_msgv_user_msgs(&uarg->rmsgv, &msg_receive_v2.rmsgv);
+	msg_receive.rmsgs.count = msg_receive_v2.rmsgv.count;
+
+	ret = stplr_msg_receive(lprocess, &msg_receive, kmsgs);
+	if (ret)
+		goto out;
+
+	msg_receive_v2.pid = msg_receive.pid;
+	msg_receive_v2.tid = msg_receive.tid;
+	msg_receive_v2.reply_required = msg_receive.reply_required;
+
+	/* the sender is followed by the inline messages, so both go back by a single copy */
+	from = offsetof(struct stplr_msg_receive_v2, pid);
+	if (kmsgs == msg_receive_v2.rmsgv.inline_msgs)
+		to = offsetof(struct stplr_msg_receive_v2, rmsgv.inline_msgs) +
+			msg_receive_v2.rmsgv.count * sizeof(struct stplr_msg);
+	else
+		to = offsetof(struct stplr_msg_receive_v2, rmsgv);
+
+	if (copy_to_user(ubuf + from, (void *)&msg_receive_v2 + from, to - from))
+		ret = -EFAULT;
+	else if (kmsgs != msg_receive_v2.rmsgv.inline_msgs)
+		ret = stplr_msgv_export(&uarg->rmsgv, &msg_receive_v2.rmsgv, kmsgs);
+
+out:
+	stplr_msgv_release(&msg_receive_v2.rmsgv, kmsgs);
+
+	return ret;
+}
+
+/*
+ * @kmsgs (if not NULL) is the copy of the messages imported by STPLR_MSG_REPLY_V2,
+ * which gets the sizes instead of the user space array.
+ */
+static long stplr_msg_reply(struct stplr_process *lprocess, const struct stplr_msg_reply *msg_reply,
+	struct stplr_msg *kmsgs)
+{
+	int ret = -EFAULT;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_thread *lthread;
+	ktime_t deadline;
+	struct stplr_process *rprocess;
+	struct stplr_thread *rthread;
+	struct stplr_transaction *t;
+	struct stplr_msg_pages *lmsg_pages;
+	__u32 lnmsgs;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_reply->handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	stplr_dbg_at3("[%d:%d] reply to %d:%d\n",
+		current->group_leader->pid, current->pid,
+		msg_reply->pid, msg_reply->tid);
+
+	rprocess = stplr_process_get(dev, msg_reply->pid, STPLR_F_STRONG_REF);
+	if (IS_ERR(rprocess)) {
+		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_reply->pid);
+		ret = PTR_ERR(rprocess);
+		goto out1;
+	}
+
+	rthread = stplr_thread_get(rprocess, msg_reply->tid, STPLR_F_STRONG_REF);
+	if (IS_ERR_OR_NULL(rthread)) {
+		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_reply->tid);
+		ret = rthread ? PTR_ERR(rthread) : -ENODEV;
+		goto out2;
+	}
+
+	t = stplr_thread_get_transaction(rthread);
+	if (!t) {
+		stplr_dbg_at1("[%d:%d] thread %d:%d does not wait for a reply\n",
+			current->group_leader->pid, current->pid,
+			msg_reply->pid, msg_reply->tid);
+		ret = -ESRCH;
+		goto out3;
+	}
+
+	ret = stplr_thread_init_msgs(lthread, &msg_reply->rmsgs, kmsgs, STPLR_THREAD_REPLY_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out4;
+	}
+
+	mutex_lock(&t->lock);
+	if (t->served_by != lprocess->pid) {
+		mutex_unlock(&t->lock);
+		ret = -ESRCH;
+		goto out5;
+	}
+
+	/* the client copies the reply from our buffers and then wakes us up */
+	lthread->waiting_for_reply = true;
+	t->replier = lthread;
+	t->replied_ns = ktime_get_ns();
+	trace_stplr_reply(lprocess->pid, lthread->tid, t->pid, t->tid, 0);
+	stplr_transaction_complete(t, 0);
+	mutex_unlock(&t->lock);
+
+	ret = stplr_wait_event_deadline(lthread->wait, lthread->waiting_for_reply == false, deadline);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
+			current->group_leader->pid, current->pid, ret);
+		mutex_lock(&t->lock);
+		if (t->replier == lthread)
+			t->replier = NULL;
+		lthread->waiting_for_reply = false;
+		mutex_unlock(&t->lock);
+		goto out5;
+	}
+
+	stplr_thread_account_replied(lthread, t->queued_ns);
+
+	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_REPLY_BUFFER);
+	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
+
+	stplr_msgs_put_sizes(&msg_reply->rmsgs, kmsgs, lmsg_pages, lnmsgs);
+
+out5:
+	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
+
+out4:
+	stplr_transaction_put(t);
+
+out3:
+	stplr_thread_put(rthread);
+
+out2:
+	stplr_process_put(rprocess);
+
+out1:
+	return ret;
+}
+
+static long stplr_ioctl_msg_reply(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	struct stplr_msg_reply msg_reply;
+
+	if (size != sizeof(struct stplr_msg_reply))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_reply, ubuf, sizeof(msg_reply)))
+		return -EFAULT;
+
+	return stplr_msg_reply(lprocess, &msg_reply, NULL);
+}
+
+static long stplr_ioctl_msg_reply_v2(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_msg_reply_v2 __user *uarg = ubuf;
+	struct stplr_msg_reply_v2 msg_reply_v2;
+	struct stplr_msg_reply msg_reply;
+	struct stplr_msg *kmsgs;
+
+	if (size != sizeof(struct stplr_msg_reply_v2))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_reply_v2, ubuf, sizeof(msg_reply_v2)))
+		return -EFAULT;
+
+	kmsgs = stplr_msgv_import(&msg_reply_v2.rmsgv);
+	if (IS_ERR(kmsgs))
+		return PTR_ERR(kmsgs);
+
+	msg_reply.handle = msg_reply_v2.handle;
+	msg_reply.pid = msg_reply_v2.pid;
+	msg_reply.tid = msg_reply_v2.tid;
+	msg_reply.rmsgs.msgs = stplr_msgv_user_msgs(&uarg->rmsgv, &msg_reply_v2.rmsgv);
+	msg_reply.rmsgs.count = msg_reply_v2.rmsgv.count;
+
+	ret = stplr_msg_reply(lprocess, &msg_reply, kmsgs);
+	if (!ret)
+		ret = stplr_msgv_export(&uarg->rmsgv, &msg_reply_v2.rmsgv, kmsgs);
+
+	stplr_msgv_release(&msg_reply_v2.rmsgv, kmsgs);
+
+	return ret;
+}
+
+static long stplr_ioctl_msg_reply_token(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = -EFAULT;
+	struct stplr_msg_reply_token msg_reply;
+	struct stplr_transaction *t;
+	struct stplr_thread *lthread;
+	struct stplr_msg_pages *lmsg_pages;
+	struct stplr_msg_pages *rmsg_pages;
+	__u32 lnmsgs;
+	__u32 rnmsgs;
+	__u32 n;
+
+	if (size != sizeof(struct stplr_msg_reply_token))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_reply, ubuf, sizeof(msg_reply)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_reply.handle, &lthread);
+	if (ret)
+		return ret;
+
+	/* every token can be used only once */
+	mutex_lock(&lprocess->tokens_lock);
+	t = idr_remove(&lprocess->tokens, msg_reply.token);
+	mutex_unlock(&lprocess->tokens_lock);
+	if (!t) {
+		stplr_dbg_at1("[%d:%d] unknown reply token %u\n",
+			current->group_leader->pid, current->pid, msg_reply.token);
+		return -EINVAL;
+	}
+
+	stplr_dbg_at3("[%d:%d] reply (token %u) to %d:%d\n",
+		current->group_leader->pid, current->pid,
+		msg_reply.token, t->pid, t->tid);
+
+	ret = stplr_thread_init_msgs(lthread, &msg_reply.rmsgs, NULL, STPLR_THREAD_REPLY_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out1;
+	}
+
+	mutex_lock(&t->lock);
+
+	if (t->served_by != lprocess->pid) {
+		stplr_dbg_at1("[%d:%d] call of %d:%d has been abandoned\n",
+			current->group_leader->pid, current->pid,
+			t->pid, t->tid);
+		ret = -ESRCH;
+		goto out2;
+	}
+
+	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_REPLY_BUFFER);
+	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
+	rmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_REPLY_BUFFER);
+	rnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_REPLY_BUFFER);
+
+	stplr_copy_msg_pages(rmsg_pages, rnmsgs, lmsg_pages, lnmsgs, t->pid, t->tid);
+
+	for (n = 0; n < lnmsgs; n++)
+		put_user(lmsg_pages[n].size, (__u32 __user *)&msg_reply.rmsgs.msgs[n].buflen);
+
+	t->reply_copied = true;
+	t->replied_ns = ktime_get_ns();
+	t->reply_copied_ns = t->replied_ns;
+	trace_stplr_reply(lprocess->pid, lthread->tid, t->pid, t->tid, msg_reply.token);
+	stplr_transaction_complete(t, 0);
+	stplr_thread_account_replied(lthread, t->queued_ns);
+
+out2:
+	mutex_unlock(&t->lock);
+	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
+
+out1:
+	stplr_transaction_put(t);
+
+	return ret;
+}
+
+static long stplr_ioctl_group_create(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_subscriber_group *group;
+	struct stplr_group g;
+	int gid;
+
+	if (size != sizeof(struct stplr_group))
+		return -EINVAL;
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+
+	group->owner = lprocess->pid;
+	INIT_LIST_HEAD(&group->subscribers);
+
+	mutex_lock(&dev->groups_lock);
+	gid = idr_alloc(&dev->groups, group, 1, 0, GFP_KERNEL);
+	if (gid >= 0)
+		group->gid = gid;
+	mutex_unlock(&dev->groups_lock);
+
+	if (gid < 0) {
+		kfree(group);
+		return gid;
+	}
+
+	stplr_dbg_at3("[%d:%d] stapler group %d created\n",
+		current->group_leader->pid, current->pid, gid);
+
+	g.gid = gid;
+	if (copy_to_user(ubuf, &g, sizeof(struct stplr_group))) {
+		mutex_lock(&dev->groups_lock);
+		stplr_group_free(dev, group);
+		mutex_unlock(&dev->groups_lock);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long stplr_ioctl_group_destroy(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = 0;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_subscriber_group *group;
+	struct stplr_group g;
+
+	if (size != sizeof(struct stplr_group))
+		return -EINVAL;
+
+	if (copy_from_user(&g, ubuf, sizeof(struct stplr_group)))
+		return -EFAULT;
+
+	mutex_lock(&dev->groups_lock);
+
+	group = idr_find(&dev->groups, g.gid);
+	if (!group)
+		ret = -ENOENT;
+	else
+	if (group->owner != lprocess->pid)
+		ret = -EPERM;
+	else
+		stplr_group_free(dev, group);
+
+	mutex_unlock(&dev->groups_lock);
+
+	return ret;
+}
+
+static long stplr_ioctl_group_subscribe(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = 0;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_group_subscription subscription;
+	struct stplr_thread *lthread;
+	struct stplr_subscriber_group *group;
+	struct stplr_subscriber *subscriber;
+
+	if (size != sizeof(struct stplr_group_subscription))
+		return -EINVAL;
+
+	if (copy_from_user(&subscription, ubuf, sizeof(subscription)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &subscription.handle, &lthread);
+	if (ret)
+		return ret;
+
+	subscriber = kzalloc(sizeof(*subscriber), GFP_KERNEL);
+	if (!subscriber)
+		return -ENOMEM;
+
+	mutex_lock(&dev->groups_lock);
+
+	group = idr_find(&dev->groups, subscription.gid);
+	if (!group) {
+		ret = -ENOENT;
+		goto out1;
+	}
+
+	if (stplr_group_find_subscriber(group, lthread)) {
+		ret = -EBUSY;
+		goto out1;
+	}
+
+	kref_get(&lthread->kref);
+	subscriber->thread = lthread;
+	list_add_tail(&subscriber->list_node, &group->subscribers);
+	subscriber = NULL;
+
+	stplr_dbg_at3("[%d:%d] subscribed to group %d\n",
+		current->group_leader->pid, current->pid, subscription.gid);
+
+out1:
+	mutex_unlock(&dev->groups_lock);
+	kfree(subscriber);
+
+	return ret;
+}
+
+static long stplr_ioctl_group_unsubscribe(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = 0;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_group_subscription subscription;
+	struct stplr_thread *lthread;
+	struct stplr_subscriber_group *group;
+	struct stplr_subscriber *subscriber;
+
+	if (size != sizeof(struct stplr_group_subscription))
+		return -EINVAL;
+
+	if (copy_from_user(&subscription, ubuf, sizeof(subscription)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &subscription.handle, &lthread);
+	if (ret)
+		return ret;
+
+	mutex_lock(&dev->groups_lock);
+
+	group = idr_find(&dev->groups, subscription.gid);
+	subscriber = group ? stplr_group_find_subscriber(group, lthread) : NULL;
+	if (subscriber)
+		stplr_group_remove_subscriber(subscriber);
+	else
+		ret = -ENOENT;
+
+	mutex_unlock(&dev->groups_lock);
+
+	return ret;
+}
+
+static long stplr_ioctl_msg_post(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = -EFAULT;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_msg_post msg_post;
+	struct stplr_thread *lthread;
+	struct stplr_thread_msg_buffer buffer = {};
+	struct stplr_post *post;
+	ktime_t deadline;
+	__u32 n;
+
+	if (size != sizeof(struct stplr_msg_post))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_post, ubuf, sizeof(msg_post)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_post.handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	stplr_dbg_at3("[%d:%d] post to group %u\n",
+		current->group_leader->pid, current->pid, msg_post.gid);
+
+	/* pin the message buffers only once, regardless of the number of subscribers */
+	ret = stplr_msg_buffer_init(&buffer, &msg_post.smsgs, NULL);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_msg_buffer_init() failed\n",
+			current->group_leader->pid, current->pid);
+		stplr_msg_buffer_free(&buffer);
+		return ret;
+	}
+
+	stplr_thread_account_pinned(lthread, &buffer);
+
+	post = stplr_group_create_post(dev, msg_post.gid);
+	if (IS_ERR(post)) {
+		stplr_msg_buffer_destroy(&buffer);
+		return PTR_ERR(post);
+	}
+
+	kref_init(&post->kref);
+	post->pid = current->group_leader->pid;
+	post->tid = current->pid;
+	atomic_set(&post->pending, post->nentries);
+	init_waitqueue_head(&post->wait);
+	post->queued_ns = ktime_get_ns();
+	post->buffer = buffer;
+
+	for (n = 0; n < post->nentries; n++) {
+		struct stplr_post_entry *entry = &post->entries[n];
+		struct stplr_thread *rthread = entry->thread;
+		struct stplr_thread *thread;
+		bool priority;
+		bool queued;
+
+		/* the subscriber's filter may drop the post or pass it to another thread */
+		thread = stplr_thread_filter(rthread, lthread, &post->buffer, &priority);
+		if (!IS_ERR(thread) && thread != rthread) {
+			stplr_thread_put(rthread);
+			rthread = thread;
+		}
+
+		/* zombie thread would never receive the post (nor drain it) */
+		spin_lock(&rthread->queue.lock);
+		queued = !IS_ERR(thread) && !atomic_read(&rthread->zombie);
+		if (queued) {
+			kref_get(&post->kref);
+			list_add_tail(&entry->list_node, &rthread->queue.posts);
+		}
+		spin_unlock(&rthread->queue.lock);
+
+		if (queued) {
+			trace_stplr_enqueue(post->pid, post->tid, rthread->parent->pid, rthread->tid,
+				post->buffer.nmsgs, false);
+			trace_stplr_wakeup(rthread->parent->pid, rthread->tid);
+			wake_up(&rthread->wait);
+		}
+		else
+		if (atomic_dec_and_test(&post->pending))
+			wake_up(&post->wait);
+
+		entry->thread = NULL;
+		stplr_thread_put(rthread);
+	}
+
+	ret = post->nentries;
+
+	if (!(msg_post.flags & STPLR_MSG_POST_F_NOWAIT)) {
+		/*
+		 * The post is already delivered to (some of) the subscribers,
+		 * so do not let the syscall be restarted when interrupted.
+		 */
+		int status = stplr_wait_event_deadline(post->wait, atomic_read(&post->pending) == 0, deadline);
+		if (status) {
+			stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
+				current->group_leader->pid, current->pid, status);
+			ret = status == -ETIMEDOUT ? -ETIMEDOUT : -EINTR;
+		}
+	}
+
+	kref_put(&post->kref, stplr_post_release);
+
+	return ret;
+}
+
+static long stplr_ioctl_msg_send_async(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = -EFAULT;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_msg_send_async msg_send_async;
+	struct stplr_thread *lthread;
+	struct stplr_process *rprocess;
+	struct stplr_thread *rthread;
+	struct stplr_thread *thread;
+	struct stplr_connection *connection;
+	struct stplr_post_entry *entry;
+	struct stplr_post *post;
+	ktime_t deadline;
+	bool priority;
+	__u32 n;
+
+	if (size != sizeof(struct stplr_msg_send_async))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_send_async, ubuf, sizeof(msg_send_async)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_send_async.handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	stplr_dbg_at3("[%d:%d] send async to %d:%d\n",
+		current->group_leader->pid, current->pid,
+		msg_send_async.pid, msg_send_async.tid);
+
+	rprocess = stplr_process_get(dev, msg_send_async.pid, STPLR_F_STRONG_REF);
+	if (IS_ERR(rprocess)) {
+		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_send_async.pid);
+		ret = PTR_ERR(rprocess);
+		goto out1;
+	}
+
+	rthread = stplr_thread_get(rprocess, msg_send_async.tid, STPLR_F_STRONG_REF);
+	if (IS_ERR_OR_NULL(rthread)) {
+		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_send_async.tid);
+		ret = rthread ? PTR_ERR(rthread) : -ENODEV;
+		goto out2;
+	}
+
+	/* asynchronous send is a post with exactly one recipient */
+	post = kzalloc(struct_size(post, entries, 1), GFP_KERNEL);
+	connection = kzalloc(sizeof(*connection), GFP_KERNEL);
+	if (!post || !connection) {
+		ret = -ENOMEM;
+		goto out3;
+	}
+
+	ret = stplr_msg_buffer_init(&post->buffer, &msg_send_async.smsgs, NULL);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_msg_buffer_init() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out3;
+	}
+
+	stplr_thread_account_pinned(lthread, &post->buffer);
+
+	thread = stplr_thread_filter(rthread, lthread, &post->buffer, &priority);
+	if (IS_ERR(thread)) {
+		ret = PTR_ERR(thread);
+		stplr_msg_buffer_deinit(&post->buffer);
+		goto out3;
+	}
+
+	if (thread != rthread) {
+		stplr_thread_put(rthread);
+		rthread = thread;
+	}
+
+	kref_init(&post->kref);
+	post->pid = current->group_leader->pid;
+	post->tid = current->pid;
+	atomic_set(&post->pending, 1);
+	init_waitqueue_head(&post->wait);
+	post->queued_ns = ktime_get_ns();
+	post->nentries = 1;
+
+	entry = &post->entries[0];
+	entry->post = post;
+	INIT_LIST_HEAD(&entry->list_node);
+	for (n = 0; n < post->buffer.nmsgs; n++)
+		entry->bytes += stplr_msg_buffer_get_msg_pages(&post->buffer)[n].size;
+
+	if (msg_send_async.flags & STPLR_MSG_SEND_ASYNC_F_WAIT) {
+		int status = 0;
+
+		ret = stplr_wait_event_deadline(rthread->credits.wait,
+			(status = stplr_thread_queue_async(rthread, entry, post->pid, &connection)) != -EAGAIN,
+			deadline);
+		if (!ret)
+			ret = status;
+	} else {
+		ret = stplr_thread_queue_async(rthread, entry, post->pid, &connection);
+	}
+
+	if (ret == 0) {
+		trace_stplr_enqueue(post->pid, post->tid, rprocess->pid, rthread->tid,
+			post->buffer.nmsgs, false);
+		trace_stplr_wakeup(rprocess->pid, rthread->tid);
+		wake_up(&rthread->wait);
+	}
+
+	/* drop the sender's reference, the queued entry keeps its own */
+	kref_put(&post->kref, stplr_post_release);
+	post = NULL;
+
+out3:
+	kfree(connection);
+	if (post)
+		stplr_msg_buffer_free(&post->buffer);
+	kfree(post);
+	stplr_thread_put(rthread);
+
+out2:
+	stplr_process_put(rprocess);
+
+out1:
+	return ret;
+}
+
+static long stplr_ioctl_msg_transfer(struct stplr_process *lprocess, void __user *ubuf, size_t size, bool write)
+{
+	int ret = -EFAULT;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_msg_transfer msg_transfer;
+	struct stplr_thread *lthread;
+	struct stplr_process *rprocess;
+	struct stplr_thread *rthread;
+	struct stplr_transaction *t;
+	struct stplr_msg_pages *lmsg_pages;
+	struct stplr_msg_pages *rmsg_pages;
+	__u32 lnmsgs;
+	__u32 rnmsgs;
+	__u32 n;
+	size_t count;
+
+	if (size != sizeof(struct stplr_msg_transfer))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_transfer, ubuf, sizeof(msg_transfer)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_transfer.handle, &lthread);
+	if (ret)
+		return ret;
+
+	stplr_dbg_at3("[%d:%d] %s %d:%d at offset %u\n",
+		current->group_leader->pid, current->pid,
+		write ? "write to" : "read from",
+		msg_transfer.pid, msg_transfer.tid, msg_transfer.offset);
+
+	rprocess = stplr_process_get(dev, msg_transfer.pid, STPLR_F_STRONG_REF);
+	if (IS_ERR(rprocess)) {
+		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_transfer.pid);
+		ret = PTR_ERR(rprocess);
+		goto out1;
+	}
+
+	rthread = stplr_thread_get(rprocess, msg_transfer.tid, STPLR_F_STRONG_REF);
+	if (IS_ERR_OR_NULL(rthread)) {
+		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
+			current->group_leader->pid, current->pid,
+			msg_transfer.tid);
+		ret = rthread ? PTR_ERR(rthread) : -ENODEV;
+		goto out2;
+	}
+
+	t = stplr_thread_get_transaction(rthread);
+	if (!t) {
+		ret = -ESRCH;
+		goto out3;
+	}
+
+	ret = stplr_thread_init_msgs(lthread, &msg_transfer.msgs, NULL, STPLR_THREAD_SEND_BUFFER);
+	if (ret) {
+		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
+			current->group_leader->pid, current->pid);
+		goto out4;
+	}
+
+	mutex_lock(&t->lock);
+
+	/* client's buffers are valid only until our process replies to it */
+	if (t->served_by != lprocess->pid) {
+		stplr_dbg_at1("[%d:%d] thread %d:%d does not wait for our reply\n",
+			current->group_leader->pid, current->pid,
+			msg_transfer.pid, msg_transfer.tid);
+		ret = -ESRCH;
+		goto out5;
+	}
+
+	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_SEND_BUFFER);
+	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+
+	if (trace_stplr_copy_start_enabled())
+		trace_stplr_copy_start(msg_transfer.pid, msg_transfer.tid, lnmsgs,
+			stplr_msgs_total_size(lmsg_pages, lnmsgs));
+
+	if (write) {
+		rmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_REPLY_BUFFER);
+		rnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_REPLY_BUFFER);
+
+		count = stplr_copy_msgs(rmsg_pages, rnmsgs, msg_transfer.offset,
+			lmsg_pages, lnmsgs, 0);
+
+		for (n = 0; n < rnmsgs; n++)
+			if (stplr_msgs_range_part(rmsg_pages, n, msg_transfer.offset, count))
+				rmsg_pages[n].written = max(rmsg_pages[n].written,
+					stplr_msgs_range_part(rmsg_pages, n, 0, msg_transfer.offset + count));
+	} else {
+		rmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_SEND_BUFFER);
+		rnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER);
+
+		count = stplr_copy_msgs(lmsg_pages, lnmsgs, 0,
+			rmsg_pages, rnmsgs, msg_transfer.offset);
+	}
+
+	trace_stplr_copy_end(msg_transfer.pid, msg_transfer.tid, lnmsgs, count);
+
+	for (n = 0; n < lnmsgs; n++)
+		put_user(stplr_msgs_range_part(lmsg_pages, n, 0, count),
+			(__u32 __user *)&msg_transfer.msgs.msgs[n].buflen);
+
+	put_user((__u32)stplr_msgs_total_size(rmsg_pages, rnmsgs),
+		(__u32 __user *)&(((struct stplr_msg_transfer*)ubuf)->size));
+
+	ret = count;
+
+out5:
+	mutex_unlock(&t->lock);
+	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+
+out4:
+	stplr_transaction_put(t);
+
+out3:
+	stplr_thread_put(rthread);
+
+out2:
+	stplr_process_put(rprocess);
+
+out1:
+	return ret;
+}
+
+/*
+ * Returns total size of the first message waiting in the queue (calls
+ * are served before posts) or -ENOENT if there is none.
+ * Must be called with queue->lock held.
+ */
+static ssize_t stplr_thread_queue_first_locked(struct stplr_thread_queue *queue,
+	struct stplr_transaction **t, struct stplr_post_entry **entry)
+{
+	*t = list_first_entry_or_null(&queue->head, struct stplr_transaction, list_node);
+	if (*t)
+		return stplr_msgs_total_size(
+			stplr_transaction_get_msg_pages(*t, STPLR_THREAD_SEND_BUFFER),
+			stplr_transaction_get_num_of_msgs(*t, STPLR_THREAD_SEND_BUFFER));
+
+	*entry = list_first_entry_or_null(&queue->posts, struct stplr_post_entry, list_node);
+	if (*entry)
+		return stplr_msgs_total_size(
+			stplr_msg_buffer_get_msg_pages(&(*entry)->post->buffer),
+			(*entry)->post->buffer.nmsgs);
+
+	return -ENOENT;
+}
+
+/*
+ * Takes the first call (or post) off the queue, provided that it is still
+ * @t (or @entry) of @size bytes, and fails it with @status. A post has no status
+ * to be reported, so it is just dropped.
+ */
+static void stplr_thread_reject_first(struct stplr_thread *thread, struct stplr_transaction *t,
+	struct stplr_post_entry *entry, ssize_t size, int status)
+{
+	struct stplr_transaction *first;
+	struct stplr_post_entry *first_entry;
+	bool taken = false;
+
+	spin_lock(&thread->queue.lock);
+	if (stplr_thread_queue_first_locked(&thread->queue, &first, &first_entry) == size &&
+	    first == t && (t || first_entry == entry)) {
+		list_del_init(t ? &t->list_node : &entry->list_node);
+		if (t)
+			stplr_thread_queue_account_locked(&thread->queue, t, -1);
+		taken = true;
+	}
+	spin_unlock(&thread->queue.lock);
+
+	if (!taken)
+		return;
+
+	if (!t) {
+		stplr_post_entry_complete(entry);
+		return;
+	}
+
+	mutex_lock(&t->lock);
+	if (!t->abandoned)
+		stplr_transaction_complete(t, status);
+	mutex_unlock(&t->lock);
+	stplr_transaction_put(t);
+}
+
+static long stplr_ioctl_msg_receive_arena(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret = -EFAULT;
+	struct stplr_msg_receive_arena msg_receive;
+	struct stplr_arena *arena;
+	struct stplr_thread *lthread;
+	ktime_t deadline;
+	struct stplr_transaction *t;
+	struct stplr_post_entry *entry;
+	struct stplr_msg_pages *rmsg_pages;
+	__u32 rnmsgs;
+	__u32 offset;
+	ssize_t msg_size;
+	ssize_t slot_size;
+	size_t pos;
+	__u32 n;
+	int reply_required;
+	pid_t pid;
+	pid_t tid;
+	u64 queued_ns;
+	u64 copy_start_ns;
+
+	if (size != sizeof(struct stplr_msg_receive_arena))
+		return -EINVAL;
+
+	if (copy_from_user(&msg_receive, ubuf, sizeof(msg_receive)))
+		return -EFAULT;
+
+	ret = stplr_handle_to_thread(lprocess, &msg_receive.handle, &lthread);
+	if (ret)
+		return ret;
+
+	ret = stplr_thread_get_deadline(lthread, &deadline);
+	if (ret)
+		return ret;
+
+	arena = stplr_arena_get(lprocess);
+	if (!arena) {
+		stplr_dbg_at1("[%d:%d] receive arena is not mapped\n",
+			current->group_leader->pid, current->pid);
+		return -ENXIO;
+	}
+
+	stplr_thread_alloc_stats(lthread);
+
+	for (;;) {
+		ret = stplr_wait_event_busy_poll(lthread, lthread->wait, stplr_thread_queue_has_clients(&lthread->queue),
+			deadline);
+		if (ret) {
+			stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
+				current->group_leader->pid, current->pid, ret);
+			goto out1;
+		}
+
+		spin_lock(&lthread->queue.lock);
+		slot_size = stplr_thread_queue_first_locked(&lthread->queue, &t, &entry);
+		spin_unlock(&lthread->queue.lock);
+		if (slot_size < 0)
+			continue;
+
+		/* the slot is allocated with no locks held as it might need to sleep */
+		ret = stplr_arena_alloc(arena, slot_size, &offset);
+		if (ret == -ENOBUFS && xa_empty(&arena->slots)) {
+			/* the message does not fit even the empty arena, so it would block the queue forever */
+			stplr_dbg_at1("[%d:%d] %zd bytes do not fit in receive arena\n",
+				current->group_leader->pid, current->pid, slot_size);
+			stplr_thread_reject_first(lthread, t, entry, slot_size, -EMSGSIZE);
+			continue;
+		}
+
+		if (ret) {
+			stplr_dbg_at1("[%d:%d] cannot allocate %zd bytes in receive arena\n",
+				current->group_leader->pid, current->pid, slot_size);
+			goto out1;
+		}
+
+		/* the queue might have changed in the meantime, so check it again */
+		spin_lock(&lthread->queue.lock);
+		msg_size = stplr_thread_queue_first_locked(&lthread->queue, &t, &entry);
+		if (msg_size >= 0 && msg_size <= slot_size) {
+			list_del_init(t ? &t->list_node : &entry->list_node);
+			if (t)
+				stplr_thread_queue_account_locked(&lthread->queue, t, -1);
+		} else
+			msg_size = -EAGAIN;
+		spin_unlock(&lthread->queue.lock);
+
+		if (msg_size >= 0 && t) {
+			mutex_lock(&t->lock);
+			if (t->abandoned) {
+				mutex_unlock(&t->lock);
+				stplr_transaction_put(t);
+				msg_size = -EAGAIN;
+			}
+		}
+
+		if (msg_size >= 0)
+			break;
+
+		stplr_arena_free(arena, offset);
+	}
+
+	if (t) {
+		reply_required = stplr_transaction_accept(lprocess, lthread, t);
+		if (reply_required < 0) {
+			stplr_thread_requeue_transaction(t);
+			stplr_arena_free(arena, offset);
+			ret = reply_required;
+			goto out1;
+		}
+
+		rmsg_pages = stplr_transaction_get_msg_pages(t, STPLR_THREAD_SEND_BUFFER);
+		rnmsgs = stplr_transaction_get_num_of_msgs(t, STPLR_THREAD_SEND_BUFFER);
+		pid = t->pid;
+		tid = t->tid;
+		queued_ns = t->queued_ns;
+	} else {
+		rmsg_pages = stplr_msg_buffer_get_msg_pages(&entry->post->buffer);
+		rnmsgs = entry->post->buffer.nmsgs;
+		pid = entry->post->pid;
+		tid = entry->post->tid;
+		queued_ns = entry->post->queued_ns;
+	}
+
+	stplr_thread_account_numa(lthread, rmsg_pages, rnmsgs);
+
+	trace_stplr_dequeue(lprocess->pid, lthread->tid, pid, tid);
+	trace_stplr_copy_start(pid, tid, rnmsgs, msg_size);
+	copy_start_ns = ktime_get_ns();
+
+	for (n = 0, pos = offset; n < rnmsgs; pos += rmsg_pages[n].buflen, n++)
+		stplr_copy_msg_to_buffer(&rmsg_pages[n], arena->base + pos);
+
+	trace_stplr_copy_end(pid, tid, rnmsgs, msg_size);
+	stplr_thread_account_received(lthread, msg_size, queued_ns, copy_start_ns);
+
+	put_user(offset, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->offset));
+	put_user(msg_size, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->size));
+
+	if (!t) {
+		put_user(entry->post->pid, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->pid));
+		put_user(entry->post->tid, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->tid));
+		put_user(0, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->reply_required));
+		stplr_thread_put_timestamps(lthread, queued_ns, copy_start_ns, 0, 0);
+		stplr_post_entry_complete(entry);
+		ret = 0;
+		goto out1;
+	}
+
+	put_user(t->pid, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->pid));
+	put_user(t->tid, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->tid));
+	put_user(reply_required, (__u32 __user *)&(((struct stplr_msg_receive_arena*)ubuf)->reply_required));
+	stplr_thread_put_timestamps(lthread, queued_ns, t->dequeued_ns, 0, 0);
+
+	/* see stplr_ioctl_msg_receive() */
+	if (!reply_required)
+		stplr_transaction_complete(t, 0);
+
+	mutex_unlock(&t->lock);
+	stplr_transaction_put(t);
+	ret = 0;
+
+out1:
+	stplr_arena_put(arena);
+
+	return ret;
+}
+
+static long stplr_ioctl_arena_release(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_arena_release arena_release;
+	struct stplr_arena *arena;
+
+	if (size != sizeof(struct stplr_arena_release))
+		return -EINVAL;
+
+	if (copy_from_user(&arena_release, ubuf, sizeof(arena_release)))
+		return -EFAULT;
+
+	arena = stplr_arena_get(lprocess);
+	if (!arena)
+		return -ENXIO;
+
+	ret = stplr_arena_free(arena, arena_release.offset);
+	stplr_arena_put(arena);
+
+	return ret;
+}
+
+static long stplr_ioctl_stats_get(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_stats __user *ustats = ubuf;
+	struct stplr_handle handle;
+	struct stplr_stats_histogram histogram;
+	struct stplr_thread *lthread;
+	__u32 flags;
+	int h;
+
+	if (size != sizeof(struct stplr_stats))
+		return -EINVAL;
+
+	/* histograms are only written, so just the header is copied in */
+	if (copy_from_user(&handle, &ustats->handle, sizeof(handle)) ||
+	    get_user(flags, &ustats->flags))
+		return -EFAULT;
+
+	if (flags & ~STPLR_STATS_GET_F_RESET)
+		return -EINVAL;
+
+	ret = stplr_handle_to_thread(lprocess, &handle, &lthread);
+	if (ret)
+		return ret;
+
+	for (h = 0; h < STPLR_STATS_NUM_OF_HISTOGRAMS; h++) {
+		stplr_thread_stats_sum(lthread, h, &histogram);
+		if (copy_to_user(&ustats->histograms[h], &histogram, sizeof(histogram)))
+			return -EFAULT;
+	}
+
+	if (flags & STPLR_STATS_GET_F_RESET)
+		stplr_thread_stats_reset(lthread);
+
+	return 0;
+}
+
+static long stplr_ioctl_load_notify(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_load_notify load_notify;
+	struct stplr_thread_load_notify *notify;
+	struct stplr_thread *lthread;
+	struct eventfd_ctx *high_ctx = NULL;
+	struct eventfd_ctx *low_ctx = NULL;
+
+	if (size != sizeof(struct stplr_load_notify))
+		return -EINVAL;
+
+	if (copy_from_user(&load_notify, ubuf, sizeof(load_notify)))
+		return -EFAULT;
+
+	if (load_notify.metric > STPLR_LOAD_QUEUE_WAIT || load_notify.low >= load_notify.high)
+		return -EINVAL;
+
+	ret = stplr_handle_to_thread(lprocess, &load_notify.handle, &lthread);
+	if (ret)
 		return ret;
+
+	if (load_notify.high_fd >= 0) {
+		high_ctx = eventfd_ctx_fdget(load_notify.high_fd);
+		if (IS_ERR(high_ctx)) {
+			ret = PTR_ERR(high_ctx);
+			goto out1;
+		}
 	}
 
-	return 0;
-}
+	if (load_notify.low_fd >= 0) {
+		low_ctx = eventfd_ctx_fdget(load_notify.low_fd);
+		if (IS_ERR(low_ctx)) {
+			ret = PTR_ERR(low_ctx);
+			goto out2;
+		}
+	}
 
-static void stplr_thread_deinit_msgs(struct stplr_thread *thread, int buffer_id)
-{
-	struct stplr_msg_pages *msg_pages;
-	struct stplr_thread_msg_buffer *buffer;
-	__u32 n;
+	spin_lock(&lthread->queue.lock);
+	notify = &lthread->queue.notify;
+	swap(notify->high_ctx, high_ctx);
+	swap(notify->low_ctx, low_ctx);
+	notify->metric = load_notify.metric;
+	notify->high = load_notify.high;
+	notify->low = load_notify.low;
+	notify->above = false;
+	notify->expires_ns = 0;
+	stplr_thread_queue_notify_locked(&lthread->queue);
+	spin_unlock(&lthread->queue.lock);
 
-	buffer = &thread->buffers[buffer_id];
-	msg_pages = stplr_thread_get_msg_pages(thread, buffer_id);
+	/* from now on the contexts which have been replaced (if any) are released */
+	if (low_ctx)
+		eventfd_ctx_put(low_ctx);
 
-	for (n = 0; n < buffer->nmsgs; n++)
-		stplr_put_user_pages(&msg_pages[n]);
+out2:
+	if (high_ctx)
+		eventfd_ctx_put(high_ctx);
 
-	kfree(buffer->msgs);
-	buffer->msgs = NULL;
-	buffer->nmsgs = 0;
+out1:
+	return ret;
 }
 
-static long stplr_ioctl_version(void __user *ubuf, size_t size)
+/* only the owner sets the filter, readers see either the old or the new one */
+static int stplr_thread_set_filter(struct stplr_thread *lthread, __u64 value)
 {
-	struct stplr_version version;
-
-	if (size != sizeof(struct stplr_version))
-		return -EINVAL;
-
-	memset(&version, 0, sizeof(version));
-	version.major = STPLR_VERSION_MAJOR;
-	version.minor = STPLR_VERSION_MINOR;
-	version.micro = STPLR_VERSION_MICRO;
+	struct bpf_prog *prog = NULL;
+	struct bpf_prog *old;
+	s64 fd = (s64)value;
+
+	if (fd >= 0) {
+		if (fd > INT_MAX)
+			return -EBADF;
+		prog = bpf_prog_get_type(fd, BPF_PROG_TYPE_RAW_TRACEPOINT);
+		if (IS_ERR(prog))
+			return PTR_ERR(prog);
+	}
 
-	if (copy_to_user(ubuf, &version, sizeof(struct stplr_version)))
-		return -EINVAL;
+	old = rcu_replace_pointer(lthread->filter, prog, true);
+	/* bpf programs are freed after rcu grace period, so readers are safe */
+	if (old)
+		bpf_prog_put(old);
 
 	return 0;
 }
 
-static long stplr_ioctl_handle_get(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+static long stplr_ioctl_handle_set_option(struct stplr_process *lprocess, void __user *ubuf, size_t size)
 {
+	int ret;
+	struct stplr_handle_option option;
 	struct stplr_thread *lthread;
-	struct stplr_handle handle;
-	pid_t tid = current->pid;
 
-	if (size != sizeof(struct stplr_handle))
+	if (size != sizeof(struct stplr_handle_option))
 		return -EINVAL;
 
-	lthread = stplr_thread_get(lprocess, tid, STPLR_F_CREAT | STPLR_F_EXCL);
-	if (IS_ERR(lthread))
-		return PTR_ERR(lthread);
+	if (copy_from_user(&option, ubuf, sizeof(option)))
+		return -EFAULT;
 
-	if (stplr_thread_to_handle(lprocess, lthread, &handle))
-		return -EBADE;
+	ret = stplr_handle_to_thread(lprocess, &option.handle, &lthread);
+	if (ret)
+		return ret;
 
-	if (copy_to_user(ubuf, &handle, sizeof(struct stplr_handle)))
-		return -EFAULT;
+	switch (option.option) {
+	case STPLR_OPT_BUSY_POLL:
+		if (option.value > STPLR_BUSY_POLL_MAX_US)
+			return -EINVAL;
+		lthread->busy_poll.max_ns = option.value * NSEC_PER_USEC;
+		lthread->busy_poll.avg_ns = 0;
+		break;
+	case STPLR_OPT_CREDIT_MSGS:
+		if (option.value > U32_MAX)
+			return -EINVAL;
+		spin_lock(&lthread->queue.lock);
+		lthread->credits.msgs = option.value;
+		spin_unlock(&lthread->queue.lock);
+		wake_up_all(&lthread->credits.wait);
+		break;
+	case STPLR_OPT_CREDIT_BYTES:
+		spin_lock(&lthread->queue.lock);
+		lthread->credits.bytes = option.value;
+		spin_unlock(&lthread->queue.lock);
+		wake_up_all(&lthread->credits.wait);
+		break;
+	case STPLR_OPT_REPLY_TOKEN:
+		lthread->reply_tokens = !!option.value;
+		break;
+	case STPLR_OPT_TIMESTAMPS:
+		if (!access_ok(u64_to_user_ptr(option.value), sizeof(struct stplr_timestamps)))
+			return -EFAULT;
+		lthread->timestamps = u64_to_user_ptr(option.value);
+		break;
+	case STPLR_OPT_WAKE_AFFINE:
+		WRITE_ONCE(lthread->wake_affine, !!option.value);
+		break;
+	case STPLR_OPT_WORK_STEALING:
+		WRITE_ONCE(lthread->work_stealing, !!option.value);
+		break;
+	case STPLR_OPT_DISPATCH:
+		if (option.value > STPLR_DISPATCH_CPU_LOCAL)
+			return -EINVAL;
+		WRITE_ONCE(lthread->dispatch, option.value);
+		break;
+	case STPLR_OPT_FILTER:
+		return stplr_thread_set_filter(lthread, option.value);
+	case STPLR_OPT_QUEUE_MAX_CALLS:
+		if (option.value > U32_MAX)
+			return -EINVAL;
+		spin_lock(&lthread->queue.lock);
+		lthread->queue.max_calls = option.value;
+		spin_unlock(&lthread->queue.lock);
+		wake_up_all(&lthread->queue.room);
+		break;
+	case STPLR_OPT_QUEUE_MAX_BYTES:
+		spin_lock(&lthread->queue.lock);
+		lthread->queue.max_bytes = option.value;
+		spin_unlock(&lthread->queue.lock);
+		wake_up_all(&lthread->queue.room);
+		break;
+	case STPLR_OPT_ADMISSION_WAIT:
+		lthread->admission_wait_us = option.value;
+		break;
+	case STPLR_OPT_DEADLINE:
+		lthread->deadline = u64_to_user_ptr(option.value);
+		break;
+	case STPLR_OPT_RESUME_INTERRUPTED:
+		lthread->resume_interrupted = !!option.value;
+		break;
+	default:
+		return -EINVAL;
+	}
 
 	return 0;
 }
 
-static long stplr_ioctl_handle_put(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+static long stplr_ioctl_handle_get_option(struct stplr_process *lprocess, void __user *ubuf, size_t size)
 {
+	int ret;
+	struct stplr_handle_option option;
 	struct stplr_thread *lthread;
-	struct stplr_handle handle;
 
-	if (size != sizeof(struct stplr_handle))
+	if (size != sizeof(struct stplr_handle_option))
 		return -EINVAL;
 
-	if (copy_from_user(&handle, ubuf, sizeof(struct stplr_handle)))
+	if (copy_from_user(&option, ubuf, sizeof(option)))
 		return -EFAULT;
 
-	if (stplr_handle_to_thread(lprocess, &handle, &lthread))
-		return -EBADE;
+	ret = stplr_handle_to_thread(lprocess, &option.handle, &lthread);
+	if (ret)
+		return ret;
 
-	atomic_set(&lthread->zombie, 1);
-	stplr_thread_put(lthread);
+	switch (option.option) {
+	case STPLR_OPT_BUSY_POLL:
+		option.value = lthread->busy_poll.max_ns / NSEC_PER_USEC;
+		break;
+	case STPLR_OPT_CREDIT_MSGS:
+		option.value = lthread->credits.msgs;
+		break;
+	case STPLR_OPT_CREDIT_BYTES:
+		option.value = lthread->credits.bytes;
+		break;
+	case STPLR_OPT_REPLY_TOKEN:
+		option.value = lthread->reply_tokens;
+		break;
+	case STPLR_OPT_TIMESTAMPS:
+		option.value = (uintptr_t)lthread->timestamps;
+		break;
+	case STPLR_OPT_WAKE_AFFINE:
+		option.value = lthread->wake_affine;
+		break;
+	case STPLR_OPT_WORK_STEALING:
+		option.value = lthread->work_stealing;
+		break;
+	case STPLR_OPT_DISPATCH:
+		option.value = lthread->dispatch;
+		break;
+	case STPLR_OPT_FILTER:
+		option.value = !!rcu_access_pointer(lthread->filter);
+		break;
+	case STPLR_OPT_QUEUE_MAX_CALLS:
+		option.value = lthread->queue.max_calls;
+		break;
+	case STPLR_OPT_QUEUE_MAX_BYTES:
+		option.value = lthread->queue.max_bytes;
+		break;
+	case STPLR_OPT_ADMISSION_WAIT:
+		option.value = lthread->admission_wait_us;
+		break;
+	case STPLR_OPT_DEADLINE:
+		option.value = (uintptr_t)lthread->deadline;
+		break;
+	case STPLR_OPT_RESUME_INTERRUPTED:
+		option.value = lthread->resume_interrupted;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (copy_to_user(ubuf, &option, sizeof(option)))
+		return -EFAULT;
 
 	return 0;
 }
 
-static long stplr_ioctl_msg_send(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+static long stplr_ioctl_name_attach(struct stplr_process *lprocess, void __user *ubuf, size_t size)
 {
-	int ret = -EFAULT;
+	int ret;
 	struct stplr_device *dev = lprocess->dev;
-	struct stplr_msg_send msg_send;
+	struct stplr_name_attach name_attach;
 	struct stplr_thread *lthread;
-	struct stplr_process *rprocess;
-	struct stplr_thread *rthread;
-	struct stplr_msg_pages *lmsg_pages;
-	__u32 lnmsgs;
-	__u32 n;
+	struct stplr_name *entry;
+	u32 hash;
 
-	if (size != sizeof(struct stplr_msg_send))
+	if (size != sizeof(struct stplr_name_attach))
 		return -EINVAL;
 
-	if (copy_from_user(&msg_send, ubuf, sizeof(msg_send)))
+	if (copy_from_user(&name_attach, ubuf, sizeof(name_attach)))
 		return -EFAULT;
 
-	ret = stplr_handle_to_thread(lprocess, &msg_send.handle, &lthread);
+	ret = stplr_handle_to_thread(lprocess, &name_attach.handle, &lthread);
 	if (ret)
 		return ret;
 
-	stplr_dbg_at3("[%d:%d] send to %d:%d\n",
-		current->group_leader->pid, current->pid,
-		msg_send.pid, msg_send.tid);
-
-	rprocess = stplr_process_get(dev, msg_send.pid, STPLR_F_STRONG_REF);
-	if (IS_ERR(rprocess)) {
-		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
-			current->group_leader->pid, current->pid,
-			msg_send.pid);
-		ret = PTR_ERR(rprocess);
-		goto out1;
-	}
-
-	rthread = stplr_thread_get(rprocess, msg_send.tid, STPLR_F_STRONG_REF);
-	if (IS_ERR(rthread)) {
-		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
-			current->group_leader->pid, current->pid,
-			msg_send.tid);
-		ret = PTR_ERR(rthread);
-		goto out2;
-	}
+	ret = stplr_name_check(name_attach.name, &hash);
+	if (ret)
+		return ret;
 
-	ret = stplr_thread_init_msgs(lthread, &msg_send.smsgs, STPLR_THREAD_SEND_BUFFER);
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
-			current->group_leader->pid, current->pid);
-		goto out3;
-	}
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
 
-	lthread->waiting_for_reply = false;
+	entry->hash = hash;
+	entry->pid = lprocess->pid;
+	entry->tid = lthread->tid;
+	strscpy(entry->name, name_attach.name, sizeof(entry->name));
 
-	spin_lock(&rthread->queue.lock);
-	list_add_tail(&lthread->list_node, &rthread->queue.head);
-	spin_unlock(&rthread->queue.lock);
-	wake_up(&rthread->wait);
+	mutex_lock(&dev->names_lock);
 
-	ret = wait_event_interruptible(lthread->wait, list_empty(&lthread->list_node));
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
-			current->group_leader->pid, current->pid, ret);
-		goto out4;
+	/* the thread is marked zombie before its names get detached (under names_lock) */
+	if (atomic_read(&lthread->zombie)) {
+		mutex_unlock(&dev->names_lock);
+		kfree(entry);
+		return -ENODEV;
 	}
 
-	/* gather number of actually copied bytes in send buffers (needed to pass to user space) */
-	/* real copying happened in receiving (remote) thread */
-	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_SEND_BUFFER);
-	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
-
-	for (n = 0; n < lnmsgs; n++)
-		put_user(lmsg_pages[n].size, (__u32 __user *)&msg_send.smsgs.msgs[n].buflen);
+	if (stplr_name_find(dev, entry->name, hash)) {
+		mutex_unlock(&dev->names_lock);
+		kfree(entry);
+		return -EEXIST;
+	}
 
-out4:
-	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+	hash_add_rcu(dev->names, &entry->hlist, hash);
+	list_add_tail(&entry->list_node, &lthread->names);
 
-out3:
-	stplr_thread_put(rthread);
+	mutex_unlock(&dev->names_lock);
 
-out2:
-	stplr_process_put(rprocess);
+	stplr_dbg_at3("[%d:%d] name '%s' attached\n",
+		current->group_leader->pid, current->pid, entry->name);
 
-out1:
-	return ret;
+	return 0;
 }
 
-static long stplr_ioctl_msg_send_receive(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+static long stplr_ioctl_name_detach(struct stplr_process *lprocess, void __user *ubuf, size_t size)
 {
-	int ret = -EFAULT;
+	int ret;
 	struct stplr_device *dev = lprocess->dev;
-	struct stplr_msg_send_receive msg_send_receive;
+	struct stplr_name_attach name_attach;
 	struct stplr_thread *lthread;
-	struct stplr_process *rprocess;
-	struct stplr_thread *rthread;
-	struct stplr_msg_pages *lmsg_pages;
-	struct stplr_msg_pages *rmsg_pages;
-	__u32 lnmsgs;
-	__u32 rnmsgs;
-	__u32 nmsgs;
-	__u32 n;
+	struct stplr_name *entry;
+	u32 hash;
 
-	if (size != sizeof(struct stplr_msg_send_receive))
+	if (size != sizeof(struct stplr_name_attach))
 		return -EINVAL;
 
-	if (copy_from_user(&msg_send_receive, ubuf, sizeof(msg_send_receive)))
+	if (copy_from_user(&name_attach, ubuf, sizeof(name_attach)))
 		return -EFAULT;
 
-	ret = stplr_handle_to_thread(lprocess, &msg_send_receive.handle, &lthread);
+	ret = stplr_handle_to_thread(lprocess, &name_attach.handle, &lthread);
 	if (ret)
 		return ret;
 
-	stplr_dbg_at3("[%d:%d] send to %d:%d\n",
-		current->group_leader->pid, current->pid,
-		msg_send_receive.pid, msg_send_receive.tid);
+	ret = stplr_name_check(name_attach.name, &hash);
+	if (ret)
+		return ret;
 
-	rprocess = stplr_process_get(dev, msg_send_receive.pid, STPLR_F_STRONG_REF);
-	if (IS_ERR(rprocess)) {
-		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
-			current->group_leader->pid, current->pid,
-			msg_send_receive.pid);
-		ret = PTR_ERR(rprocess);
-		goto out1;
-	}
+	mutex_lock(&dev->names_lock);
 
-	rthread = stplr_thread_get(rprocess, msg_send_receive.tid, STPLR_F_STRONG_REF);
-	if (IS_ERR(rthread)) {
-		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
-			current->group_leader->pid, current->pid,
-			msg_send_receive.tid);
-		ret = PTR_ERR(rthread);
-		goto out2;
-	}
+	entry = stplr_name_find(dev, name_attach.name, hash);
+	if (entry && entry->pid == lprocess->pid && entry->tid == lthread->tid)
+		stplr_name_remove(entry);
+	else
+		ret = -ENOENT;
 
-	ret = stplr_thread_init_msgs(lthread, &msg_send_receive.smsgs, STPLR_THREAD_SEND_BUFFER);
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
-			current->group_leader->pid, current->pid);
-		goto out3;
-	}
+	mutex_unlock(&dev->names_lock);
 
-	ret = stplr_thread_init_msgs(lthread, &msg_send_receive.rmsgs, STPLR_THREAD_REPLY_BUFFER);
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
-			current->group_leader->pid, current->pid);
-		goto out4;
-	}
+	return ret;
+}
 
-	lthread->waiting_for_reply = true;
+static long stplr_ioctl_name_open(struct stplr_process *lprocess, void __user *ubuf, size_t size)
+{
+	int ret;
+	struct stplr_device *dev = lprocess->dev;
+	struct stplr_name_open name_open;
+	struct stplr_name *entry;
+	u32 hash;
 
-	spin_lock(&rthread->queue.lock);
-	list_add_tail(&lthread->list_node, &rthread->queue.head);
-	spin_unlock(&rthread->queue.lock);
-	wake_up(&rthread->wait);
+	if (size != sizeof(struct stplr_name_open))
+		return -EINVAL;
 
-	ret = wait_event_interruptible(lthread->wait, list_empty(&lthread->list_node) && (lthread->waiting_for_reply == false));
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
-			current->group_leader->pid, current->pid, ret);
-		goto out5;
+	if (copy_from_user(&name_open, ubuf, sizeof(name_open)))
+		return -EFAULT;
+
+	ret = stplr_name_check(name_open.name, &hash);
+	if (ret)
+		return ret;
+
+	rcu_read_lock();
+
+	entry = stplr_name_find(dev, name_open.name, hash);
+	if (entry) {
+		name_open.pid = entry->pid;
+		name_open.tid = entry->tid;
 	}
 
-	/* gather number of actually copied bytes in send buffers (needed to pass to user space) */
-	/* real copying happened in receiving (remote) thread */
-	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_SEND_BUFFER);
-	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+	rcu_read_unlock();
 
-	for (n = 0; n < lnmsgs; n++)
-		put_user(lmsg_pages[n].size, (__u32 __user *)&msg_send_receive.smsgs.msgs[n].buflen);
+	if (!entry)
+		return -ENOENT;
 
-	/* here copying of reply buffers will take place */
-	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_REPLY_BUFFER);
-	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
-	rmsg_pages = stplr_thread_get_msg_pages(rthread, STPLR_THREAD_REPLY_BUFFER);
-	rnmsgs = stplr_thread_get_num_of_msgs(rthread, STPLR_THREAD_REPLY_BUFFER);
+	if (copy_to_user(ubuf, &name_open, sizeof(name_open)))
+		return -EFAULT;
 
-	nmsgs = min(lnmsgs, rnmsgs);
-	for (n = 0; n < nmsgs; n++)
-		lmsg_pages[n].size =
-		rmsg_pages[n].size =
-			stplr_copy_buffers(
-				&lmsg_pages[n].sgt, &rmsg_pages[n].sgt);
+	return 0;
+}
 
-	if (nmsgs == rnmsgs)
-		for (; n < lnmsgs; n++)
-			lmsg_pages[n].size = 0;
-	else
-		for (; n < rnmsgs; n++)
-			rmsg_pages[n].size = 0;
+static int stplr_open(struct inode *inode, struct file *file)
+{
+	struct stplr_device *dev;
+	struct stplr_process *process;
 
-	for (n = 0; n < lnmsgs; n++)
-		put_user(lmsg_pages[n].size, (__u32 __user *)&msg_send_receive.rmsgs.msgs[n].buflen);
+	stplr_dbg_at3("[%d:%d] %s()\n",
+		current->group_leader->pid, current->pid, __func__);
 
-	rthread->waiting_for_reply = false;
+	dev = container_of(file->private_data, struct stplr_device, miscdev);
+	process = stplr_process_get(dev, current->group_leader->pid, STPLR_F_CREAT | STPLR_F_EXCL);
+	if (IS_ERR(process))
+		return PTR_ERR(process);
 
-	/* finally wake up replying thread */
-	wake_up(&rthread->wait);
+	file->private_data = process;
 
-out5:
-	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
+	return 0;
+}
 
-out4:
-	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+static int stplr_flush(struct file *file, fl_owner_t id)
+{
+	struct stplr_process *process;
+	struct stplr_thread *thread;
+	struct rb_node *node;
 
-out3:
-	stplr_thread_put(rthread);
+	stplr_dbg_at3("[%d:%d] %s()\n",
+		current->group_leader->pid, current->pid, __func__);
 
-out2:
-	stplr_process_put(rprocess);
+	process = file->private_data;
 
-out1:
-	return ret;
-}
+	stplr_groups_flush(process);
+	stplr_reply_tokens_flush(process);
+
+	/*
+	 * Threads are torn down one by one, as completing their calls
+	 * drops references to other threads (possibly of this very process),
+	 * which cannot be done with threads_lock held.
+	 */
+	for (;;) {
+		mutex_lock(&process->threads_lock);
+
+		for (node = rb_first(&process->threads); node != NULL; node = rb_next(node)) {
+			thread = rb_entry(node, struct stplr_thread, rb_node);
+			if (!atomic_read(&thread->zombie))
+				break;
+		}
 
-static long stplr_ioctl_msg_receive(struct stplr_process *lprocess, void __user *ubuf, size_t size)
-{
-	int ret = -EFAULT;
-	struct stplr_msg_receive msg_receive;
-	struct stplr_thread *lthread;
-	struct stplr_thread *rthread;
-	struct stplr_msg_pages *lmsg_pages;
-	struct stplr_msg_pages *rmsg_pages;
-	__u32 lnmsgs;
-	__u32 rnmsgs;
-	__u32 nmsgs;
-	__u32 n;
+		if (!node) {
+			mutex_unlock(&process->threads_lock);
+			break;
+		}
 
-	if (size != sizeof(struct stplr_msg_receive))
-		return -EINVAL;
+		stplr_dbg_at3("[%d:%d] flusing tid: %d\n",
+			current->group_leader->pid, current->pid, thread->tid);
 
-	if (copy_from_user(&msg_receive, ubuf, sizeof(msg_receive)))
-		return -EFAULT;
+		atomic_set(&thread->zombie, 1);
+		stplr_thread_invalidate_handle_locked(process, thread);
+		stplr_names_detach_thread(process->dev, thread);
 
-	ret = stplr_handle_to_thread(lprocess, &msg_receive.handle, &lthread);
-	if (ret)
-		return ret;
+		mutex_unlock(&process->threads_lock);
 
-	ret = stplr_thread_init_msgs(lthread, &msg_receive.rmsgs, STPLR_THREAD_SEND_BUFFER);
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
-			current->group_leader->pid, current->pid);
-		return ret;
+		stplr_thread_drain_queue(thread);
+		stplr_thread_abandon_calls(thread);
+		stplr_thread_put(thread);
 	}
 
-	ret = wait_event_interruptible(lthread->wait, stplr_thread_queue_has_clients(&lthread->queue));
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
-			current->group_leader->pid, current->pid, ret);
-		goto out1;
-	}
+	return 0;
+}
 
-	/* pick the first client from the list */
-	spin_lock(&lthread->queue.lock);
-	rthread = list_first_entry(&lthread->queue.head, struct stplr_thread, list_node);
-	spin_unlock(&lthread->queue.lock);
+static int stplr_release(struct inode *inode, struct file *file)
+{
+	struct stplr_process *process;
 
-	/* here copying of send buffers will take place */
-	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_SEND_BUFFER);
-	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
-	rmsg_pages = stplr_thread_get_msg_pages(rthread, STPLR_THREAD_SEND_BUFFER);
-	rnmsgs = stplr_thread_get_num_of_msgs(rthread, STPLR_THREAD_SEND_BUFFER);
+	stplr_dbg_at3("[%d:%d] %s()\n",
+		current->group_leader->pid, current->pid, __func__);
 
-	nmsgs = min(lnmsgs, rnmsgs);
-	for (n = 0; n < nmsgs; n++)
-		lmsg_pages[n].size =
-		rmsg_pages[n].size =
-			stplr_copy_buffers(
-				&lmsg_pages[n].sgt, &rmsg_pages[n].sgt);
+	process = file->private_data;
+	stplr_process_put(process);
 
-	if (nmsgs == rnmsgs)
-		for (; n < lnmsgs; n++)
-			lmsg_pages[n].size = 0;
-	else
-		for (; n < rnmsgs; n++)
-			rmsg_pages[n].size = 0;
+	return 0;
+}
 
-	for (n = 0; n < lnmsgs; n++)
-		put_user(lmsg_pages[n].size, (__u32 __user *)&msg_receive.rmsgs.msgs[n].buflen);
+static void stplr_arena_vm_open(struct vm_area_struct *vma)
+{
+	struct stplr_arena *arena = vma->vm_private_data;
 
-	put_user(rthread->parent->pid, (__u32 __user *)&(((struct stplr_msg_receive*)ubuf)->pid));
-	put_user(rthread->tid, (__u32 __user *)&(((struct stplr_msg_receive*)ubuf)->tid));
-	put_user(rthread->waiting_for_reply, (__u32 __user *)&(((struct stplr_msg_receive*)ubuf)->reply_required));
+	/* the vma is being split */
+	atomic_inc(&arena->mappings);
+}
 
-	list_del_init(&rthread->list_node);
+/* once the arena is unmapped, the process may map a new one */
+static void stplr_arena_vm_close(struct vm_area_struct *vma)
+{
+	struct stplr_process *process = vma->vm_file->private_data;
+	struct stplr_arena *arena = vma->vm_private_data;
 
-	/*
-	 * Wake up client thread only if reply is not needed.
-	 * In case reply is needed client thread will be woken up
-	 * from STPLR_MSG_REPLY ioctl().
-	 */
-	if (!rthread->waiting_for_reply)
-		wake_up(&rthread->wait);
+	if (!atomic_dec_and_test(&arena->mappings))
+		return;
 
-out1:
-	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_SEND_BUFFER);
+	mutex_lock(&process->threads_lock);
+	if (rcu_dereference_protected(process->arena, lockdep_is_held(&process->threads_lock)) == arena)
+		RCU_INIT_POINTER(process->arena, NULL);
+	mutex_unlock(&process->threads_lock);
 
-	return ret;
+	stplr_arena_put(arena);
 }
 
-static long stplr_ioctl_msg_reply(struct stplr_process *lprocess, void __user *ubuf, size_t size)
-{
-	int ret = -EFAULT;
-	struct stplr_device *dev = lprocess->dev;
-	struct stplr_msg_reply msg_reply;
-	struct stplr_thread *lthread;
-	struct stplr_process *rprocess;
-	struct stplr_thread *rthread;
-	struct stplr_msg_pages *lmsg_pages;
-	__u32 lnmsgs;
-	__u32 n;
+static const struct vm_operations_struct stplr_arena_vm_ops = {
+	.open = stplr_arena_vm_open,
+	.close = stplr_arena_vm_close,
+};
 
-	if (size != sizeof(struct stplr_msg_reply))
-		return -EINVAL;
+static int stplr_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret;
+	struct stplr_process *process;
+	struct stplr_arena *arena;
+	size_t size = vma->vm_end - vma->vm_start;
 
-	if (copy_from_user(&msg_reply, ubuf, sizeof(msg_reply)))
-		return -EFAULT;
+	stplr_dbg_at3("[%d:%d] %s() size: %zu\n",
+		current->group_leader->pid, current->pid, __func__, size);
 
-	ret = stplr_handle_to_thread(lprocess, &msg_reply.handle, &lthread);
-	if (ret)
-		return ret;
+	process = file->private_data;
 
-	stplr_dbg_at3("[%d:%d] reply to %d:%d\n",
-		current->group_leader->pid, current->pid,
-		msg_reply.pid, msg_reply.tid);
+	if (vma->vm_pgoff || size > STPLR_ARENA_MAX_SIZE)
+		return -EINVAL;
 
-	rprocess = stplr_process_get(dev, msg_reply.pid, STPLR_F_STRONG_REF);
-	if (IS_ERR(rprocess)) {
-		stplr_dbg_at1("[%d:%d] cannot find process with pid %d\n",
-			current->group_leader->pid, current->pid,
-			msg_reply.pid);
-		ret = PTR_ERR(rprocess);
-		goto out1;
-	}
+	mutex_lock(&process->threads_lock);
 
-	rthread = stplr_thread_get(rprocess, msg_reply.tid, STPLR_F_STRONG_REF);
-	if (IS_ERR(rthread)) {
-		stplr_dbg_at1("[%d:%d] cannot find thread with tid %d\n",
-			current->group_leader->pid, current->pid,
-			msg_reply.tid);
-		ret = PTR_ERR(rthread);
-		goto out2;
+	if (rcu_access_pointer(process->arena)) {
+		ret = -EBUSY;
+		goto out;
 	}
 
-	ret = stplr_thread_init_msgs(lthread, &msg_reply.rmsgs, STPLR_THREAD_REPLY_BUFFER);
-	if (ret) {
-		stplr_dbg_at1("[%d:%d] stplr_thread_init_msgs() failed\n",
-			current->group_leader->pid, current->pid);
-		goto out3;
+	arena = stplr_arena_create(size);
+	if (IS_ERR(arena)) {
+		ret = PTR_ERR(arena);
+		goto out;
 	}
 
-	lthread->waiting_for_reply = true;
-	rthread->waiting_for_reply = false;
-	wake_up(&rthread->wait);
-
-	ret = wait_event_interruptible(lthread->wait, lthread->waiting_for_reply == false);
+	ret = remap_vmalloc_range(vma, arena->base, 0);
 	if (ret) {
-		stplr_dbg_at1("[%d:%d] wait_event_interruptible() failed with code %d\n",
-			current->group_leader->pid, current->pid, ret);
-		goto out4;
+		stplr_arena_destroy(arena);
+		goto out;
 	}
 
-	lmsg_pages = stplr_thread_get_msg_pages(lthread, STPLR_THREAD_REPLY_BUFFER);
-	lnmsgs = stplr_thread_get_num_of_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
-
-	for (n = 0; n < lnmsgs; n++)
-		put_user(lmsg_pages[n].size, (__u32 __user *)&msg_reply.rmsgs.msgs[n].buflen);
-
-out4:
-	stplr_thread_deinit_msgs(lthread, STPLR_THREAD_REPLY_BUFFER);
+	/* a child process would share the arena without having a process structure of its own */
+	vm_flags_set(vma, VM_DONTCOPY);
+	vma->vm_private_data = arena;
+	vma->vm_ops = &stplr_arena_vm_ops;
 
-out3:
-	stplr_thread_put(rthread);
+	rcu_assign_pointer(process->arena, arena);
 
-out2:
-	stplr_process_put(rprocess);
+out:
+	mutex_unlock(&process->threads_lock);
 
-out1:
 	return ret;
 }
 
@@ -1165,6 +6011,78 @@ static long stplr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case STPLR_MSG_REPLY:
 		ret = stplr_ioctl_msg_reply(process, ubuf, size);
 		break;
+	case STPLR_GROUP_CREATE:
+		ret = stplr_ioctl_group_create(process, ubuf, size);
+		break;
+	case STPLR_GROUP_DESTROY:
+		ret = stplr_ioctl_group_destroy(process, ubuf, size);
+		break;
+	case STPLR_GROUP_SUBSCRIBE:
+		ret = stplr_ioctl_group_subscribe(process, ubuf, size);
+		break;
+	case STPLR_GROUP_UNSUBSCRIBE:
+		ret = stplr_ioctl_group_unsubscribe(process, ubuf, size);
+		break;
+	case STPLR_MSG_POST:
+		ret = stplr_ioctl_msg_post(process, ubuf, size);
+		break;
+	case STPLR_HANDLE_SET_OPTION:
+		ret = stplr_ioctl_handle_set_option(process, ubuf, size);
+		break;
+	case STPLR_HANDLE_GET_OPTION:
+		ret = stplr_ioctl_handle_get_option(process, ubuf, size);
+		break;
+	case STPLR_NAME_ATTACH:
+		ret = stplr_ioctl_name_attach(process, ubuf, size);
+		break;
+	case STPLR_NAME_DETACH:
+		ret = stplr_ioctl_name_detach(process, ubuf, size);
+		break;
+	case STPLR_NAME_OPEN:
+		ret = stplr_ioctl_name_open(process, ubuf, size);
+		break;
+	case STPLR_MSG_SEND_ASYNC:
+		ret = stplr_ioctl_msg_send_async(process, ubuf, size);
+		break;
+	case STPLR_MSG_READ:
+		ret = stplr_ioctl_msg_transfer(process, ubuf, size, false);
+		break;
+	case STPLR_MSG_WRITE:
+		ret = stplr_ioctl_msg_transfer(process, ubuf, size, true);
+		break;
+	case STPLR_MSG_RECEIVE_ARENA:
+		ret = stplr_ioctl_msg_receive_arena(process, ubuf, size);
+		break;
+	case STPLR_ARENA_RELEASE:
+		ret = stplr_ioctl_arena_release(process, ubuf, size);
+		break;
+	case STPLR_MSG_REPLY_TOKEN:
+		ret = stplr_ioctl_msg_reply_token(process, ubuf, size);
+		break;
+	case STPLR_MSG_CALL:
+		ret = stplr_ioctl_msg_call(process, ubuf, size);
+		break;
+	case STPLR_MSG_CALL_COMPLETE:
+		ret = stplr_ioctl_msg_call_complete(process, ubuf, size);
+		break;
+	case STPLR_STATS_GET:
+		ret = stplr_ioctl_stats_get(process, ubuf, size);
+		break;
+	case STPLR_LOAD_NOTIFY:
+		ret = stplr_ioctl_load_notify(process, ubuf, size);
+		break;
+	case STPLR_MSG_SEND_RECEIVE_V2:
+		ret = stplr_ioctl_msg_send_receive_v2(process, ubuf, size);
+		break;
+	case STPLR_MSG_RECEIVE_V2:
+		ret = stplr_ioctl_msg_receive_v2(process, ubuf, size);
+		break;
+	case STPLR_MSG_REPLY_V2:
+		ret = stplr_ioctl_msg_reply_v2(process, ubuf, size);
+		break;
+	case STPLR_MSG_SEND_V2:
+		ret = stplr_ioctl_msg_send_v2(process, ubuf, size);
+		break;
 	default:
 		msleep(1000); /* deliberately sleep for 1 second */
 		ret = -EINVAL;
@@ -1183,24 +6101,321 @@ const struct file_operations stplr_fops = {
 	.open = stplr_open,
 	.flush = stplr_flush,
 	.release = stplr_release,
+	.mmap = stplr_mmap,
 	.unlocked_ioctl = stplr_ioctl,
 	.compat_ioctl = compat_ptr_ioctl,
 };
 
+/**
+ * struct stplr_debugfs_queued - snapshot of a queued call (or post)
+ * @post:	the entry is a post
+ * @oneway:	the call does not need a reply
+ * @pid:	process id of the sender
+ * @tid:	thread id of the sender
+ * @bytes:	size of the message(s)
+ * @queued_ns:	time the entry has been queued at
+ */
+struct stplr_debugfs_queued {
+	bool post;
+	bool oneway;
+	pid_t pid;
+	pid_t tid;
+	size_t bytes;
+	u64 queued_ns;
+};
+
+/* the queue is copied (at most STPLR_DEBUGFS_MAX_QUEUED entries of it) and printed with no locks held */
+static void stplr_debugfs_show_queue(struct seq_file *m, struct stplr_thread *thread, u64 now)
+{
+	struct stplr_debugfs_queued *queued;
+	struct stplr_transaction *t;
+	struct stplr_post_entry *entry;
+	struct stplr_post *post;
+	unsigned int n = 0;
+	unsigned int i;
+	bool more = false;
+	u32 ncalls;
+	u64 bytes;
+
+	queued = kmalloc_array(STPLR_DEBUGFS_MAX_QUEUED, sizeof(*queued), GFP_KERNEL);
+
+	spin_lock(&thread->queue.lock);
+
+	ncalls = thread->queue.ncalls;
+	bytes = thread->queue.bytes;
+
+	if (queued) {
+		list_for_each_entry(t, &thread->queue.head, list_node) {
+			if (n == STPLR_DEBUGFS_MAX_QUEUED) {
+				more = true;
+				break;
+			}
+			queued[n].post = false;
+			queued[n].oneway = !t->reply_required;
+			queued[n].pid = t->pid;
+			queued[n].tid = t->tid;
+			queued[n].bytes = t->bytes;
+			queued[n].queued_ns = t->queued_ns;
+			n++;
+		}
+
+		list_for_each_entry(entry, &thread->queue.posts, list_node) {
+			if (n == STPLR_DEBUGFS_MAX_QUEUED) {
+				more = true;
+				break;
+			}
+			post = entry->post;
+			queued[n].post = true;
+			queued[n].oneway = true;
+			queued[n].pid = post->pid;
+			queued[n].tid = post->tid;
+			queued[n].bytes = stplr_msgs_total_size(stplr_msg_buffer_get_msg_pages(&post->buffer),
+				post->buffer.nmsgs);
+			queued[n].queued_ns = post->queued_ns;
+			n++;
+		}
+	}
+
+	spin_unlock(&thread->queue.lock);
+
+	seq_printf(m, "    queue: calls %u bytes %llu\n", ncalls, bytes);
+
+	for (i = 0; i < n; i++) {
+		if (queued[i].post)
+			seq_printf(m, "      post %d:%d bytes %zu waiting %llu us\n",
+				queued[i].pid, queued[i].tid, queued[i].bytes,
+				div_u64(now - queued[i].queued_ns, NSEC_PER_USEC));
+		else
+			seq_printf(m, "      call %d:%d bytes %zu waiting %llu us%s\n",
+				queued[i].pid, queued[i].tid, queued[i].bytes,
+				div_u64(now - queued[i].queued_ns, NSEC_PER_USEC),
+				queued[i].oneway ? " (oneway)" : "");
+	}
+
+	if (more)
+		seq_puts(m, "      ...\n");
+
+	kfree(queued);
+}
+
+static void stplr_debugfs_show_histogram(struct seq_file *m, struct stplr_thread *thread, int histogram)
+{
+	static const char * const names[STPLR_STATS_NUM_OF_HISTOGRAMS] = {
+		[STPLR_STATS_SIZE] = "size",
+		[STPLR_STATS_QUEUE_NS] = "queue_ns",
+		[STPLR_STATS_COPY_NS] = "copy_ns",
+		[STPLR_STATS_RTT_NS] = "rtt_ns",
+	};
+	static const unsigned int percents[] = {50, 90, 99};
+	struct stplr_stats_histogram h;
+	u64 total = 0;
+	u64 count;
+	u64 rank;
+	int i;
+	int b;
+
+	stplr_thread_stats_sum(thread, histogram, &h);
+
+	for (b = 0; b < STPLR_STATS_BUCKETS; b++)
+		total += h.buckets[b];
+
+	seq_printf(m, "    %s: count %llu", names[histogram], total);
+
+	/* percentiles are reported as the bounds of the buckets they fall into */
+	for (i = 0; total && i < ARRAY_SIZE(percents); i++) {
+		rank = div_u64(total * percents[i] + 99, 100);
+		for (b = 0, count = 0; b < STPLR_STATS_BUCKETS - 1; b++) {
+			count += h.buckets[b];
+			if (count >= rank)
+				break;
+		}
+
+		if (b < STPLR_STATS_BUCKETS - 1)
+			seq_printf(m, " p%u <%llu", percents[i], 2ULL << b);
+		else
+			seq_printf(m, " p%u >=%llu", percents[i], 1ULL << b);
+	}
+
+	seq_putc(m, '\n');
+}
+
+static void stplr_debugfs_show_thread(struct seq_file *m, struct stplr_thread *thread, u64 now)
+{
+	struct stplr_transaction *t;
+	unsigned int ncalls = 0;
+	pid_t served_by = 0;
+	int h;
+
+	spin_lock(&thread->queue.lock);
+	t = thread->transaction;
+	if (t)
+		served_by = READ_ONCE(t->served_by);
+	list_for_each_entry(t, &thread->calls, call_node)
+		ncalls++;
+	spin_unlock(&thread->queue.lock);
+
+	/* the reference taken by the dump itself is not shown */
+	seq_printf(m, "  thread %d: node %d refs %u%s%s%s\n",
+		thread->tid, thread->node, kref_read(&thread->kref) - 1,
+		atomic_read(&thread->zombie) ? " zombie" : "",
+		READ_ONCE(thread->waiting_for_reply) ? " waiting_for_reply" : "",
+		rcu_access_pointer(thread->filter) ? " filter" : "");
+
+	if (served_by)
+		seq_printf(m, "    call served by %d\n", served_by);
+
+	seq_printf(m, "    calls in flight %u, received msgs %llu bytes %llu, pinned pages %llu, remote copies %llu, stolen %llu\n",
+		ncalls,
+		READ_ONCE(thread->counters.msgs),
+		READ_ONCE(thread->counters.bytes),
+		READ_ONCE(thread->counters.pinned_pages),
+		READ_ONCE(thread->counters.remote_copies),
+		READ_ONCE(thread->counters.stolen));
+
+	if (smp_load_acquire(&thread->stats))
+		for (h = 0; h < STPLR_STATS_NUM_OF_HISTOGRAMS; h++)
+			stplr_debugfs_show_histogram(m, thread, h);
+
+	stplr_debugfs_show_queue(m, thread, now);
+}
+
+/* takes a reference to the process with the lowest pid greater than @pid */
+static struct stplr_process *stplr_debugfs_next_process(struct stplr_device *dev, pid_t pid)
+{
+	struct stplr_process *process;
+	struct stplr_process *next = NULL;
+	struct rb_node *node;
+
+	mutex_lock(&dev->processes_lock);
+
+	for (node = dev->processes.rb_node; node; ) {
+		process = rb_entry(node, struct stplr_process, rb_node);
+		if (pid < process->pid) {
+			next = process;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+
+	if (next)
+		kref_get(&next->kref);
+
+	mutex_unlock(&dev->processes_lock);
+
+	return next;
+}
+
+/* takes a reference to the thread with the lowest tid greater than @tid */
+static struct stplr_thread *stplr_debugfs_next_thread(struct stplr_process *process, pid_t tid)
+{
+	struct stplr_thread *thread;
+	struct stplr_thread *next = NULL;
+	struct rb_node *node;
+
+	mutex_lock(&process->threads_lock);
+
+	for (node = process->threads.rb_node; node; ) {
+		thread = rb_entry(node, struct stplr_thread, rb_node);
+		if (tid < thread->tid) {
+			next = thread;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+
+	if (next)
+		kref_get(&next->kref);
+
+	mutex_unlock(&process->threads_lock);
+
+	return next;
+}
+
+/*
+ * Dumps all processes and threads of the device together with their queues,
+ * so that a stuck server (or a client it waits for) can be identified
+ * without attaching a debugger. The locks are taken just to find the next
+ * process (or thread), so reading the dump does not stall the ipc.
+ */
+static int stplr_debugfs_device_show(struct seq_file *m, void *unused)
+{
+	struct stplr_device *dev = m->private;
+	struct stplr_process *process;
+	struct stplr_thread *thread;
+	pid_t pid = 0;
+	pid_t tid;
+	u64 now = ktime_get_ns();
+
+	while ((process = stplr_debugfs_next_process(dev, pid)) != NULL) {
+		pid = process->pid;
+
+		/* the reference taken by the dump itself is not shown */
+		seq_printf(m, "process %d: refs %u\n", process->pid, kref_read(&process->kref) - 1);
+
+		tid = 0;
+		while ((thread = stplr_debugfs_next_thread(process, tid)) != NULL) {
+			tid = thread->tid;
+			stplr_debugfs_show_thread(m, thread, now);
+			stplr_thread_put(thread);
+		}
+
+		stplr_process_put(process);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stplr_debugfs_device);
+
 static void stplr_free_devices(void)
 {
 	struct stplr_device *dev;
 	struct hlist_node *node;
 
 	hlist_for_each_entry_safe(dev, node, &stplr_devices, hlist) {
+		debugfs_remove(dev->debugfs);
 		misc_deregister(&dev->miscdev);
 		hlist_del(&dev->hlist);
+		idr_destroy(&dev->groups);
 		stplr_dbg_at1("'%s' device destroyed\n", dev->name);
 
 		kfree(dev);
 	}
 }
 
+static ssize_t busy_poll_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct stplr_device *dev = container_of(dev_get_drvdata(d), struct stplr_device, miscdev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(dev->busy_poll_us));
+}
+
+static ssize_t busy_poll_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct stplr_device *dev = container_of(dev_get_drvdata(d), struct stplr_device, miscdev);
+	unsigned int value;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &value);
+	if (ret)
+		return ret;
+
+	if (value > STPLR_BUSY_POLL_MAX_US)
+		return -EINVAL;
+
+	WRITE_ONCE(dev->busy_poll_us, value);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(busy_poll);
+
+static struct attribute *stplr_device_attrs[] = {
+	&dev_attr_busy_poll.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(stplr_device);
+
 static int __init stplr_init_device(int device_id)
 {
 	int status;
@@ -1224,6 +6439,8 @@ static int __init stplr_init_device(int device_id)
 	dev->miscdev.fops = &stplr_fops;
 	dev->miscdev.minor = MISC_DYNAMIC_MINOR;
 	dev->miscdev.name = dev->name;
+	dev->miscdev.groups = stplr_device_groups;
+	dev->busy_poll_us = min_t(unsigned int, stplr_busy_poll_us, STPLR_BUSY_POLL_MAX_US);
 	status = misc_register(&dev->miscdev);
 	if (status < 0) {
 		pr_err("misc_register(%s) failed with code %d\n", dev->name, status);
@@ -1233,18 +6450,57 @@ static int __init stplr_init_device(int device_id)
 
 	mutex_init(&dev->processes_lock);
 	dev->processes.rb_node = NULL;
+	mutex_init(&dev->groups_lock);
+	idr_init(&dev->groups);
+	mutex_init(&dev->names_lock);
+	hash_init(dev->names);
 
 	hlist_add_head(&dev->hlist, &stplr_devices);
+	dev->debugfs = debugfs_create_file(dev->name, 0400, stplr_debugfs_root, dev,
+		&stplr_debugfs_device_fops);
 	stplr_dbg_at1("'%s' device created\n", dev->name);
 
 	return 0;
 }
 
+static void stplr_destroy_caches(void)
+{
+	/* threads are freed after rcu grace period */
+	rcu_barrier();
+
+	kmem_cache_destroy(stplr_transaction_cache);
+	kmem_cache_destroy(stplr_thread_cache);
+	kmem_cache_destroy(stplr_process_cache);
+}
+
+static int __init stplr_create_caches(void)
+{
+	stplr_process_cache = KMEM_CACHE(stplr_process, SLAB_HWCACHE_ALIGN);
+	stplr_thread_cache = KMEM_CACHE(stplr_thread, SLAB_HWCACHE_ALIGN);
+	stplr_transaction_cache = KMEM_CACHE(stplr_transaction, SLAB_HWCACHE_ALIGN);
+
+	if (!stplr_process_cache || !stplr_thread_cache || !stplr_transaction_cache) {
+		stplr_destroy_caches();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static int __init stplr_init(void)
 {
 	int i;
 	int status;
 
+	status = stplr_create_caches();
+	if (status)
+		return status;
+
+	/* debug level might have been set before the module got loaded */
+	stplr_debug_level_update();
+
+	stplr_debugfs_root = debugfs_create_dir(STPLR_DEVICE_NAME, NULL);
+
 	for (i = 0; i < stplr_num_of_devices; i++) {
 		status = stplr_init_device(i);
 		if (status)
@@ -1256,6 +6512,8 @@ static int __init stplr_init(void)
 
 out1:
 	stplr_free_devices();
+	debugfs_remove_recursive(stplr_debugfs_root);
+	stplr_destroy_caches();
 	return status;
 }
 module_init(stplr_init);
@@ -1264,6 +6522,8 @@ module_init(stplr_init);
 static void __exit stplr_exit(void)
 {
 	stplr_free_devices();
+	debugfs_remove_recursive(stplr_debugfs_root);
+	stplr_destroy_caches();
 	pr_info("module removed\n");
 }
 module_exit(stplr_exit);
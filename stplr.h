@@ -20,8 +20,8 @@
 #include <linux/ioctl.h>
 
 #define STPLR_VERSION_MAJOR 0
-#define STPLR_VERSION_MINOR 0
-#define STPLR_VERSION_MICRO 7
+#define STPLR_VERSION_MINOR 19
+#define STPLR_VERSION_MICRO 0
 
 /**
  * struct stplr_version - used by STPLR_VERSION ioctl
@@ -99,6 +99,12 @@ struct stplr_msgs {
  *
  * The send data will not overflow the receive buffer area provided
  * by the receiver.
+ *
+ * If the sending thread is interrupted by a signal, the message(s) are given
+ * up, unless the thread has set STPLR_OPT_RESUME_INTERRUPTED. Then they stay
+ * queued and the ioctl restarted with the same arguments (by the kernel
+ * or by the caller after EINTR) resumes waiting for the very same call.
+ * Any other ioctl on the handle gives up the call.
  */
 struct stplr_msg_send {
 	struct stplr_handle handle;
@@ -133,6 +139,10 @@ struct stplr_msg_send {
  * by the receiver.
  * The reply data will not overflow the reply buffer area provided
  * by the sender.
+ *
+ * Interrupted by a signal, the ioctl may be restarted the same way
+ * as STPLR_MSG_SEND (STPLR_OPT_RESUME_INTERRUPTED), so the call is not
+ * sent again.
  */
 struct stplr_msg_send_receive {
 	struct stplr_handle handle;
@@ -150,7 +160,9 @@ struct stplr_msg_send_receive {
  * @pid:		process id of the sender process
  * @tid:		thread id of the sender thread
  * @reply_required:	1 if we shall reply to this message via STPLR_MSG_REPLY,
- * 			0 if the reply shall not be sent
+ * 			0 if the reply shall not be sent (a reply token
+ * 			instead of 1 if STPLR_OPT_REPLY_TOKEN is enabled
+ * 			or the message comes from STPLR_MSG_CALL)
  * @rmsgs:		an array of message buffers to be filled by sender
  * 			message(s)
  *
@@ -194,6 +206,8 @@ struct stplr_msg_receive {
  *
  * The reply data will not overflow the reply buffer area provided
  * by the sender.
+ * Calls issued by STPLR_MSG_CALL cannot be addressed by @pid and @tid,
+ * they are always replied to by STPLR_MSG_REPLY_TOKEN.
  */
 struct stplr_msg_reply {
 	struct stplr_handle handle;
@@ -204,6 +218,727 @@ struct stplr_msg_reply {
 	};
 };
 
+/**
+ * struct stplr_group - used by STPLR_GROUP_CREATE and STPLR_GROUP_DESTROY ioctls
+ * @gid:	group identifier (returned by STPLR_GROUP_CREATE)
+ *
+ * Subscriber group is a set of receiving threads (possibly living
+ * in different processes) which all get a copy of every message
+ * posted to the group by STPLR_MSG_POST.
+ * The group is owned by the process which created it and it is destroyed
+ * either explicitly by STPLR_GROUP_DESTROY or when the owning process
+ * closes the stapler device.
+ */
+struct stplr_group {
+	__u32 gid;
+};
+
+/**
+ * struct stplr_group_subscription - used by STPLR_GROUP_SUBSCRIBE and
+ *                                   STPLR_GROUP_UNSUBSCRIBE ioctls
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET) of the receiving thread
+ * @gid:	group identifier
+ *
+ * Once subscribed, the receiving thread gets messages posted to the group
+ * via regular STPLR_MSG_RECEIVE (with @reply_required set to 0).
+ * A thread is unsubscribed from all its groups when its handle is released.
+ */
+struct stplr_group_subscription {
+	struct stplr_handle handle;
+	__u32 gid;
+};
+
+/* do not wait for the subscribers to receive the posted message(s) */
+#define STPLR_MSG_POST_F_NOWAIT (1U << 0)
+
+/**
+ * struct stplr_msg_post - used by STPLR_MSG_POST ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @gid:	identifier of the group to post the message(s) to
+ * @flags:	STPLR_MSG_POST_F_* flags
+ * @smsgs:	an array of message buffers to be posted
+ *
+ * STPLR_MSG_POST delivers specified message(s) to every thread subscribed
+ * to the group @gid. The message buffers are pinned only once, regardless
+ * of the number of subscribers, and they are copied directly to the address
+ * space of every subscriber once it invokes STPLR_MSG_RECEIVE.
+ * Unless STPLR_MSG_POST_F_NOWAIT is given, the posting thread becomes
+ * blocked until all subscribers have received the message(s).
+ * With STPLR_MSG_POST_F_NOWAIT the call returns immediately and the message
+ * buffers are kept pinned until the last subscriber received them, thus they
+ * shall not be modified nor released by the caller in the meantime.
+ *
+ * On success the ioctl returns the number of subscribers the message(s)
+ * was/were posted to. @buflen fields of @smsgs are left untouched as every
+ * subscriber may consume different number of bytes.
+ */
+struct stplr_msg_post {
+	struct stplr_handle handle;
+	struct {
+		__u32 gid;
+		__u32 flags;
+		struct stplr_msgs smsgs;
+	};
+};
+
+/*
+ * STPLR_OPT_BUSY_POLL - busy poll window in microseconds (0 disables busy polling)
+ *
+ * When enabled, STPLR_MSG_SEND_RECEIVE and STPLR_MSG_RECEIVE spin on their
+ * completion condition before going to sleep. The actual spinning time is
+ * adapted to the observed response times and never exceeds the given window.
+ * Default value for new handles is taken from 'busy_poll' sysfs attribute
+ * of the device (initialized from 'busy_poll' module parameter).
+ */
+#define STPLR_OPT_BUSY_POLL 1
+
+/*
+ * STPLR_OPT_CREDIT_MSGS - number of messages sent by STPLR_MSG_SEND_ASYNC
+ *                         which every sending process may have outstanding
+ *                         (sent but not received yet) to the thread owning
+ *                         the handle (0 means no limit, which is the default)
+ * STPLR_OPT_CREDIT_BYTES - the same as above but expressed in bytes
+ */
+#define STPLR_OPT_CREDIT_MSGS 2
+#define STPLR_OPT_CREDIT_BYTES 3
+
+/*
+ * STPLR_OPT_REPLY_TOKEN - when non-zero, STPLR_MSG_RECEIVE and STPLR_MSG_RECEIVE_ARENA
+ *                         invoked with the handle report (in @reply_required)
+ *                         a reply token instead of 1 for messages requiring
+ *                         a reply (see STPLR_MSG_REPLY_TOKEN)
+ */
+#define STPLR_OPT_REPLY_TOKEN 4
+
+/*
+ * STPLR_OPT_TIMESTAMPS - user space address of struct stplr_timestamps
+ *                        (0 means none, which is the default) filled
+ *                        with the kernel timestamps of the message by every
+ *                        successful STPLR_MSG_RECEIVE, STPLR_MSG_RECEIVE_ARENA
+ *                        and STPLR_MSG_SEND_RECEIVE invoked with the handle
+ *                        (setting an address outside of user space fails
+ *                        with -EFAULT, and if the timestamps cannot be written,
+ *                        the address is reset to 0, so STPLR_HANDLE_GET_OPTION
+ *                        shows that they are no longer reported)
+ */
+#define STPLR_OPT_TIMESTAMPS 5
+
+/*
+ * STPLR_OPT_WAKE_AFFINE - when non-zero, the thread owning the handle is woken
+ *                         up (when a call is queued to it or its own call
+ *                         completes) with a hint that the waking thread is
+ *                         about to sleep, so that the scheduler prefers to run
+ *                         it on the cpu (and so the numa node) of the waking
+ *                         thread, where the data just written is cache hot
+ */
+#define STPLR_OPT_WAKE_AFFINE 6
+
+/*
+ * STPLR_OPT_WORK_STEALING - when non-zero, the thread owning the handle takes
+ *                           part in work stealing among the threads of its
+ *                           process which enabled the option as well: once
+ *                           its queue is empty, STPLR_MSG_RECEIVE takes a call
+ *                           waiting in the queue of a busy sibling (the reply
+ *                           is sent the usual way, as replies are addressed
+ *                           to the client, not to the thread it called)
+ */
+#define STPLR_OPT_WORK_STEALING 7
+
+/*
+ * STPLR_OPT_DISPATCH - one of STPLR_DISPATCH_* policies choosing which thread
+ *                      actually gets the calls addressed to the thread owning
+ *                      the handle; the choice is made among the threads of
+ *                      its process taking part in work stealing
+ *                      (STPLR_OPT_WORK_STEALING) or having a dispatch policy
+ *                      set themselves
+ *
+ * STPLR_DISPATCH_NONE - the addressed thread gets the call (default)
+ * STPLR_DISPATCH_ROUND_ROBIN - the threads get the calls in turns
+ * STPLR_DISPATCH_LEAST_QUEUED - an idle thread or the one with the shortest
+ *                               queue gets the call
+ * STPLR_DISPATCH_CPU_LOCAL - an idle thread which last waited on the cpu of
+ *                            the client, or on a cpu sharing the last level
+ *                            cache with it, gets the call (so that the data
+ *                            just written by the client is cache hot),
+ *                            otherwise as STPLR_DISPATCH_LEAST_QUEUED
+ */
+#define STPLR_OPT_DISPATCH 8
+
+#define STPLR_DISPATCH_NONE		0
+#define STPLR_DISPATCH_ROUND_ROBIN	1
+#define STPLR_DISPATCH_LEAST_QUEUED	2
+#define STPLR_DISPATCH_CPU_LOCAL	3
+
+/*
+ * STPLR_OPT_FILTER - file descriptor of a BPF program run for every call,
+ *                    asynchronous message (STPLR_MSG_SEND_ASYNC) and post
+ *                    (STPLR_MSG_POST) addressed to the thread owning
+ *                    the handle before it is queued (a negative value detaches
+ *                    the program, STPLR_HANDLE_GET_OPTION returns 1 if one
+ *                    is attached)
+ *
+ * As modules cannot define BPF program types of their own, the program is
+ * loaded as BPF_PROG_TYPE_RAW_TRACEPOINT. Its context is struct stplr_filter_ctx
+ * (read-only) and its return value is a verdict:
+ * - STPLR_FILTER_PASS - the call is queued to the addressed thread,
+ * - STPLR_FILTER_DROP - the call fails with -EPERM (a post is just not
+ *                       delivered to the thread),
+ * - thread id - the call is queued to that thread of the same process
+ *               (if there is no such thread, the call fails with -ENODEV,
+ *               so does any other value, as nothing verifies it),
+ * optionally or-ed with STPLR_FILTER_F_PRIORITY, which queues the call ahead
+ * of the calls queued without it (asynchronous messages and posts ignore it).
+ * The program runs once the messages are pinned, so the payload it sees
+ * comes from the very pages the receiver copies from. A program which would
+ * recurse into itself (e.g. being attached to a tracepoint hit while it runs)
+ * is not run and the verdict is STPLR_FILTER_DROP. The program is run like
+ * a raw tracepoint program, but not attached to any, so bpf_get_attach_cookie()
+ * returns 0.
+ */
+#define STPLR_OPT_FILTER 9
+
+#define STPLR_FILTER_PASS		0
+#define STPLR_FILTER_DROP		0xffffffffU
+#define STPLR_FILTER_F_PRIORITY		0x80000000U
+
+/*
+ * STPLR_OPT_QUEUE_MAX_CALLS - maximal number of calls (STPLR_MSG_SEND,
+ *                             STPLR_MSG_SEND_RECEIVE and STPLR_MSG_CALL)
+ *                             queued to the thread owning the handle
+ *                             (0 means no limit, the default)
+ * STPLR_OPT_QUEUE_MAX_BYTES - the same as above but expressed in bytes
+ *                             of the queued messages (a call exceeding
+ *                             the limit on its own is queued only
+ *                             to an empty queue)
+ */
+#define STPLR_OPT_QUEUE_MAX_CALLS 10
+#define STPLR_OPT_QUEUE_MAX_BYTES 11
+
+/*
+ * STPLR_OPT_ADMISSION_WAIT - what the calls of the thread owning the handle do
+ *                            when the queue of the receiving thread is full:
+ *                            0 - fail with -EAGAIN at once (the default),
+ *                            STPLR_ADMISSION_WAIT_FOREVER - wait for room,
+ *                            otherwise - wait for room at most this many
+ *                            microseconds and fail with -EBUSY then
+ *                            (the wait of the calls reading STPLR_OPT_DEADLINE
+ *                            ends at their deadline as well, failing with
+ *                            -ETIMEDOUT)
+ */
+#define STPLR_OPT_ADMISSION_WAIT 12
+
+#define STPLR_ADMISSION_WAIT_FOREVER	(~0ULL)
+
+/*
+ * STPLR_OPT_DEADLINE - user space address of __u64 absolute CLOCK_MONOTONIC
+ *                      deadline in nanoseconds (0 means none, as does
+ *                      the address 0, which is the default), read by every
+ *                      STPLR_MSG_SEND, STPLR_MSG_SEND_RECEIVE, STPLR_MSG_RECEIVE,
+ *                      STPLR_MSG_RECEIVE_ARENA, STPLR_MSG_REPLY,
+ *                      STPLR_MSG_CALL_COMPLETE, STPLR_MSG_POST (waiting for
+ *                      the subscribers) and STPLR_MSG_SEND_ASYNC (waiting
+ *                      for credits) invoked with the handle,
+ *                      so that a per call deadline is set by just writing
+ *                      the variable; the ioctl fails with -ETIMEDOUT if
+ *                      it is still blocked once the deadline passes
+ *                      (a call which has not been received yet is taken
+ *                      off the queue, as if the client has been interrupted,
+ *                      while a post stays queued to the subscribers)
+ */
+#define STPLR_OPT_DEADLINE 13
+
+/*
+ * STPLR_OPT_RESUME_INTERRUPTED - (bool) STPLR_MSG_SEND and STPLR_MSG_SEND_RECEIVE
+ *                                invoked with the handle and interrupted
+ *                                by a signal keep their call queued (with
+ *                                the message buffers in use) to be resumed
+ *                                by the ioctl restarted with the same
+ *                                arguments; set it only if the interrupted
+ *                                ioctls are always restarted (SA_RESTART
+ *                                or a retry on EINTR), never abandoned
+ *                                (e.g. by siglongjmp()), as the receiver
+ *                                may still write the reply to the buffers
+ *                                until then (0 by default, the call is
+ *                                given up when interrupted)
+ */
+#define STPLR_OPT_RESUME_INTERRUPTED 14
+
+/* wait for the receiver to return credits instead of failing with -EAGAIN */
+#define STPLR_MSG_SEND_ASYNC_F_WAIT (1U << 0)
+
+/**
+ * struct stplr_msg_send_async - used by STPLR_MSG_SEND_ASYNC ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @pid:	process id of the process to send the message(s) to
+ * @tid:	thread id of the thread to send the message(s) to
+ * @flags:	STPLR_MSG_SEND_ASYNC_F_* flags
+ * @smsgs:	an array of message buffers to be sent
+ *
+ * STPLR_MSG_SEND_ASYNC queues specified message(s) to the receiving thread
+ * and returns immediately, without waiting for the receiver to read them.
+ * The message buffers are kept pinned until the receiver has read them,
+ * thus they shall not be modified nor released by the caller in the meantime.
+ *
+ * Every message sent this way consumes credits which the receiver granted
+ * to the sending process (see STPLR_OPT_CREDIT_MSGS and STPLR_OPT_CREDIT_BYTES).
+ * The credits are returned once the receiver reads the message.
+ * When the credits are exhausted the ioctl fails with -EAGAIN, unless
+ * STPLR_MSG_SEND_ASYNC_F_WAIT is given, in which case the caller becomes
+ * blocked until enough credits are returned.
+ */
+struct stplr_msg_send_async {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		__u32 flags;
+		struct stplr_msgs smsgs;
+	};
+};
+
+/**
+ * struct stplr_handle_option - used by STPLR_HANDLE_SET_OPTION and
+ *                              STPLR_HANDLE_GET_OPTION ioctls
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @option:	one of STPLR_OPT_* options
+ * @value:	value of the option (set by the caller for STPLR_HANDLE_SET_OPTION,
+ * 		set by the driver for STPLR_HANDLE_GET_OPTION)
+ */
+struct stplr_handle_option {
+	struct stplr_handle handle;
+	struct {
+		__u32 option;
+		__u64 value;
+	};
+};
+
+/**
+ * struct stplr_timestamps - kernel timestamps of a message (see STPLR_OPT_TIMESTAMPS)
+ * @enqueue_ns:		the message was queued to the receiving thread
+ * @dequeue_ns:		the message was taken off the queue by the receiving thread
+ * @reply_ns:		the reply was issued by the receiving thread
+ * 			(STPLR_MSG_SEND_RECEIVE only, 0 otherwise)
+ * @reply_copy_ns:	the reply was copied to the buffers of the client
+ * 			(STPLR_MSG_SEND_RECEIVE only, 0 otherwise)
+ *
+ * All timestamps are CLOCK_MONOTONIC nanoseconds, so they may be compared
+ * with clock_gettime(CLOCK_MONOTONIC) taken in user space.
+ */
+struct stplr_timestamps {
+	__u64 enqueue_ns;
+	__u64 dequeue_ns;
+	__u64 reply_ns;
+	__u64 reply_copy_ns;
+};
+
+/* number of the payload bytes seen by STPLR_OPT_FILTER programs */
+#define STPLR_FILTER_PAYLOAD 32
+
+/**
+ * struct stplr_filter_ctx - context of STPLR_OPT_FILTER programs
+ * @pid:		process id of the client
+ * @tid:		thread id of the client
+ * @rtid:		thread id of the addressed thread
+ * @nmsgs:		number of messages of the call
+ * @bytes:		total size of the messages
+ * @payload_len:	number of valid bytes in @payload
+ * @payload:		first bytes of the first message
+ * @reserved:		always zero
+ *
+ * All fields are 64 bit wide, as the context of raw tracepoint programs
+ * is an array of 64 bit arguments. The verifier lets such programs read
+ * as many of them as the maximal number of arguments of BPF functions (12),
+ * so the structure is padded to that size.
+ */
+struct stplr_filter_ctx {
+	__u64 pid;
+	__u64 tid;
+	__u64 rtid;
+	__u64 nmsgs;
+	__u64 bytes;
+	__u64 payload_len;
+	__u64 payload[STPLR_FILTER_PAYLOAD / sizeof(__u64)];
+	__u64 reserved[2];
+};
+
+/* maximal length of a service name (including terminating null byte) */
+#define STPLR_NAME_MAX 64
+
+/**
+ * struct stplr_name_attach - used by STPLR_NAME_ATTACH and STPLR_NAME_DETACH ioctls
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET) of the receiving thread
+ * @name:	null terminated service name
+ *
+ * STPLR_NAME_ATTACH binds @name to the thread owning @handle, so that
+ * clients can find the thread by STPLR_NAME_OPEN instead of passing
+ * its pid and tid around. Names are unique within a stapler device.
+ * A thread may attach several names. All names attached by the thread
+ * are detached when its handle is released.
+ */
+struct stplr_name_attach {
+	struct stplr_handle handle;
+	char name[STPLR_NAME_MAX];
+};
+
+/**
+ * struct stplr_name_open - used by STPLR_NAME_OPEN ioctl
+ * @name:	null terminated service name
+ * @pid:	process id of the thread the name is attached to (set by the driver)
+ * @tid:	thread id of the thread the name is attached to (set by the driver)
+ *
+ * STPLR_NAME_OPEN resolves @name (attached by STPLR_NAME_ATTACH)
+ * to @pid and @tid which can be used in STPLR_MSG_SEND
+ * and STPLR_MSG_SEND_RECEIVE ioctls.
+ */
+struct stplr_name_open {
+	char name[STPLR_NAME_MAX];
+	pid_t pid;
+	pid_t tid;
+};
+
+/**
+ * struct stplr_msg_transfer - used by STPLR_MSG_READ and STPLR_MSG_WRITE ioctls
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET) of the receiving thread
+ * @pid:	process id of the client (as returned by STPLR_MSG_RECEIVE)
+ * @tid:	thread id of the client (as returned by STPLR_MSG_RECEIVE)
+ * @offset:	offset (in bytes) into the client's message buffers
+ * @size:	total size of the client's message buffers (set by the driver)
+ * @msgs:	an array of message buffers to read into (STPLR_MSG_READ)
+ * 		or to write from (STPLR_MSG_WRITE), their buflen fields
+ * 		are updated with number of actually copied bytes
+ *
+ * Both ioctls operate on a request which was received by STPLR_MSG_RECEIVE
+ * but has not been replied to yet. All client's message buffers are treated
+ * as one contiguous stream of bytes.
+ *
+ * STPLR_MSG_READ copies the data from the client's send buffers starting
+ * at @offset. This way the server may receive just a header of the request
+ * and pull the rest of it once it knows where to put it.
+ *
+ * STPLR_MSG_WRITE copies the data into the client's reply buffers starting
+ * at @offset. The data written this way is reported to the client together
+ * with the data passed by the final STPLR_MSG_REPLY (which copies to the
+ * beginning of the reply buffers), thus large replies may be streamed
+ * in parts and completed by STPLR_MSG_REPLY with no message buffers.
+ *
+ * Both ioctls return number of copied bytes. Only STPLR_MSG_SEND_RECEIVE
+ * requests can be accessed this way, calls issued by STPLR_MSG_CALL cannot.
+ */
+struct stplr_msg_transfer {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		__u32 offset;
+		__u32 size;
+		struct stplr_msgs msgs;
+	};
+};
+
+/**
+ * struct stplr_msg_receive_arena - used by STPLR_MSG_RECEIVE_ARENA ioctl
+ * @handle:		ipc handle (acquired by STPLR_HANDLE_GET)
+ * @pid:		process id of the sender process
+ * @tid:		thread id of the sender thread
+ * @reply_required:	1 if we shall reply to this message via STPLR_MSG_REPLY,
+ * 			0 if the reply shall not be sent
+ * @offset:		offset of the received message(s) within the arena
+ * 			(set by the driver)
+ * @size:		size of the received message(s) (set by the driver)
+ *
+ * Works like STPLR_MSG_RECEIVE, but instead of copying the message(s)
+ * to buffers provided by the caller, the driver copies them (back to back)
+ * to a free slot of the receive arena of the calling process.
+ * The arena is created by mmap() on the stapler device file descriptor
+ * (at offset 0, at most 64 MiB) and it is shared by all threads
+ * of the process. The slot has to be given back by STPLR_ARENA_RELEASE
+ * once the message is not needed anymore. The arena is not inherited
+ * by child processes and, once unmapped, a new one may be mapped.
+ *
+ * If there is not enough free space in the arena, the ioctl fails
+ * with -ENOBUFS and the message is left queued. A message which does
+ * not fit even the empty arena fails back to its sender with -EMSGSIZE
+ * (or, if posted, is dropped) and the next one is received instead.
+ */
+struct stplr_msg_receive_arena {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		int reply_required;
+		__u32 offset;
+		__u32 size;
+	};
+};
+
+/**
+ * struct stplr_arena_release - used by STPLR_ARENA_RELEASE ioctl
+ * @offset:	offset of the slot as returned by STPLR_MSG_RECEIVE_ARENA
+ */
+struct stplr_arena_release {
+	__u32 offset;
+};
+
+/**
+ * struct stplr_msg_reply_token - used by STPLR_MSG_REPLY_TOKEN ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET) of the replying thread
+ * @token:	reply token (the positive value of @reply_required reported
+ * 		by a receive ioctl with STPLR_OPT_REPLY_TOKEN enabled)
+ * @rmsgs:	an array of messages you will reply with (on return @buflen
+ * 		fields will contain actual number of copied bytes)
+ *
+ * Unlike STPLR_MSG_REPLY, the reply is copied directly to the reply
+ * buffers of the sender and the replying thread does not block.
+ * A token may be used by any thread of the process which received
+ * the message, in any order, but only once. Tokens of requests which
+ * were abandoned by their senders are rejected with -ESRCH.
+ */
+struct stplr_msg_reply_token {
+	struct stplr_handle handle;
+	struct {
+		__u32 token;
+		struct stplr_msgs rmsgs;
+	};
+};
+
+/**
+ * struct stplr_msg_call - used by STPLR_MSG_CALL ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @pid:	process id of the process to send the message(s) to
+ * @tid:	thread id of the thread to send the message(s) to
+ * @cookie:	opaque value passed back by STPLR_MSG_CALL_COMPLETE
+ * @smsgs:	an array of message buffers to be sent
+ * @rmsgs:	an array of message buffers to be filled by replying
+ * 		thread
+ *
+ * STPLR_MSG_CALL is the non-blocking counterpart of STPLR_MSG_SEND_RECEIVE.
+ * It queues the call and returns immediately, so one thread may have many
+ * calls in flight. All the message buffers stay pinned and must stay valid
+ * until the call is completed. Completion of the call, together with the
+ * sizes of the sent and received messages (written back into @smsgs
+ * and @rmsgs arrays), is reported by STPLR_MSG_CALL_COMPLETE.
+ *
+ * The receiving thread gets a reply token in @reply_required of struct
+ * stplr_msg_receive and replies by STPLR_MSG_REPLY_TOKEN.
+ */
+struct stplr_msg_call {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		__u64 cookie;
+		struct stplr_msgs smsgs;
+		struct stplr_msgs rmsgs;
+	};
+};
+
+/**
+ * struct stplr_msg_call_complete - used by STPLR_MSG_CALL_COMPLETE ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET) of the calling thread
+ * @flags:	STPLR_MSG_CALL_COMPLETE_F_* flags
+ * @status:	completion status of the call (set by the driver), 0 on success
+ * 		or negative error code (e.g. -EPIPE if the receiving thread
+ * 		went away without replying)
+ * @cookie:	cookie of the completed call (set by the driver)
+ *
+ * STPLR_MSG_CALL_COMPLETE reaps one completed call issued by STPLR_MSG_CALL.
+ * It blocks until any of the calls completes unless
+ * STPLR_MSG_CALL_COMPLETE_F_NOWAIT is specified, in which case it fails
+ * with -EAGAIN when there is nothing to reap.
+ */
+struct stplr_msg_call_complete {
+	struct stplr_handle handle;
+	struct {
+		__u32 flags;
+		__s32 status;
+		__u64 cookie;
+	};
+};
+
+#define STPLR_MSG_CALL_COMPLETE_F_NOWAIT (1U << 0)
+
+/* number of buckets of a histogram */
+#define STPLR_STATS_BUCKETS 32
+
+/* histograms reported by STPLR_STATS_GET (indices of stplr_stats::histograms) */
+#define STPLR_STATS_SIZE	0 /* sizes of received messages in bytes */
+#define STPLR_STATS_QUEUE_NS	1 /* time messages spent queued before being received */
+#define STPLR_STATS_COPY_NS	2 /* time spent copying received messages */
+#define STPLR_STATS_RTT_NS	3 /* time from queueing a call to delivering its reply */
+#define STPLR_STATS_NUM_OF_HISTOGRAMS 4
+
+/**
+ * struct stplr_stats_histogram - log2 histogram
+ * @buckets:	bucket n counts values from range [2^n, 2^(n+1)),
+ * 		bucket 0 counts also zeros and the last bucket counts
+ * 		all values which do not fit into the previous ones
+ */
+struct stplr_stats_histogram {
+	__u64 buckets[STPLR_STATS_BUCKETS];
+};
+
+#define STPLR_STATS_GET_F_RESET (1U << 0)
+
+/**
+ * struct stplr_stats - used by STPLR_STATS_GET ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @flags:	STPLR_STATS_GET_F_* flags
+ * @histograms:	histograms of the thread (set by the driver),
+ * 		indexed by STPLR_STATS_* constants
+ *
+ * Every receiving thread keeps (per cpu) histograms of the sizes of received
+ * messages, of the time they waited in the queue, of the time it took
+ * to copy them and of the round-trip time of the calls it replied to.
+ * Histograms are collected since the first receive of the thread or since
+ * they were last reset by STPLR_STATS_GET_F_RESET (which clears them
+ * after they are reported).
+ */
+struct stplr_stats {
+	struct stplr_handle handle;
+	struct {
+		__u32 flags;
+		struct stplr_stats_histogram histograms[STPLR_STATS_NUM_OF_HISTOGRAMS];
+	};
+};
+
+/* load metrics of STPLR_LOAD_NOTIFY */
+#define STPLR_LOAD_QUEUE_DEPTH	0
+#define STPLR_LOAD_QUEUE_WAIT	1
+
+/**
+ * struct stplr_load_notify - used by STPLR_LOAD_NOTIFY ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @high_fd:	eventfd signalled when the load reaches @high (-1 if none)
+ * @low_fd:	eventfd signalled when the load, once it has reached @high,
+ * 		falls to @low (-1 if none, may be the same as @high_fd)
+ * @metric:	STPLR_LOAD_QUEUE_DEPTH (number of queued calls) or
+ * 		STPLR_LOAD_QUEUE_WAIT (nanoseconds the oldest queued call waits)
+ * @high:	high watermark
+ * @low:	low watermark (shall be lower than @high)
+ *
+ * The load of the thread owning the handle is evaluated whenever a call
+ * is queued to it or taken off its queue (and, for STPLR_LOAD_QUEUE_WAIT,
+ * also once the oldest call has waited for @high, so that a stalled thread
+ * is noticed as well), so that e.g. a supervisor may spawn
+ * or park receiving threads before the latency of the calls degrades.
+ * Setting both descriptors to -1 stops the notifications.
+ */
+struct stplr_load_notify {
+	struct stplr_handle handle;
+	struct {
+		__s32 high_fd;
+		__s32 low_fd;
+		__u32 metric;
+		__u64 high;
+		__u64 low;
+	};
+};
+
+/* number of message buffers carried inline by the v2 ioctls (UIO_FASTIOV) */
+#define STPLR_MSGV_INLINE 8
+
+/**
+ * struct stplr_msgv - describes an array of ipc message buffers (v2 ioctls)
+ * @count:		number of message buffers (at most UIO_MAXIOV)
+ * @pad:		must be zero
+ * @msgs:		pointer to array of @count message buffers,
+ * 			used only if @count exceeds STPLR_MSGV_INLINE
+ * @inline_msgs:	the message buffers themselves if @count does not
+ * 			exceed STPLR_MSGV_INLINE
+ *
+ * Unlike struct stplr_msgs, which always points to the array, small arrays
+ * travel inside the ioctl argument, so the driver reads the whole call with
+ * a single copy. On return the @buflen fields (of @inline_msgs or of the array
+ * pointed to by @msgs) contain actual number of copied bytes, written back
+ * all at once.
+ */
+struct stplr_msgv {
+	__u32 count;
+	__u32 pad;
+	struct stplr_msg *msgs;
+	struct stplr_msg inline_msgs[STPLR_MSGV_INLINE];
+};
+
+/**
+ * struct stplr_msg_send_v2 - used by STPLR_MSG_SEND_V2 ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @pid:	process id of the process to send the message(s) to
+ * @tid:	thread id of the thread to send the message(s) to
+ * @smsgv:	message buffers to be sent
+ *
+ * Same as STPLR_MSG_SEND, except for the layout of the messages.
+ */
+struct stplr_msg_send_v2 {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		struct stplr_msgv smsgv;
+	};
+};
+
+/**
+ * struct stplr_msg_send_receive_v2 - used by STPLR_MSG_SEND_RECEIVE_V2 ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @pid:	process id of the process to send the message(s) to
+ * @tid:	thread id of the thread to send the message(s) to
+ * @nsmsgs:	number of message buffers to be sent, these are the first
+ * 		@nsmsgs buffers of @msgv, the remaining ones are filled
+ * 		by replying thread
+ * @msgv:	message buffers to be sent followed by reply message buffers
+ *
+ * Same as STPLR_MSG_SEND_RECEIVE, except for the layout of the messages.
+ */
+struct stplr_msg_send_receive_v2 {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		__u32 nsmsgs;
+		struct stplr_msgv msgv;
+	};
+};
+
+/**
+ * struct stplr_msg_receive_v2 - used by STPLR_MSG_RECEIVE_V2 ioctl
+ * @handle:		ipc handle (acquired by STPLR_HANDLE_GET)
+ * @pid:		process id of the sender process
+ * @tid:		thread id of the sender thread
+ * @reply_required:	as in struct stplr_msg_receive
+ * @rmsgv:		message buffers to be filled by sender message(s)
+ *
+ * Same as STPLR_MSG_RECEIVE, except for the layout of the messages.
+ * With inline message buffers @pid, @tid, @reply_required and the sizes
+ * of the messages are all written back by a single copy.
+ */
+struct stplr_msg_receive_v2 {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		int reply_required;
+		struct stplr_msgv rmsgv;
+	};
+};
+
+/**
+ * struct stplr_msg_reply_v2 - used by STPLR_MSG_REPLY_V2 ioctl
+ * @handle:	ipc handle (acquired by STPLR_HANDLE_GET)
+ * @pid:	process id of the process to reply the message(s) to
+ * @tid:	thread id of the thread to reply the message(s) to
+ * @rmsgv:	message buffers you will reply with
+ *
+ * Same as STPLR_MSG_REPLY, except for the layout of the messages.
+ */
+struct stplr_msg_reply_v2 {
+	struct stplr_handle handle;
+	struct {
+		pid_t pid;
+		pid_t tid;
+		struct stplr_msgv rmsgv;
+	};
+};
+
 #define STPLR_MAGIC 'i'
 #define STPLR_IO(nr)		_IO(STPLR_MAGIC, nr)
 #define STPLR_IOR(nr, type)	_IOR(STPLR_MAGIC, nr, type)
@@ -217,6 +952,30 @@ struct stplr_msg_reply {
 #define STPLR_MSG_SEND_RECEIVE	STPLR_IOWR(46, struct stplr_msg_send_receive)
 #define STPLR_MSG_RECEIVE	STPLR_IOWR(47, struct stplr_msg_receive)
 #define STPLR_MSG_REPLY		STPLR_IOWR(48, struct stplr_msg_reply)
+#define STPLR_GROUP_CREATE	STPLR_IOR (49, struct stplr_group)
+#define STPLR_GROUP_DESTROY	STPLR_IOW (50, struct stplr_group)
+#define STPLR_GROUP_SUBSCRIBE	STPLR_IOW (51, struct stplr_group_subscription)
+#define STPLR_GROUP_UNSUBSCRIBE	STPLR_IOW (52, struct stplr_group_subscription)
+#define STPLR_MSG_POST		STPLR_IOW (53, struct stplr_msg_post)
+#define STPLR_HANDLE_SET_OPTION	STPLR_IOW (54, struct stplr_handle_option)
+#define STPLR_HANDLE_GET_OPTION	STPLR_IOWR(55, struct stplr_handle_option)
+#define STPLR_NAME_ATTACH	STPLR_IOW (56, struct stplr_name_attach)
+#define STPLR_NAME_DETACH	STPLR_IOW (57, struct stplr_name_attach)
+#define STPLR_NAME_OPEN		STPLR_IOWR(58, struct stplr_name_open)
+#define STPLR_MSG_SEND_ASYNC	STPLR_IOW (59, struct stplr_msg_send_async)
+#define STPLR_MSG_READ		STPLR_IOWR(60, struct stplr_msg_transfer)
+#define STPLR_MSG_WRITE		STPLR_IOWR(61, struct stplr_msg_transfer)
+#define STPLR_MSG_RECEIVE_ARENA	STPLR_IOWR(62, struct stplr_msg_receive_arena)
+#define STPLR_ARENA_RELEASE	STPLR_IOW (63, struct stplr_arena_release)
+#define STPLR_MSG_REPLY_TOKEN	STPLR_IOWR(64, struct stplr_msg_reply_token)
+#define STPLR_MSG_CALL		STPLR_IOW (65, struct stplr_msg_call)
+#define STPLR_MSG_CALL_COMPLETE	STPLR_IOWR(66, struct stplr_msg_call_complete)
+#define STPLR_STATS_GET		STPLR_IOWR(67, struct stplr_stats)
+#define STPLR_LOAD_NOTIFY	STPLR_IOW (68, struct stplr_load_notify)
+#define STPLR_MSG_SEND_RECEIVE_V2	STPLR_IOWR(69, struct stplr_msg_send_receive_v2)
+#define STPLR_MSG_RECEIVE_V2	STPLR_IOWR(70, struct stplr_msg_receive_v2)
+#define STPLR_MSG_REPLY_V2	STPLR_IOWR(71, struct stplr_msg_reply_v2)
+#define STPLR_MSG_SEND_V2	STPLR_IOWR(72, struct stplr_msg_send_v2)
 
 static inline const char *stplr_cmd_to_string(size_t cmd)
 {
@@ -235,6 +994,54 @@ static inline const char *stplr_cmd_to_string(size_t cmd)
 		return "STPLR_MSG_RECEIVE";
 	case STPLR_MSG_REPLY:
 		return "STPLR_MSG_REPLY";
+	case STPLR_GROUP_CREATE:
+		return "STPLR_GROUP_CREATE";
+	case STPLR_GROUP_DESTROY:
+		return "STPLR_GROUP_DESTROY";
+	case STPLR_GROUP_SUBSCRIBE:
+		return "STPLR_GROUP_SUBSCRIBE";
+	case STPLR_GROUP_UNSUBSCRIBE:
+		return "STPLR_GROUP_UNSUBSCRIBE";
+	case STPLR_MSG_POST:
+		return "STPLR_MSG_POST";
+	case STPLR_HANDLE_SET_OPTION:
+		return "STPLR_HANDLE_SET_OPTION";
+	case STPLR_HANDLE_GET_OPTION:
+		return "STPLR_HANDLE_GET_OPTION";
+	case STPLR_NAME_ATTACH:
+		return "STPLR_NAME_ATTACH";
+	case STPLR_NAME_DETACH:
+		return "STPLR_NAME_DETACH";
+	case STPLR_NAME_OPEN:
+		return "STPLR_NAME_OPEN";
+	case STPLR_MSG_SEND_ASYNC:
+		return "STPLR_MSG_SEND_ASYNC";
+	case STPLR_MSG_READ:
+		return "STPLR_MSG_READ";
+	case STPLR_MSG_WRITE:
+		return "STPLR_MSG_WRITE";
+	case STPLR_MSG_RECEIVE_ARENA:
+		return "STPLR_MSG_RECEIVE_ARENA";
+	case STPLR_ARENA_RELEASE:
+		return "STPLR_ARENA_RELEASE";
+	case STPLR_MSG_REPLY_TOKEN:
+		return "STPLR_MSG_REPLY_TOKEN";
+	case STPLR_MSG_CALL:
+		return "STPLR_MSG_CALL";
+	case STPLR_MSG_CALL_COMPLETE:
+		return "STPLR_MSG_CALL_COMPLETE";
+	case STPLR_STATS_GET:
+		return "STPLR_STATS_GET";
+	case STPLR_LOAD_NOTIFY:
+		return "STPLR_LOAD_NOTIFY";
+	case STPLR_MSG_SEND_RECEIVE_V2:
+		return "STPLR_MSG_SEND_RECEIVE_V2";
+	case STPLR_MSG_RECEIVE_V2:
+		return "STPLR_MSG_RECEIVE_V2";
+	case STPLR_MSG_REPLY_V2:
+		return "STPLR_MSG_REPLY_V2";
+	case STPLR_MSG_SEND_V2:
+		return "STPLR_MSG_SEND_V2";
 	default:
 		return "STPLR_UNRECOGNIZED_COMMAND";
 	}
@@ -0,0 +1,193 @@
+/*
+ * stplr_trace.h
+ *
+ * Copyright (C) 2022 Lukasz Wiecaszek <lukasz.wiecaszek(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License (in file COPYING) for more details.
+ */
+
+/*
+ * Trace events of the message lifecycle, so that per phase latencies
+ * (queueing, copying, replying, waking up) can be measured by perf,
+ * ftrace or bpftrace (e.g. 'bpftrace -e tracepoint:stplr:stplr_dequeue {...}').
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stplr
+
+#if !defined(_STPLR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _STPLR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(stplr_thread_class,
+
+	TP_PROTO(pid_t pid, pid_t tid),
+
+	TP_ARGS(pid, tid),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tid)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+	),
+
+	TP_printk("%d:%d", __entry->pid, __entry->tid)
+);
+
+/* thread acquired a handle (STPLR_HANDLE_GET) */
+DEFINE_EVENT(stplr_thread_class, stplr_handle_get,
+	TP_PROTO(pid_t pid, pid_t tid),
+	TP_ARGS(pid, tid)
+);
+
+/* thread released its handle (STPLR_HANDLE_PUT) */
+DEFINE_EVENT(stplr_thread_class, stplr_handle_put,
+	TP_PROTO(pid_t pid, pid_t tid),
+	TP_ARGS(pid, tid)
+);
+
+/* thread is woken up (a call is queued to it or its call is completed) */
+DEFINE_EVENT(stplr_thread_class, stplr_wakeup,
+	TP_PROTO(pid_t pid, pid_t tid),
+	TP_ARGS(pid, tid)
+);
+
+/* a call (or a post) is queued by the client to the receiving thread */
+TRACE_EVENT(stplr_enqueue,
+
+	TP_PROTO(pid_t pid, pid_t tid, pid_t rpid, pid_t rtid, __u32 nmsgs, bool reply_required),
+
+	TP_ARGS(pid, tid, rpid, rtid, nmsgs, reply_required),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tid)
+		__field(pid_t, rpid)
+		__field(pid_t, rtid)
+		__field(__u32, nmsgs)
+		__field(bool, reply_required)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->rpid = rpid;
+		__entry->rtid = rtid;
+		__entry->nmsgs = nmsgs;
+		__entry->reply_required = reply_required;
+	),
+
+	TP_printk("%d:%d -> %d:%d nmsgs=%u reply_required=%d",
+		__entry->pid, __entry->tid, __entry->rpid, __entry->rtid,
+		__entry->nmsgs, __entry->reply_required)
+);
+
+/* a call (or a post) is taken off the queue by the receiving thread */
+TRACE_EVENT(stplr_dequeue,
+
+	TP_PROTO(pid_t pid, pid_t tid, pid_t cpid, pid_t ctid),
+
+	TP_ARGS(pid, tid, cpid, ctid),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tid)
+		__field(pid_t, cpid)
+		__field(pid_t, ctid)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->cpid = cpid;
+		__entry->ctid = ctid;
+	),
+
+	TP_printk("%d:%d <- %d:%d",
+		__entry->pid, __entry->tid, __entry->cpid, __entry->ctid)
+);
+
+DECLARE_EVENT_CLASS(stplr_copy_class,
+
+	TP_PROTO(pid_t pid, pid_t tid, __u32 segments, size_t bytes),
+
+	TP_ARGS(pid, tid, segments, bytes),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tid)
+		__field(__u32, segments)
+		__field(size_t, bytes)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->segments = segments;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("peer=%d:%d segments=%u bytes=%zu",
+		__entry->pid, __entry->tid, __entry->segments, __entry->bytes)
+);
+
+/* copying between the current thread and its peer starts (@bytes is the size offered) */
+DEFINE_EVENT(stplr_copy_class, stplr_copy_start,
+	TP_PROTO(pid_t pid, pid_t tid, __u32 segments, size_t bytes),
+	TP_ARGS(pid, tid, segments, bytes)
+);
+
+/* copying between the current thread and its peer ends (@bytes is the size copied) */
+DEFINE_EVENT(stplr_copy_class, stplr_copy_end,
+	TP_PROTO(pid_t pid, pid_t tid, __u32 segments, size_t bytes),
+	TP_ARGS(pid, tid, segments, bytes)
+);
+
+/* the receiving thread replies to the call of the client */
+TRACE_EVENT(stplr_reply,
+
+	TP_PROTO(pid_t pid, pid_t tid, pid_t cpid, pid_t ctid, __u32 token),
+
+	TP_ARGS(pid, tid, cpid, ctid, token),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tid)
+		__field(pid_t, cpid)
+		__field(pid_t, ctid)
+		__field(__u32, token)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->tid = tid;
+		__entry->cpid = cpid;
+		__entry->ctid = ctid;
+		__entry->token = token;
+	),
+
+	TP_printk("%d:%d -> %d:%d token=%u",
+		__entry->pid, __entry->tid, __entry->cpid, __entry->ctid,
+		__entry->token)
+);
+
+#endif /* _STPLR_TRACE_H */
+
+/* this part must be outside of the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE stplr_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file arena.c
+ *
+ * Small application showing usage of the stapler receive arena.
+ * The process maps the arena and its server thread receives messages
+ * of various sizes using STPLR_MSG_RECEIVE_ARENA ioctl, while the main
+ * thread sends them using STPLR_MSG_SEND_RECEIVE ioctl.
+ *
+ * @author Lukasz Wiecaszek <lukasz.wiecaszek@gmail.com>
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "common.h"
+#include "../../stplr.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+static int debug_level = 3;
+
+#define dbg_at1(args...) do { if (debug_level >= 1) fprintf(stderr, args); } while (0)
+#define dbg_at2(args...) do { if (debug_level >= 2) fprintf(stdout, args); } while (0)
+#define dbg_at3(args...) do { if (debug_level >= 3) fprintf(stdout, args); } while (0)
+
+#define NUM_OF_REPETITIONS 1000
+#define MAX_MESSAGE_SIZE 8192
+#define ARENA_SIZE (1 << 20)
+
+/*===========================================================================*\
+ * local types definitions
+\*===========================================================================*/
+struct thread_args {
+    pthread_t thread_id;
+    int       fd;
+    const uint8_t *arena;
+    pid_t     tid;
+};
+
+/*===========================================================================*\
+ * local (internal linkage) objects definitions
+\*===========================================================================*/
+static pthread_barrier_t ready;
+
+/*===========================================================================*\
+ * global (external linkage) objects definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local (internal linkage) functions definitions
+\*===========================================================================*/
+static uint8_t pattern(int message, int offset)
+{
+    return (uint8_t)(message * 31 + offset);
+}
+
+static size_t message_size(int message)
+{
+    return (message * 97) % MAX_MESSAGE_SIZE;
+}
+
+static void* server_function(void *ptr)
+{
+    int i;
+    size_t n;
+    int status;
+    uint32_t size;
+    struct stplr_handle handle;
+    struct thread_args *args = (struct thread_args *)ptr;
+
+    status = ioctl(args->fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    args->tid = gettid();
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; i < NUM_OF_REPETITIONS; i++) {
+        struct stplr_msg_receive_arena msg_receive = {};
+        msg_receive.handle = handle;
+
+        status = ioctl(args->fd, STPLR_MSG_RECEIVE_ARENA, &msg_receive);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_RECEIVE_ARENA) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (msg_receive.size != message_size(i) || !msg_receive.reply_required) {
+            dbg_at1("[%d] unexpected message #%d (size: %u, expected: %zu)\n",
+                gettid(), i, msg_receive.size, message_size(i));
+            exit(EXIT_FAILURE);
+        }
+
+        for (n = 0; n < msg_receive.size; n++)
+            if (args->arena[msg_receive.offset + n] != pattern(i, n)) {
+                dbg_at1("[%d] corrupted message #%d at offset %zu\n", gettid(), i, n);
+                exit(EXIT_FAILURE);
+            }
+
+        struct stplr_arena_release arena_release = {};
+        arena_release.offset = msg_receive.offset;
+
+        status = ioctl(args->fd, STPLR_ARENA_RELEASE, &arena_release);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_ARENA_RELEASE) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        size = msg_receive.size;
+
+        struct stplr_msg msgs[] = {
+            {.msgbuf = &size, .buflen = sizeof(size)},
+        };
+
+        struct stplr_msg_reply msg_reply = {};
+        msg_reply.handle = handle;
+        msg_reply.pid = msg_receive.pid;
+        msg_reply.tid = msg_receive.tid;
+        msg_reply.rmsgs.msgs = msgs;
+        msg_reply.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
+
+        status = ioctl(args->fd, STPLR_MSG_REPLY, &msg_reply);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_REPLY) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    dbg_at3("[%d] received %d messages\n", gettid(), NUM_OF_REPETITIONS);
+
+    status = ioctl(args->fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return NULL;
+}
+
+static int send_message(int fd, const struct stplr_handle *handle, pid_t tid, int message)
+{
+    int ret;
+    size_t n;
+    uint32_t size = 0;
+    static uint8_t buffer[MAX_MESSAGE_SIZE];
+
+    for (n = 0; n < message_size(message); n++)
+        buffer[n] = pattern(message, n);
+
+    /* split the message in two, the server gets both parts back to back */
+    struct stplr_msg smsgs[] = {
+        {.msgbuf = buffer, .buflen = message_size(message) / 2},
+        {.msgbuf = buffer + message_size(message) / 2, .buflen = message_size(message) - message_size(message) / 2},
+    };
+
+    struct stplr_msg rmsgs[] = {
+        {.msgbuf = &size, .buflen = sizeof(size)},
+    };
+
+    struct stplr_msg_send_receive msg_send_receive = {};
+    msg_send_receive.handle = *handle;
+    msg_send_receive.pid = getpid();
+    msg_send_receive.tid = tid;
+    msg_send_receive.smsgs.msgs = smsgs;
+    msg_send_receive.smsgs.count = sizeof(smsgs)/sizeof(smsgs[0]);
+    msg_send_receive.rmsgs.msgs = rmsgs;
+    msg_send_receive.rmsgs.count = sizeof(rmsgs)/sizeof(rmsgs[0]);
+
+    ret = ioctl(fd, STPLR_MSG_SEND_RECEIVE, &msg_send_receive);
+    if (ret < 0) {
+        dbg_at1("ioctl(STPLR_MSG_SEND_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+        return ret;
+    }
+
+    if (size != message_size(message)) {
+        dbg_at1("server got %u bytes of message #%d (expected %zu)\n",
+            size, message, message_size(message));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*===========================================================================*\
+ * global (external linkage) functions definitions
+\*===========================================================================*/
+int main(int argc, char *argv[])
+{
+    int fd;
+    int c;
+    int i;
+    int status;
+    void *arena;
+    struct stplr_version version;
+    struct stplr_handle handle;
+    struct thread_args thread_args;
+    struct timespec t1, t2;
+    uint64_t microseconds;
+
+    static struct option long_options[] = {
+        {"verbose", required_argument, 0, 'v'},
+        {0, 0, 0, 0}
+    };
+
+    for (;;) {
+        c = getopt_long(argc, argv, "v:", long_options, 0);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'v':
+                debug_level = atoi(optarg);
+                break;
+        }
+    }
+
+    fd = open(STPLR_DEVICENAME, O_RDWR);
+    assert(fd >= -1);
+    if (fd == -1) {
+        dbg_at1("cannot open '%s': %s\n",
+            STPLR_DEVICENAME, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_VERSION, &version);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_VERSION) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    dbg_at2("version: %d.%d.%d\n", version.major, version.minor, version.micro);
+
+    if (version.major != STPLR_VERSION_MAJOR || version.minor < 6) {
+        dbg_at1("kernel module version does not support receive arena\n");
+        exit(EXIT_FAILURE);
+    }
+
+    arena = mmap(NULL, ARENA_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (arena == MAP_FAILED) {
+        dbg_at1("mmap() failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_init(&ready, NULL, 2);
+
+    thread_args.fd = fd;
+    thread_args.arena = arena;
+    status = pthread_create(&thread_args.thread_id, NULL, server_function, &thread_args);
+    if (status != 0) {
+        dbg_at1("pthread_create() failed with code %d : %s\n", status, strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(&ready);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < NUM_OF_REPETITIONS; i++) {
+        status = send_message(fd, &handle, thread_args.tid, i);
+        if (status != 0) {
+            dbg_at1("Test failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_join(thread_args.thread_id, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    microseconds = (t2.tv_sec - t1.tv_sec) * 1000000 +
+                   (t2.tv_nsec - t1.tv_nsec) / 1000;
+
+    dbg_at2("Sending %d messages through receive arena took %lu microseconds\n",
+        NUM_OF_REPETITIONS, microseconds);
+
+    pthread_barrier_destroy(&ready);
+
+    status = ioctl(fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    munmap(arena, ARENA_SIZE);
+    close(fd);
+
+    return 0;
+}
@@ -132,6 +132,7 @@ int main(int argc, char *argv[])
     int i;
     int pid = -1;
     int tid = -1;
+    const char *name = NULL;
     int ret;
     int status;
     struct stplr_version version;
@@ -144,11 +145,13 @@ int main(int argc, char *argv[])
     static struct option long_options[] = {
         {"pid", required_argument, 0, 'p'},
         {"tid", required_argument, 0, 't'},
+        {"name", required_argument, 0, 'n'},
+        {"verbose", required_argument, 0, 'v'},
         {0, 0, 0, 0}
     };
 
     for (;;) {
-        c = getopt_long(argc, argv, "p:t:", long_options, 0);
+        c = getopt_long(argc, argv, "p:t:n:v:", long_options, 0);
         if (c == -1)
             break;
 
@@ -159,6 +162,9 @@ int main(int argc, char *argv[])
             case 't':
                 tid = atoi(optarg);
                 break;
+            case 'n':
+                name = optarg;
+                break;
             case 'v':
                 debug_level = atoi(optarg);
                 break;
@@ -187,6 +193,21 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (name) {
+        struct stplr_name_open name_open = {};
+        strncpy(name_open.name, name, sizeof(name_open.name) - 1);
+
+        ret = ioctl(fd, STPLR_NAME_OPEN, &name_open);
+        if (ret < 0) {
+            dbg_at1("ioctl(STPLR_NAME_OPEN) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        pid = name_open.pid;
+        tid = name_open.tid;
+        dbg_at2("name '%s' resolved to pid: %d, tid: %d\n", name, pid, tid);
+    }
+
     ret = ioctl(fd, STPLR_HANDLE_GET, &handle);
     if (ret < 0) {
         dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
@@ -3,7 +3,10 @@
  * @file client2.c
  *
  * Small application showing basic usage of the stapler api (client side).
- * This client uses STPLR_MSG_SEND_RECEIVE ioctl to communicate with the server.
+ * This client uses STPLR_MSG_SEND_RECEIVE ioctl to communicate with the server
+ * and STPLR_MSG_SEND ioctl to send it more messages than STPLR_MSGV_INLINE.
+ * With --v2 option it uses STPLR_MSG_SEND_RECEIVE_V2 and STPLR_MSG_SEND_V2
+ * ioctls instead.
  *
  * @author Lukasz Wiecaszek <lukasz.wiecaszek@gmail.com>
  */
@@ -43,6 +46,9 @@ static int debug_level = 3;
 
 #define NUM_OF_REPETITIONS 1000
 
+/* more than STPLR_MSGV_INLINE, at most the number of the server's small receive buffers */
+#define NUM_OF_SMALL_MESSAGES 12
+
 /*===========================================================================*\
  * local types definitions
 \*===========================================================================*/
@@ -50,6 +56,7 @@ static int debug_level = 3;
 /*===========================================================================*\
  * local (internal linkage) objects definitions
 \*===========================================================================*/
+static int v2;
 
 /*===========================================================================*\
  * global (external linkage) objects definitions
@@ -64,15 +71,102 @@ static void p(const char *prefix, const struct stplr_msg *msg)
         prefix, msg->msgbuf, msg->buflen, DIV_ROUND_UP(msg->buflen, PAGE_SIZE), msg->buflen % PAGE_SIZE);
 }
 
+/*
+ * The same call through either ABI, the first @nsmsgs of @msgs are sent,
+ * the remaining ones receive the reply (if @reply_required), sizes are updated
+ * as STPLR_MSG_SEND_RECEIVE (STPLR_MSG_SEND) does.
+ */
+static int call(int fd, const struct stplr_handle *handle, int pid, int tid,
+    struct stplr_msg *msgs, uint32_t nsmsgs, uint32_t count, int reply_required)
+{
+    int ret;
+
+    if (!v2 && reply_required) {
+        struct stplr_msg_send_receive msg_send_receive = {};
+        msg_send_receive.handle = *handle;
+        msg_send_receive.pid = pid;
+        msg_send_receive.tid = tid;
+        msg_send_receive.smsgs.msgs = msgs;
+        msg_send_receive.smsgs.count = nsmsgs;
+        msg_send_receive.rmsgs.msgs = msgs + nsmsgs;
+        msg_send_receive.rmsgs.count = count - nsmsgs;
+
+        ret = ioctl(fd, STPLR_MSG_SEND_RECEIVE, &msg_send_receive);
+        if (ret < 0)
+            dbg_at1("ioctl(STPLR_MSG_SEND_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+        else
+            dbg_at3("ioctl(STPLR_MSG_SEND_RECEIVE) returned %d\n", ret);
+
+        return ret;
+    }
+
+    if (!v2) {
+        struct stplr_msg_send msg_send = {};
+        msg_send.handle = *handle;
+        msg_send.pid = pid;
+        msg_send.tid = tid;
+        msg_send.smsgs.msgs = msgs;
+        msg_send.smsgs.count = nsmsgs;
+
+        ret = ioctl(fd, STPLR_MSG_SEND, &msg_send);
+        if (ret < 0)
+            dbg_at1("ioctl(STPLR_MSG_SEND) failed with code %d : %s\n", errno, strerror(errno));
+        else
+            dbg_at3("ioctl(STPLR_MSG_SEND) returned %d\n", ret);
+
+        return ret;
+    }
+
+    /* both v2 ioctls share the layout of the messages */
+    struct stplr_msg_send_receive_v2 msg_send_receive = {};
+    struct stplr_msg_send_v2 msg_send = {};
+    struct stplr_msgv *msgv = reply_required ? &msg_send_receive.msgv : &msg_send.smsgv;
+
+    msgv->count = reply_required ? count : nsmsgs;
+    if (msgv->count > STPLR_MSGV_INLINE)
+        msgv->msgs = msgs;
+    else
+        memcpy(msgv->inline_msgs, msgs, msgv->count * sizeof(*msgs));
+
+    if (reply_required) {
+        msg_send_receive.handle = *handle;
+        msg_send_receive.pid = pid;
+        msg_send_receive.tid = tid;
+        msg_send_receive.nsmsgs = nsmsgs;
+
+        ret = ioctl(fd, STPLR_MSG_SEND_RECEIVE_V2, &msg_send_receive);
+    } else {
+        msg_send.handle = *handle;
+        msg_send.pid = pid;
+        msg_send.tid = tid;
+
+        ret = ioctl(fd, STPLR_MSG_SEND_V2, &msg_send);
+    }
+
+    if (ret < 0) {
+        dbg_at1("ioctl(%s) failed with code %d : %s\n",
+            reply_required ? "STPLR_MSG_SEND_RECEIVE_V2" : "STPLR_MSG_SEND_V2", errno, strerror(errno));
+        return ret;
+    }
+
+    dbg_at3("ioctl(%s) returned %d\n",
+        reply_required ? "STPLR_MSG_SEND_RECEIVE_V2" : "STPLR_MSG_SEND_V2", ret);
+
+    if (msgv->count <= STPLR_MSGV_INLINE)
+        memcpy(msgs, msgv->inline_msgs, msgv->count * sizeof(*msgs));
+
+    return ret;
+}
+
 static int send_message(int fd, const struct stplr_handle *handle, int pid, int tid)
 {
-    int i;
+    uint32_t i;
     int ret;
 
     char buf1[3] = {'a', 'b', 'c'};
     const uint32_t buf1len = sizeof(buf1);
 
-    static char __thread buf2[3] = {'a', 'b', 'c'};
+    static __thread char buf2[3] = {'a', 'b', 'c'};
     const uint32_t buf2len = sizeof(buf2);
 
     static char buf3[5] = {'1', '2', '3', '4', '5'};
@@ -86,52 +180,61 @@ static int send_message(int fd, const struct stplr_handle *handle, int pid, int
     }
     memcpy(buf4, "ABCDEF", MIN(buf4len, sizeof("ABCDEF")));
 
-    struct stplr_msg smsgs[] = {
+    char rbuf[1024];
+
+    /* send messages followed by the receive one */
+    struct stplr_msg msgs[] = {
         {.msgbuf = buf1, .buflen = buf1len},
         {.msgbuf = buf2, .buflen = buf2len},
         {.msgbuf = buf3, .buflen = buf3len},
         {.msgbuf = buf4, .buflen = buf4len},
+        {.msgbuf = rbuf, .buflen = sizeof(rbuf)},
     };
+    const uint32_t nsmsgs = 4;
+    const uint32_t count = sizeof(msgs)/sizeof(msgs[0]);
 
-    p("sbuf1", &smsgs[0]);
-    p("sbuf2", &smsgs[1]);
-    p("sbuf3", &smsgs[2]);
-    p("sbuf4", &smsgs[3]);
-
-    char rbuf[1024];
-    struct stplr_msg rmsgs[] = {
-        {.msgbuf = rbuf, .buflen = sizeof(rbuf)}
-    };
-
-    p("rbuf1", &rmsgs[0]);
-
-    struct stplr_msg_send_receive msg_send_receive;
-    msg_send_receive.handle = *handle;
-    msg_send_receive.pid = pid;
-    msg_send_receive.tid = tid;
-    msg_send_receive.smsgs.msgs = smsgs;
-    msg_send_receive.smsgs.count = sizeof(smsgs)/sizeof(smsgs[0]);
-    msg_send_receive.rmsgs.msgs = rmsgs;
-    msg_send_receive.rmsgs.count = sizeof(rmsgs)/sizeof(rmsgs[0]);
-
-    ret = ioctl(fd, STPLR_MSG_SEND_RECEIVE, &msg_send_receive);
-    if (ret < 0)
-        dbg_at1("ioctl() failed with code %d : %s\n", errno, strerror(errno));
-    else
-        dbg_at3("ioctl() returned %d\n", ret);
+    p("sbuf1", &msgs[0]);
+    p("sbuf2", &msgs[1]);
+    p("sbuf3", &msgs[2]);
+    p("sbuf4", &msgs[3]);
+    p("rbuf1", &msgs[4]);
 
+    ret = call(fd, handle, pid, tid, msgs, nsmsgs, count, 1);
     if (ret < 0) {
         free(buf4);
         return ret;
     }
 
-    for (i = 0; i < msg_send_receive.smsgs.count; i++)
-        dbg_at3("send message #%d consumed %u bytes\n", i, msg_send_receive.smsgs.msgs[i].buflen);
+    for (i = 0; i < nsmsgs; i++)
+        dbg_at3("send message #%u consumed %u bytes\n", i, msgs[i].buflen);
 
-    for (i = 0; i < msg_send_receive.rmsgs.count; i++)
-        dbg_at3("receive message #%d has %u bytes\n", i, msg_send_receive.smsgs.msgs[i].buflen);
+    for (; i < count; i++)
+        dbg_at3("receive message #%u has %u bytes\n", i - nsmsgs, msgs[i].buflen);
 
     free(buf4);
+
+    /* more messages than the v2 ioctls carry inline, sent oneway */
+    char small_bufs[NUM_OF_SMALL_MESSAGES][8];
+    struct stplr_msg small_msgs[NUM_OF_SMALL_MESSAGES];
+
+    for (i = 0; i < NUM_OF_SMALL_MESSAGES; i++) {
+        snprintf(small_bufs[i], sizeof(small_bufs[i]), "msg%u", i);
+        small_msgs[i].msgbuf = small_bufs[i];
+        small_msgs[i].buflen = strlen(small_bufs[i]) + 1;
+    }
+
+    ret = call(fd, handle, pid, tid, small_msgs, NUM_OF_SMALL_MESSAGES, NUM_OF_SMALL_MESSAGES, 0);
+    if (ret < 0)
+        return ret;
+
+    for (i = 0; i < NUM_OF_SMALL_MESSAGES; i++)
+        if (small_msgs[i].buflen != strlen(small_bufs[i]) + 1) {
+            dbg_at1("send message #%u consumed %u bytes instead of %zu\n",
+                i, small_msgs[i].buflen, strlen(small_bufs[i]) + 1);
+            return -1;
+        }
+
+    return 0;
 }
 
 /*===========================================================================*\
@@ -142,9 +245,9 @@ int main(int argc, char *argv[])
     int fd;
     int pid = -1;
     int tid = -1;
+    const char *name = NULL;
     int c;
     int ret;
-    int i;
     int status;
     struct stplr_version version;
     struct stplr_handle handle;
@@ -156,12 +259,14 @@ int main(int argc, char *argv[])
     static struct option long_options[] = {
         {"pid", required_argument, 0, 'p'},
         {"tid", required_argument, 0, 't'},
+        {"name", required_argument, 0, 'n'},
         {"verbose", required_argument, 0, 'v'},
+        {"v2", no_argument, 0, '2'},
         {0, 0, 0, 0}
     };
 
     for (;;) {
-        c = getopt_long(argc, argv, "p:t:v:", long_options, 0);
+        c = getopt_long(argc, argv, "p:t:n:v:2", long_options, 0);
         if (c == -1)
             break;
 
@@ -172,9 +277,15 @@ int main(int argc, char *argv[])
             case 't':
                 tid = atoi(optarg);
                 break;
+            case 'n':
+                name = optarg;
+                break;
             case 'v':
                 debug_level = atoi(optarg);
                 break;
+            case '2':
+                v2 = 1;
+                break;
         }
     }
 
@@ -200,6 +311,26 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (v2 && version.minor < 19) {
+        dbg_at1("kernel module version does not support v2 ioctls\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (name) {
+        struct stplr_name_open name_open = {};
+        strncpy(name_open.name, name, sizeof(name_open.name) - 1);
+
+        ret = ioctl(fd, STPLR_NAME_OPEN, &name_open);
+        if (ret < 0) {
+            dbg_at1("ioctl(STPLR_NAME_OPEN) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        pid = name_open.pid;
+        tid = name_open.tid;
+        dbg_at2("name '%s' resolved to pid: %d, tid: %d\n", name, pid, tid);
+    }
+
     ret = ioctl(fd, STPLR_HANDLE_GET, &handle);
     if (ret < 0) {
         dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
@@ -0,0 +1,517 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file dispatch.c
+ *
+ * Dispatch policy benchmark of the stapler module. A number of server
+ * threads take part in work stealing (STPLR_OPT_WORK_STEALING) and the first
+ * of them sets the dispatch policy (STPLR_OPT_DISPATCH). A number of client
+ * threads call the first server using STPLR_MSG_SEND_RECEIVE ioctl, so that
+ * the module chooses which of the servers actually gets each call.
+ * The benchmark reports the latency of the calls as seen by the clients
+ * and the number of last level cache misses of the whole process
+ * (if perf events are accessible, see /proc/sys/kernel/perf_event_paranoid),
+ * so the policies can be compared by running it with different --policy
+ * options.
+ *
+ * @author Lukasz Wiecaszek <lukasz.wiecaszek@gmail.com>
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "common.h"
+#include "../../stplr.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+static int debug_level = 3;
+
+#define dbg_at1(args...) do { if (debug_level >= 1) fprintf(stderr, args); } while (0)
+#define dbg_at2(args...) do { if (debug_level >= 2) fprintf(stdout, args); } while (0)
+#define dbg_at3(args...) do { if (debug_level >= 3) fprintf(stdout, args); } while (0)
+
+#define MAX_SERVERS 64
+#define MAX_CLIENTS 64
+#define DEFAULT_SERVERS 4
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_REPETITIONS 100000
+
+/* request asking the server which receives it to exit */
+#define STOP_REQUEST UINT64_MAX
+
+/*===========================================================================*\
+ * local types definitions
+\*===========================================================================*/
+struct thread_args {
+    int       thread_num;
+    pthread_t thread_id;
+    int       fd;
+    pid_t     tid;
+    int       stopped; /* 1 once the server got the stop request, 2 once joined */
+    uint64_t  served;
+};
+
+/*===========================================================================*\
+ * local (internal linkage) objects definitions
+\*===========================================================================*/
+static int num_servers = DEFAULT_SERVERS;
+static int num_clients = DEFAULT_CLIENTS;
+static int num_repetitions = DEFAULT_REPETITIONS;
+static int policy = STPLR_DISPATCH_CPU_LOCAL;
+static pid_t server_tid;
+static uint64_t *latencies;
+static pthread_barrier_t ready;
+
+static const char *policy_names[] = {
+    [STPLR_DISPATCH_NONE]         = "none",
+    [STPLR_DISPATCH_ROUND_ROBIN]  = "round-robin",
+    [STPLR_DISPATCH_LEAST_QUEUED] = "least-queued",
+    [STPLR_DISPATCH_CPU_LOCAL]    = "cpu-local",
+};
+
+/*===========================================================================*\
+ * global (external linkage) objects definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local (internal linkage) functions definitions
+\*===========================================================================*/
+static int parse_policy(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(policy_names)/sizeof(policy_names[0])); i++)
+        if (strcmp(name, policy_names[i]) == 0)
+            return i;
+
+    return -1;
+}
+
+static int set_option(int fd, const struct stplr_handle *handle, uint32_t option, uint64_t value)
+{
+    int status;
+    struct stplr_handle_option handle_option = {};
+
+    handle_option.handle = *handle;
+    handle_option.option = option;
+    handle_option.value = value;
+
+    status = ioctl(fd, STPLR_HANDLE_SET_OPTION, &handle_option);
+    if (status < 0)
+        dbg_at1("ioctl(STPLR_HANDLE_SET_OPTION) failed with code %d : %s\n", errno, strerror(errno));
+
+    return status;
+}
+
+/* counts last level cache misses of the calling thread and of the threads it creates later */
+static int open_cache_misses_counter(void)
+{
+    struct perf_event_attr attr = {};
+
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a;
+    uint64_t lb = *(const uint64_t *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static void* server_function(void *ptr)
+{
+    int status;
+    uint64_t request;
+    struct stplr_handle handle;
+    struct thread_args *args = (struct thread_args *)ptr;
+
+    status = ioctl(args->fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (set_option(args->fd, &handle, STPLR_OPT_WORK_STEALING, 1) < 0)
+        exit(EXIT_FAILURE);
+
+    if (args->thread_num == 0 && set_option(args->fd, &handle, STPLR_OPT_DISPATCH, policy) < 0)
+        exit(EXIT_FAILURE);
+
+    args->tid = gettid();
+    if (args->thread_num == 0)
+        server_tid = args->tid;
+
+    pthread_barrier_wait(&ready);
+
+    for (;;) {
+        struct stplr_msg msgs[] = {
+            {.msgbuf = &request, .buflen = sizeof(request)},
+        };
+
+        struct stplr_msg_receive msg_receive = {};
+        msg_receive.handle = handle;
+        msg_receive.rmsgs.msgs = msgs;
+        msg_receive.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
+
+        status = ioctl(args->fd, STPLR_MSG_RECEIVE, &msg_receive);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (request == STOP_REQUEST)
+            __atomic_store_n(&args->stopped, 1, __ATOMIC_RELEASE);
+        else {
+            /* reply with the request incremented by one */
+            request++;
+            args->served++;
+        }
+
+        struct stplr_msg_reply msg_reply = {};
+        msg_reply.handle = handle;
+        msg_reply.pid = msg_receive.pid;
+        msg_reply.tid = msg_receive.tid;
+        msg_reply.rmsgs.msgs = msgs;
+        msg_reply.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
+
+        status = ioctl(args->fd, STPLR_MSG_REPLY, &msg_reply);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_REPLY) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (request == STOP_REQUEST)
+            break;
+    }
+
+    status = ioctl(args->fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return NULL;
+}
+
+static int call_server(int fd, const struct stplr_handle *handle, pid_t tid, uint64_t request, uint64_t *reply)
+{
+    int status;
+
+    struct stplr_msg smsgs[] = {
+        {.msgbuf = &request, .buflen = sizeof(request)},
+    };
+
+    struct stplr_msg rmsgs[] = {
+        {.msgbuf = reply, .buflen = sizeof(*reply)},
+    };
+
+    struct stplr_msg_send_receive msg_send_receive = {};
+    msg_send_receive.handle = *handle;
+    msg_send_receive.pid = getpid();
+    msg_send_receive.tid = tid;
+    msg_send_receive.smsgs.msgs = smsgs;
+    msg_send_receive.smsgs.count = sizeof(smsgs)/sizeof(smsgs[0]);
+    msg_send_receive.rmsgs.msgs = rmsgs;
+    msg_send_receive.rmsgs.count = sizeof(rmsgs)/sizeof(rmsgs[0]);
+
+    status = ioctl(fd, STPLR_MSG_SEND_RECEIVE, &msg_send_receive);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_MSG_SEND_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+        return status;
+    }
+
+    if (rmsgs[0].buflen != sizeof(*reply)) {
+        dbg_at1("[%d] unexpected reply size %u\n", gettid(), rmsgs[0].buflen);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void* client_function(void *ptr)
+{
+    int i;
+    int status;
+    uint64_t request;
+    uint64_t reply;
+    struct stplr_handle handle;
+    struct timespec t1, t2;
+    const struct thread_args *args = (const struct thread_args *)ptr;
+    uint64_t *client_latencies = &latencies[(long)args->thread_num * num_repetitions];
+
+    status = ioctl(args->fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; i < num_repetitions; i++) {
+        request = ((uint64_t)args->thread_num << 32) | i;
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        status = call_server(args->fd, &handle, server_tid, request, &reply);
+        if (status != 0)
+            exit(EXIT_FAILURE);
+
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+
+        if (reply != request + 1) {
+            dbg_at1("[%d] unexpected reply 0x%lx to request 0x%lx\n", gettid(), reply, request);
+            exit(EXIT_FAILURE);
+        }
+
+        client_latencies[i] = (t2.tv_sec - t1.tv_sec) * 1000000000 + (t2.tv_nsec - t1.tv_nsec);
+    }
+
+    dbg_at3("[%d] sent %d messages\n", gettid(), num_repetitions);
+
+    status = ioctl(args->fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return NULL;
+}
+
+/*
+ * Each stop request is served by exactly one of the running servers, which
+ * then exits. It is joined before the next request is sent, so that its
+ * handle is released and the module no longer dispatches calls to it.
+ */
+static void stop_servers(int fd, struct thread_args *server_args)
+{
+    int i;
+    int j;
+    int status;
+    uint64_t reply;
+    struct stplr_handle handle;
+
+    status = ioctl(fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_servers; i++) {
+        for (j = 0; j < num_servers; j++)
+            if (!__atomic_load_n(&server_args[j].stopped, __ATOMIC_ACQUIRE))
+                break;
+
+        status = call_server(fd, &handle, server_args[j].tid, STOP_REQUEST, &reply);
+        if (status != 0)
+            exit(EXIT_FAILURE);
+
+        for (j = 0; j < num_servers; j++)
+            if (__atomic_load_n(&server_args[j].stopped, __ATOMIC_ACQUIRE) == 1) {
+                pthread_join(server_args[j].thread_id, NULL);
+                server_args[j].stopped = 2;
+            }
+    }
+
+    status = ioctl(fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*===========================================================================*\
+ * global (external linkage) functions definitions
+\*===========================================================================*/
+int main(int argc, char *argv[])
+{
+    int fd;
+    int perf_fd;
+    int c;
+    int i;
+    int status;
+    long total;
+    struct stplr_version version;
+    struct thread_args server_args[MAX_SERVERS] = {};
+    struct thread_args client_args[MAX_CLIENTS] = {};
+    struct timespec t1, t2;
+    uint64_t microseconds;
+    uint64_t cache_misses;
+    uint64_t sum = 0;
+
+    static struct option long_options[] = {
+        {"servers",     required_argument, 0, 's'},
+        {"clients",     required_argument, 0, 'c'},
+        {"repetitions", required_argument, 0, 'r'},
+        {"policy",      required_argument, 0, 'p'},
+        {"verbose",     required_argument, 0, 'v'},
+        {0, 0, 0, 0}
+    };
+
+    for (;;) {
+        c = getopt_long(argc, argv, "s:c:r:p:v:", long_options, 0);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 's':
+                num_servers = atoi(optarg);
+                break;
+
+            case 'c':
+                num_clients = atoi(optarg);
+                break;
+
+            case 'r':
+                num_repetitions = atoi(optarg);
+                break;
+
+            case 'p':
+                policy = parse_policy(optarg);
+                if (policy < 0) {
+                    dbg_at1("unknown policy '%s' (shall be one of: none, round-robin, least-queued, cpu-local)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'v':
+                debug_level = atoi(optarg);
+                break;
+        }
+    }
+
+    if (num_servers < 1 || num_servers > MAX_SERVERS ||
+        num_clients < 1 || num_clients > MAX_CLIENTS || num_repetitions < 1) {
+        dbg_at1("number of servers shall be in range 1..%d, number of clients in range 1..%d "
+            "and number of repetitions positive\n", MAX_SERVERS, MAX_CLIENTS);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(STPLR_DEVICENAME, O_RDWR);
+    assert(fd >= -1);
+    if (fd == -1) {
+        dbg_at1("cannot open '%s': %s\n",
+            STPLR_DEVICENAME, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_VERSION, &version);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_VERSION) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    dbg_at2("version: %d.%d.%d\n", version.major, version.minor, version.micro);
+
+    /* STPLR_OPT_DISPATCH is available since 0.13 */
+    if (version.major != STPLR_VERSION_MAJOR || version.minor < 13) {
+        dbg_at1("kernel module version does not support dispatch policies\n");
+        exit(EXIT_FAILURE);
+    }
+
+    total = (long)num_clients * num_repetitions;
+    latencies = malloc(total * sizeof(*latencies));
+    if (!latencies) {
+        dbg_at1("cannot allocate memory for %ld latencies\n", total);
+        exit(EXIT_FAILURE);
+    }
+
+    /* opened before any thread is created, so that all of them are counted */
+    perf_fd = open_cache_misses_counter();
+    if (perf_fd < 0)
+        dbg_at2("cache misses are not counted: perf_event_open() failed with code %d : %s\n",
+            errno, strerror(errno));
+
+    pthread_barrier_init(&ready, NULL, num_servers + num_clients + 1);
+
+    for (i = 0; i < num_servers; i++) {
+        server_args[i].thread_num = i;
+        server_args[i].fd = fd;
+        status = pthread_create(&server_args[i].thread_id, NULL, server_function, &server_args[i]);
+        if (status != 0) {
+            dbg_at1("pthread_create() failed with code %d : %s\n", status, strerror(status));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < num_clients; i++) {
+        client_args[i].thread_num = i;
+        client_args[i].fd = fd;
+        status = pthread_create(&client_args[i].thread_id, NULL, client_function, &client_args[i]);
+        if (status != 0) {
+            dbg_at1("pthread_create() failed with code %d : %s\n", status, strerror(status));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < num_clients; i++)
+        pthread_join(client_args[i].thread_id, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    stop_servers(fd, server_args);
+
+    microseconds = (t2.tv_sec - t1.tv_sec) * 1000000 +
+                   (t2.tv_nsec - t1.tv_nsec) / 1000;
+
+    dbg_at2("policy %s: %d clients sent %d messages each to %d servers in %lu microseconds (%.0f messages/s)\n",
+        policy_names[policy], num_clients, num_repetitions, num_servers, microseconds,
+        microseconds ? (double)total * 1000000 / microseconds : 0.0);
+
+    for (i = 0; i < num_servers; i++)
+        dbg_at3("server %d served %lu calls\n", i, server_args[i].served);
+
+    for (i = 0; i < total; i++)
+        sum += latencies[i];
+
+    qsort(latencies, total, sizeof(*latencies), compare_latencies);
+
+    dbg_at2("latency average %lu ns, p50 %lu ns, p99 %lu ns, max %lu ns\n",
+        sum / total, latencies[total / 2], latencies[total * 99 / 100], latencies[total - 1]);
+
+    if (perf_fd >= 0) {
+        if (read(perf_fd, &cache_misses, sizeof(cache_misses)) == sizeof(cache_misses))
+            dbg_at2("cache misses %lu (%.2f per call)\n",
+                cache_misses, (double)cache_misses / total);
+        close(perf_fd);
+    }
+
+    pthread_barrier_destroy(&ready);
+
+    free(latencies);
+
+    close(fd);
+
+    return 0;
+}
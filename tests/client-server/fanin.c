@@ -0,0 +1,384 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file fanin.c
+ *
+ * Fan-in benchmark of the stapler module. A number of client threads
+ * send messages using STPLR_MSG_SEND_RECEIVE ioctl to one server thread,
+ * which receives them using STPLR_MSG_RECEIVE and replies using
+ * STPLR_MSG_REPLY. As all clients queue on the same server thread,
+ * it shows the cost of cache lines shared between clients and the server
+ * (run it under 'perf c2c record' to see which of them bounce).
+ *
+ * @author Lukasz Wiecaszek <lukasz.wiecaszek@gmail.com>
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <pthread.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "common.h"
+#include "../../stplr.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+static int debug_level = 3;
+
+#define dbg_at1(args...) do { if (debug_level >= 1) fprintf(stderr, args); } while (0)
+#define dbg_at2(args...) do { if (debug_level >= 2) fprintf(stdout, args); } while (0)
+#define dbg_at3(args...) do { if (debug_level >= 3) fprintf(stdout, args); } while (0)
+
+#define MAX_CLIENTS 64
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_REPETITIONS 100000
+
+/*===========================================================================*\
+ * local types definitions
+\*===========================================================================*/
+struct thread_args {
+    int       thread_num;
+    pthread_t thread_id;
+    int       fd;
+};
+
+/*===========================================================================*\
+ * local (internal linkage) objects definitions
+\*===========================================================================*/
+static int num_clients = DEFAULT_CLIENTS;
+static int num_repetitions = DEFAULT_REPETITIONS;
+static pid_t server_tid;
+static int stats_supported;
+static int timestamps_supported;
+static pthread_barrier_t ready;
+
+/*===========================================================================*\
+ * global (external linkage) objects definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local (internal linkage) functions definitions
+\*===========================================================================*/
+/* returns the upper bound of the bucket the given percentile falls into */
+static uint64_t percentile(const struct stplr_stats_histogram *histogram, unsigned int percent)
+{
+    int b;
+    uint64_t total = 0;
+    uint64_t count = 0;
+
+    for (b = 0; b < STPLR_STATS_BUCKETS; b++)
+        total += histogram->buckets[b];
+
+    for (b = 0; b < STPLR_STATS_BUCKETS - 1; b++) {
+        count += histogram->buckets[b];
+        if (count * 100 >= total * percent)
+            break;
+    }
+
+    return 2ULL << b;
+}
+
+static void print_stats(int fd, const struct stplr_handle *handle)
+{
+    int status;
+    struct stplr_stats stats = {};
+
+    stats.handle = *handle;
+
+    status = ioctl(fd, STPLR_STATS_GET, &stats);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_STATS_GET) failed with code %d : %s\n", errno, strerror(errno));
+        return;
+    }
+
+    dbg_at2("server queue wait p50 <%lu ns, p99 <%lu ns\n",
+        percentile(&stats.histograms[STPLR_STATS_QUEUE_NS], 50),
+        percentile(&stats.histograms[STPLR_STATS_QUEUE_NS], 99));
+    dbg_at2("server copy time  p50 <%lu ns, p99 <%lu ns\n",
+        percentile(&stats.histograms[STPLR_STATS_COPY_NS], 50),
+        percentile(&stats.histograms[STPLR_STATS_COPY_NS], 99));
+    dbg_at2("server round-trip p50 <%lu ns, p99 <%lu ns\n",
+        percentile(&stats.histograms[STPLR_STATS_RTT_NS], 50),
+        percentile(&stats.histograms[STPLR_STATS_RTT_NS], 99));
+}
+
+static void* server_function(void *ptr)
+{
+    long i;
+    int status;
+    uint64_t request;
+    struct stplr_handle handle;
+    const struct thread_args *args = (const struct thread_args *)ptr;
+
+    status = ioctl(args->fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    server_tid = gettid();
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; i < (long)num_clients * num_repetitions; i++) {
+        struct stplr_msg msgs[] = {
+            {.msgbuf = &request, .buflen = sizeof(request)},
+        };
+
+        struct stplr_msg_receive msg_receive = {};
+        msg_receive.handle = handle;
+        msg_receive.rmsgs.msgs = msgs;
+        msg_receive.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
+
+        status = ioctl(args->fd, STPLR_MSG_RECEIVE, &msg_receive);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        /* reply with the request incremented by one */
+        request++;
+
+        struct stplr_msg_reply msg_reply = {};
+        msg_reply.handle = handle;
+        msg_reply.pid = msg_receive.pid;
+        msg_reply.tid = msg_receive.tid;
+        msg_reply.rmsgs.msgs = msgs;
+        msg_reply.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
+
+        status = ioctl(args->fd, STPLR_MSG_REPLY, &msg_reply);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_REPLY) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (stats_supported)
+        print_stats(args->fd, &handle);
+
+    status = ioctl(args->fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return NULL;
+}
+
+static void* client_function(void *ptr)
+{
+    int i;
+    int status;
+    uint64_t request;
+    uint64_t reply;
+    uint64_t queue_ns = 0;
+    uint64_t serve_ns = 0;
+    uint64_t copy_ns = 0;
+    struct stplr_handle handle;
+    struct stplr_timestamps timestamps = {};
+    const struct thread_args *args = (const struct thread_args *)ptr;
+
+    status = ioctl(args->fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (timestamps_supported) {
+        struct stplr_handle_option option = {};
+        option.handle = handle;
+        option.option = STPLR_OPT_TIMESTAMPS;
+        option.value = (uintptr_t)&timestamps;
+
+        status = ioctl(args->fd, STPLR_HANDLE_SET_OPTION, &option);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_HANDLE_SET_OPTION) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; i < num_repetitions; i++) {
+        request = ((uint64_t)args->thread_num << 32) | i;
+
+        struct stplr_msg smsgs[] = {
+            {.msgbuf = &request, .buflen = sizeof(request)},
+        };
+
+        struct stplr_msg rmsgs[] = {
+            {.msgbuf = &reply, .buflen = sizeof(reply)},
+        };
+
+        struct stplr_msg_send_receive msg_send_receive = {};
+        msg_send_receive.handle = handle;
+        msg_send_receive.pid = getpid();
+        msg_send_receive.tid = server_tid;
+        msg_send_receive.smsgs.msgs = smsgs;
+        msg_send_receive.smsgs.count = sizeof(smsgs)/sizeof(smsgs[0]);
+        msg_send_receive.rmsgs.msgs = rmsgs;
+        msg_send_receive.rmsgs.count = sizeof(rmsgs)/sizeof(rmsgs[0]);
+
+        status = ioctl(args->fd, STPLR_MSG_SEND_RECEIVE, &msg_send_receive);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_SEND_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (rmsgs[0].buflen != sizeof(reply) || reply != request + 1) {
+            dbg_at1("[%d] unexpected reply 0x%lx to request 0x%lx\n", gettid(), reply, request);
+            exit(EXIT_FAILURE);
+        }
+
+        queue_ns += timestamps.dequeue_ns - timestamps.enqueue_ns;
+        serve_ns += timestamps.reply_ns - timestamps.dequeue_ns;
+        copy_ns += timestamps.reply_copy_ns - timestamps.reply_ns;
+    }
+
+    dbg_at3("[%d] sent %d messages\n", gettid(), num_repetitions);
+
+    if (timestamps_supported && num_repetitions > 0)
+        dbg_at3("[%d] average time queued %lu ns, served %lu ns, reply pick up %lu ns\n", gettid(),
+            queue_ns / num_repetitions, serve_ns / num_repetitions, copy_ns / num_repetitions);
+
+    status = ioctl(args->fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return NULL;
+}
+
+/*===========================================================================*\
+ * global (external linkage) functions definitions
+\*===========================================================================*/
+int main(int argc, char *argv[])
+{
+    int fd;
+    int c;
+    int i;
+    int status;
+    struct stplr_version version;
+    struct thread_args server_args;
+    struct thread_args client_args[MAX_CLIENTS];
+    struct timespec t1, t2;
+    uint64_t microseconds;
+
+    static struct option long_options[] = {
+        {"clients",     required_argument, 0, 'c'},
+        {"repetitions", required_argument, 0, 'r'},
+        {"verbose",     required_argument, 0, 'v'},
+        {0, 0, 0, 0}
+    };
+
+    for (;;) {
+        c = getopt_long(argc, argv, "c:r:v:", long_options, 0);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'c':
+                num_clients = atoi(optarg);
+                break;
+
+            case 'r':
+                num_repetitions = atoi(optarg);
+                break;
+
+            case 'v':
+                debug_level = atoi(optarg);
+                break;
+        }
+    }
+
+    if (num_clients < 1 || num_clients > MAX_CLIENTS || num_repetitions < 1) {
+        dbg_at1("number of clients shall be in range 1..%d and number of repetitions positive\n", MAX_CLIENTS);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(STPLR_DEVICENAME, O_RDWR);
+    assert(fd >= -1);
+    if (fd == -1) {
+        dbg_at1("cannot open '%s': %s\n",
+            STPLR_DEVICENAME, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_VERSION, &version);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_VERSION) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    dbg_at2("version: %d.%d.%d\n", version.major, version.minor, version.micro);
+
+    if (version.major != STPLR_VERSION_MAJOR) {
+        dbg_at1("kernel module version is not supported\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* STPLR_STATS_GET is available since 0.9, STPLR_OPT_TIMESTAMPS since 0.10 */
+    stats_supported = version.minor >= 9;
+    timestamps_supported = version.minor >= 10;
+
+    pthread_barrier_init(&ready, NULL, num_clients + 2);
+
+    server_args.thread_num = 0;
+    server_args.fd = fd;
+    status = pthread_create(&server_args.thread_id, NULL, server_function, &server_args);
+    if (status != 0) {
+        dbg_at1("pthread_create() failed with code %d : %s\n", status, strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_clients; i++) {
+        client_args[i].thread_num = i;
+        client_args[i].fd = fd;
+        status = pthread_create(&client_args[i].thread_id, NULL, client_function, &client_args[i]);
+        if (status != 0) {
+            dbg_at1("pthread_create() failed with code %d : %s\n", status, strerror(status));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < num_clients; i++)
+        pthread_join(client_args[i].thread_id, NULL);
+
+    pthread_join(server_args.thread_id, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    microseconds = (t2.tv_sec - t1.tv_sec) * 1000000 +
+                   (t2.tv_nsec - t1.tv_nsec) / 1000;
+
+    dbg_at2("%d clients sent %d messages each in %lu microseconds (%.0f messages/s)\n",
+        num_clients, num_repetitions, microseconds,
+        microseconds ? (double)num_clients * num_repetitions * 1000000 / microseconds : 0.0);
+
+    pthread_barrier_destroy(&ready);
+
+    close(fd);
+
+    return 0;
+}
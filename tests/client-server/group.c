@@ -0,0 +1,286 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file group.c
+ *
+ * Small application showing usage of the stapler subscriber groups.
+ * A number of subscriber threads joins one group and the main thread posts
+ * messages to all of them at once using STPLR_MSG_POST ioctl.
+ *
+ * @author Lukasz Wiecaszek <lukasz.wiecaszek@gmail.com>
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <pthread.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "common.h"
+#include "../../stplr.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+static int debug_level = 3;
+
+#define dbg_at1(args...) do { if (debug_level >= 1) fprintf(stderr, args); } while (0)
+#define dbg_at2(args...) do { if (debug_level >= 2) fprintf(stdout, args); } while (0)
+#define dbg_at3(args...) do { if (debug_level >= 3) fprintf(stdout, args); } while (0)
+
+#define NUM_SUBSCRIBERS 4
+#define NUM_OF_REPETITIONS 1000
+
+/*===========================================================================*\
+ * local types definitions
+\*===========================================================================*/
+struct thread_args {
+    int       thread_num;
+    pthread_t thread_id;
+    int       fd;
+    uint32_t  gid;
+};
+
+/*===========================================================================*\
+ * local (internal linkage) objects definitions
+\*===========================================================================*/
+static pthread_barrier_t subscribed;
+
+/*===========================================================================*\
+ * global (external linkage) objects definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local (internal linkage) functions definitions
+\*===========================================================================*/
+static void* subscriber_function(void *ptr)
+{
+    int i;
+    int status;
+    uint64_t sequence;
+    struct stplr_handle handle;
+    struct stplr_group_subscription subscription = {};
+    const struct thread_args *args = (const struct thread_args *)ptr;
+
+    status = ioctl(args->fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    subscription.handle = handle;
+    subscription.gid = args->gid;
+
+    status = ioctl(args->fd, STPLR_GROUP_SUBSCRIBE, &subscription);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_GROUP_SUBSCRIBE) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(&subscribed);
+
+    for (i = 0; i < NUM_OF_REPETITIONS; i++) {
+        struct stplr_msg msgs[] = {
+            {.msgbuf = &sequence, .buflen = sizeof(sequence)},
+        };
+
+        struct stplr_msg_receive msg_receive = {};
+        msg_receive.handle = handle;
+        msg_receive.rmsgs.msgs = msgs;
+        msg_receive.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
+
+        status = ioctl(args->fd, STPLR_MSG_RECEIVE, &msg_receive);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_MSG_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (msgs[0].buflen != sizeof(sequence) || sequence != (uint64_t)i || msg_receive.reply_required) {
+            dbg_at1("[%d] unexpected post #%lu (expected #%d, size: %u)\n",
+                gettid(), sequence, i, msgs[0].buflen);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    dbg_at3("[%d] received %d posts\n", gettid(), NUM_OF_REPETITIONS);
+
+    status = ioctl(args->fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return NULL;
+}
+
+static int post_message(int fd, const struct stplr_handle *handle, uint32_t gid, uint64_t sequence)
+{
+    int ret;
+
+    /* static storage as the NOWAIT post keeps the buffer pinned after return */
+    static uint64_t sequences[NUM_OF_REPETITIONS];
+    sequences[sequence] = sequence;
+
+    struct stplr_msg smsgs[] = {
+        {.msgbuf = &sequences[sequence], .buflen = sizeof(sequences[sequence])},
+    };
+
+    struct stplr_msg_post msg_post = {};
+    msg_post.handle = *handle;
+    msg_post.gid = gid;
+    msg_post.flags = sequence % 2 ? STPLR_MSG_POST_F_NOWAIT : 0;
+    msg_post.smsgs.msgs = smsgs;
+    msg_post.smsgs.count = sizeof(smsgs)/sizeof(smsgs[0]);
+
+    ret = ioctl(fd, STPLR_MSG_POST, &msg_post);
+    if (ret < 0) {
+        dbg_at1("ioctl(STPLR_MSG_POST) failed with code %d : %s\n", errno, strerror(errno));
+        return ret;
+    }
+
+    if (ret != NUM_SUBSCRIBERS) {
+        dbg_at1("post #%lu delivered to %d subscriber(s) (expected %d)\n",
+            sequence, ret, NUM_SUBSCRIBERS);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*===========================================================================*\
+ * global (external linkage) functions definitions
+\*===========================================================================*/
+int main(int argc, char *argv[])
+{
+    int fd;
+    int c;
+    int i;
+    int status;
+    struct stplr_version version;
+    struct stplr_handle handle;
+    struct stplr_group group;
+    struct thread_args thread_args[NUM_SUBSCRIBERS];
+    struct timespec t1, t2;
+    uint64_t microseconds;
+
+    static struct option long_options[] = {
+        {"verbose", required_argument, 0, 'v'},
+        {0, 0, 0, 0}
+    };
+
+    for (;;) {
+        c = getopt_long(argc, argv, "v:", long_options, 0);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'v':
+                debug_level = atoi(optarg);
+                break;
+        }
+    }
+
+    fd = open(STPLR_DEVICENAME, O_RDWR);
+    assert(fd >= -1);
+    if (fd == -1) {
+        dbg_at1("cannot open '%s': %s\n",
+            STPLR_DEVICENAME, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_VERSION, &version);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_VERSION) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    dbg_at2("version: %d.%d.%d\n", version.major, version.minor, version.micro);
+
+    if (version.major != STPLR_VERSION_MAJOR || version.minor < 1) {
+        dbg_at1("kernel module version does not support subscriber groups\n");
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_HANDLE_GET, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_GET) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_GROUP_CREATE, &group);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_GROUP_CREATE) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    dbg_at2("group %u created\n", group.gid);
+
+    pthread_barrier_init(&subscribed, NULL, NUM_SUBSCRIBERS + 1);
+
+    for (i = 0; i < NUM_SUBSCRIBERS; i++) {
+        thread_args[i].thread_num = i;
+        thread_args[i].fd = fd;
+        thread_args[i].gid = group.gid;
+        status = pthread_create(&thread_args[i].thread_id, NULL, subscriber_function, &thread_args[i]);
+        if (status != 0) {
+            dbg_at1("pthread_create() failed with code %d : %s\n", status, strerror(status));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&subscribed);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < NUM_OF_REPETITIONS; i++) {
+        status = post_message(fd, &handle, group.gid, i);
+        if (status != 0) {
+            dbg_at1("Test failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < NUM_SUBSCRIBERS; i++)
+        pthread_join(thread_args[i].thread_id, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    microseconds = (t2.tv_sec - t1.tv_sec) * 1000000 +
+                   (t2.tv_nsec - t1.tv_nsec) / 1000;
+
+    dbg_at2("Posting %d messages to %d subscribers took %lu microseconds\n",
+        NUM_OF_REPETITIONS, NUM_SUBSCRIBERS, microseconds);
+
+    pthread_barrier_destroy(&subscribed);
+
+    status = ioctl(fd, STPLR_GROUP_DESTROY, &group);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_GROUP_DESTROY) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    status = ioctl(fd, STPLR_HANDLE_PUT, &handle);
+    if (status < 0) {
+        dbg_at1("ioctl(STPLR_HANDLE_PUT) failed with code %d : %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    close(fd);
+
+    return 0;
+}
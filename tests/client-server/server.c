@@ -3,6 +3,8 @@
  * @file server.c
  *
  * Small application showing basic usage of the stapler api (server side).
+ * With --v2 option it uses STPLR_MSG_RECEIVE_V2 and STPLR_MSG_REPLY_V2 ioctls
+ * instead of STPLR_MSG_RECEIVE and STPLR_MSG_REPLY.
  *
  * @author Lukasz Wiecaszek <lukasz.wiecaszek@gmail.com>
  */
@@ -42,6 +44,10 @@ static int debug_level = 3;
 
 #define NUM_THREADS 1
 
+/* small receive buffers following the four above, so that more than STPLR_MSGV_INLINE messages fit */
+#define NUM_OF_SMALL_BUFFERS 12
+#define SMALL_BUFFER_SIZE 16
+
 /*===========================================================================*\
  * local types definitions
 \*===========================================================================*/
@@ -49,11 +55,13 @@ struct thread_args {
     int       thread_num;
     pthread_t thread_id;
     int       fd;
+    const char *name;
 };
 
 /*===========================================================================*\
  * local (internal linkage) objects definitions
 \*===========================================================================*/
+static int v2;
 
 /*===========================================================================*\
  * global (external linkage) objects definitions
@@ -68,9 +76,110 @@ static void p(const char *prefix, const struct stplr_msg *msg)
         gettid(), prefix, msg->msgbuf, msg->buflen, DIV_ROUND_UP(msg->buflen, PAGE_SIZE), msg->buflen % PAGE_SIZE);
 }
 
+/* the same receive through either ABI, updates @msgs and @count as STPLR_MSG_RECEIVE does */
+static int receive(int fd, const struct stplr_handle *handle, struct stplr_msg *msgs, uint32_t *count,
+    int *pid, int *tid, int *reply_required)
+{
+    int ret;
+
+    if (!v2) {
+        struct stplr_msg_receive msg_receive = {};
+        msg_receive.handle = *handle;
+        msg_receive.rmsgs.msgs = msgs;
+        msg_receive.rmsgs.count = *count;
+
+        ret = ioctl(fd, STPLR_MSG_RECEIVE, &msg_receive);
+        if (ret < 0) {
+            dbg_at1("ioctl(STPLR_MSG_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
+            return ret;
+        }
+
+        dbg_at3("ioctl(STPLR_MSG_RECEIVE) returned %d\n", ret);
+
+        *count = msg_receive.rmsgs.count;
+        *pid = msg_receive.pid;
+        *tid = msg_receive.tid;
+        *reply_required = msg_receive.reply_required;
+        return 0;
+    }
+
+    struct stplr_msg_receive_v2 msg_receive = {};
+    msg_receive.handle = *handle;
+    msg_receive.rmsgv.count = *count;
+    if (*count > STPLR_MSGV_INLINE)
+        msg_receive.rmsgv.msgs = msgs;
+    else
+        memcpy(msg_receive.rmsgv.inline_msgs, msgs, *count * sizeof(*msgs));
+
+    ret = ioctl(fd, STPLR_MSG_RECEIVE_V2, &msg_receive);
+    if (ret < 0) {
+        dbg_at1("ioctl(STPLR_MSG_RECEIVE_V2) failed with code %d : %s\n", errno, strerror(errno));
+        return ret;
+    }
+
+    dbg_at3("ioctl(STPLR_MSG_RECEIVE_V2) returned %d\n", ret);
+
+    if (*count <= STPLR_MSGV_INLINE)
+        memcpy(msgs, msg_receive.rmsgv.inline_msgs, *count * sizeof(*msgs));
+
+    *count = msg_receive.rmsgv.count;
+    *pid = msg_receive.pid;
+    *tid = msg_receive.tid;
+    *reply_required = msg_receive.reply_required;
+    return 0;
+}
+
+/* the same reply through either ABI, updates @msgs as STPLR_MSG_REPLY does */
+static int reply(int fd, const struct stplr_handle *handle, int pid, int tid, struct stplr_msg *msgs, uint32_t count)
+{
+    int ret;
+
+    if (!v2) {
+        struct stplr_msg_reply msg_reply = {};
+        msg_reply.handle = *handle;
+        msg_reply.pid = pid;
+        msg_reply.tid = tid;
+        msg_reply.rmsgs.msgs = msgs;
+        msg_reply.rmsgs.count = count;
+
+        ret = ioctl(fd, STPLR_MSG_REPLY, &msg_reply);
+        if (ret < 0)
+            dbg_at1("ioctl(STPLR_MSG_REPLY) failed with code %d : %s\n", errno, strerror(errno));
+        else
+            dbg_at3("ioctl(STPLR_MSG_REPLY) returned %d\n", ret);
+
+        return ret;
+    }
+
+    struct stplr_msg_reply_v2 msg_reply = {};
+    msg_reply.handle = *handle;
+    msg_reply.pid = pid;
+    msg_reply.tid = tid;
+    msg_reply.rmsgv.count = count;
+    if (count > STPLR_MSGV_INLINE)
+        msg_reply.rmsgv.msgs = msgs;
+    else
+        memcpy(msg_reply.rmsgv.inline_msgs, msgs, count * sizeof(*msgs));
+
+    ret = ioctl(fd, STPLR_MSG_REPLY_V2, &msg_reply);
+    if (ret < 0) {
+        dbg_at1("ioctl(STPLR_MSG_REPLY_V2) failed with code %d : %s\n", errno, strerror(errno));
+        return ret;
+    }
+
+    dbg_at3("ioctl(STPLR_MSG_REPLY_V2) returned %d\n", ret);
+
+    if (count <= STPLR_MSGV_INLINE)
+        memcpy(msgs, msg_reply.rmsgv.inline_msgs, count * sizeof(*msgs));
+
+    return ret;
+}
+
 static int msg_receive(int fd, int thread_num, const struct stplr_handle *handle, int* pid, int* tid, int *reply_required)
 {
-    int i, j;
+    uint32_t i, j;
+    uint32_t count;
+    int rpid, rtid, rreply_required;
 
     char buf1[1]; /* 1 page on stack */
     const uint32_t buf1len = sizeof(buf1);
@@ -93,65 +202,64 @@ static int msg_receive(int fd, int thread_num, const struct stplr_handle *handle
     }
     memset(buf4, 0, buf4len);
 
-    struct stplr_msg msgs[] = {
+    static __thread char small_bufs[NUM_OF_SMALL_BUFFERS][SMALL_BUFFER_SIZE];
+    memset(small_bufs, 0, sizeof(small_bufs));
+
+    struct stplr_msg msgs[4 + NUM_OF_SMALL_BUFFERS] = {
         {.msgbuf = buf1, .buflen = buf1len},
         {.msgbuf = buf2, .buflen = buf2len},
         {.msgbuf = buf3, .buflen = buf3len},
         {.msgbuf = buf4, .buflen = buf4len},
     };
 
+    for (i = 0; i < NUM_OF_SMALL_BUFFERS; i++) {
+        msgs[4 + i].msgbuf = small_bufs[i];
+        msgs[4 + i].buflen = SMALL_BUFFER_SIZE;
+    }
+
     p("buf1", &msgs[0]);
     p("buf2", &msgs[1]);
     p("buf3", &msgs[2]);
     p("buf4", &msgs[3]);
 
-    struct stplr_msg_receive msg_receive = {};
-    msg_receive.handle = *handle;
-    msg_receive.rmsgs.msgs = msgs;
-    msg_receive.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
-
     dbg_at3("[%d] waiting for a messages ...\n", gettid());
 
-    int ret = ioctl(fd, STPLR_MSG_RECEIVE, &msg_receive);
-    if (ret < 0)
-        dbg_at1("ioctl(STPLR_MSG_RECEIVE) failed with code %d : %s\n", errno, strerror(errno));
-    else
-        dbg_at3("ioctl(STPLR_MSG_RECEIVE) returned %d\n", ret);
-
+    count = sizeof(msgs)/sizeof(msgs[0]);
+    int ret = receive(fd, handle, msgs, &count, &rpid, &rtid, &rreply_required);
     if (ret < 0) {
         free(buf4);
         return ret;
     }
 
     dbg_at3("[%d] received %u message(s) from pid: %d, tid: %d, reply_required: %d\n",
-        gettid(), msg_receive.rmsgs.count, msg_receive.pid, msg_receive.tid, msg_receive.reply_required);
+        gettid(), count, rpid, rtid, rreply_required);
 
-    for (i = 0; i < msg_receive.rmsgs.count; i++) {
-        uint8_t *p = msg_receive.rmsgs.msgs[i].msgbuf;
-        dbg_at3("message #%d size: %u '%s' ", i, msg_receive.rmsgs.msgs[i].buflen, (char*)p);
-        for (j = 0; j < msg_receive.rmsgs.msgs[i].buflen; j++) {
+    for (i = 0; i < count; i++) {
+        uint8_t *p = msgs[i].msgbuf;
+        dbg_at3("message #%u size: %u '%.*s' ", i, msgs[i].buflen, (int)msgs[i].buflen, (char*)p);
+        for (j = 0; j < msgs[i].buflen; j++) {
             dbg_at3("0x%02x ", p[j]);
         }
         dbg_at3("\n");
     }
 
     if (pid)
-        *pid = msg_receive.pid;
+        *pid = rpid;
 
     if (tid)
-        *tid = msg_receive.tid;
+        *tid = rtid;
 
     if (reply_required)
-        *reply_required = msg_receive.reply_required;
+        *reply_required = rreply_required;
 
     free(buf4);
 
     return 0;
 }
 
-static int msg_reply(int fd, int thread_num, const struct stplr_handle *handle, int pid, int tid)
+static int msg_reply(int fd, const struct stplr_handle *handle, int pid, int tid)
 {
-    int i;
+    uint32_t i;
 
     char buf1[1]; /* 1 page on stack */
     const uint32_t buf1len = sizeof(buf1);
@@ -185,28 +293,16 @@ static int msg_reply(int fd, int thread_num, const struct stplr_handle *handle,
     p("buf3", &msgs[2]);
     p("buf4", &msgs[3]);
 
-    struct stplr_msg_reply msg_reply = {};
-    msg_reply.handle = *handle;
-    msg_reply.pid = pid;
-    msg_reply.tid = tid;
-    msg_reply.rmsgs.msgs = msgs;
-    msg_reply.rmsgs.count = sizeof(msgs)/sizeof(msgs[0]);
-
     dbg_at3("replying to pid: %d, tid: %d\n", pid, tid);
 
-    int ret = ioctl(fd, STPLR_MSG_REPLY, &msg_reply);
-    if (ret < 0)
-        dbg_at1("ioctl(STPLR_MSG_REPLY) failed with code %d : %s\n", errno, strerror(errno));
-    else
-        dbg_at3("ioctl(STPLR_MSG_REPLY) returned %d\n", ret);
-
+    int ret = reply(fd, handle, pid, tid, msgs, sizeof(msgs)/sizeof(msgs[0]));
     if (ret < 0) {
         free(buf4);
         return ret;
     }
 
-    for (i = 0; i < msg_reply.rmsgs.count; i++)
-        dbg_at3("message #%d consumed %u bytes\n", i, msg_reply.rmsgs.msgs[i].buflen);
+    for (i = 0; i < sizeof(msgs)/sizeof(msgs[0]); i++)
+        dbg_at3("message #%u consumed %u bytes\n", i, msgs[i].buflen);
 
     free(buf4);
 
@@ -229,13 +325,27 @@ static void* server_function(void *ptr)
         exit(EXIT_FAILURE);
     }
 
+    if (args->name) {
+        struct stplr_name_attach name_attach = {};
+        name_attach.handle = handle;
+        strncpy(name_attach.name, args->name, sizeof(name_attach.name) - 1);
+
+        status = ioctl(args->fd, STPLR_NAME_ATTACH, &name_attach);
+        if (status < 0) {
+            dbg_at1("ioctl(STPLR_NAME_ATTACH) failed with code %d : %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        dbg_at2("thread %d attached name '%s'\n", gettid(), name_attach.name);
+    }
+
     for (;;) {
         int ret = msg_receive(args->fd, args->thread_num, &handle, &pid, &tid, &reply_required);
         if (ret != 0)
             break;
         dbg_at3("reply_required: %d\n", reply_required);
         if (reply_required)
-            msg_reply(args->fd, args->thread_num, &handle, pid, tid);
+            msg_reply(args->fd, &handle, pid, tid);
     }
 
     status = ioctl(args->fd, STPLR_HANDLE_PUT, &handle);
@@ -245,6 +355,8 @@ static void* server_function(void *ptr)
     }
 
     dbg_at2("terminating thread %d\n", gettid());
+
+    return NULL;
 }
 
 /*===========================================================================*\
@@ -256,6 +368,7 @@ int main(int argc, char *argv[])
     int i;
     int c;
     int status;
+    const char *name = NULL;
     struct stplr_version version;
     struct thread_args thread_args[NUM_THREADS];
     pthread_attr_t thread_attrs;
@@ -263,19 +376,27 @@ int main(int argc, char *argv[])
     static struct option long_options[] = {
         {"pid", required_argument, 0, 'p'},
         {"tid", required_argument, 0, 't'},
+        {"name", required_argument, 0, 'n'},
         {"verbose", required_argument, 0, 'v'},
+        {"v2", no_argument, 0, '2'},
         {0, 0, 0, 0}
     };
 
     for (;;) {
-        c = getopt_long(argc, argv, "v:", long_options, 0);
+        c = getopt_long(argc, argv, "n:v:2", long_options, 0);
         if (c == -1)
             break;
 
         switch (c) {
+            case 'n':
+                name = optarg;
+                break;
             case 'v':
                 debug_level = atoi(optarg);
                 break;
+            case '2':
+                v2 = 1;
+                break;
         }
     }
 
@@ -304,6 +425,11 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (v2 && version.minor < 19) {
+        dbg_at1("kernel module version does not support v2 ioctls\n");
+        exit(EXIT_FAILURE);
+    }
+
     status = pthread_attr_init(&thread_attrs);
     if (status != 0) {
         dbg_at1("pthread_attr_init() failed with code %d : %s\n",
@@ -314,6 +440,7 @@ int main(int argc, char *argv[])
     for (i = 0; i < NUM_THREADS; i++) {
         thread_args[i].thread_num = i;
         thread_args[i].fd = fd;
+        thread_args[i].name = i == 0 ? name : NULL;
         status = pthread_create(&thread_args[i].thread_id, &thread_attrs, server_function, &thread_args[i]);
         if (status != 0) {
             dbg_at1("pthread_create() failed with code %d : %s\n",